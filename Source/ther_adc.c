@@ -6,6 +6,7 @@
 #include "ther_uart.h"
 #include "ther_uart_comm.h"
 
+#include "thermometer.h"
 #include "ther_adc.h"
 
 #define MODULE "[ADC] "
@@ -19,63 +20,81 @@
 #define HAL_ADC_DEC_512     0x30    /* Decimate by 512 : 14-bit resolution */
 #define HAL_ADC_DEC_BITS    0x30    /* Bits [5:4] */
 
-unsigned short read_adc(unsigned char channel, unsigned char resolution, unsigned char vref)
-{
-	int16  reading = 0;
-	uint8   i, resbits;
-	uint8  adcChannel = 1;
+/* internal reference of HAL_ADC_REF_125V */
+#define ADC_INTERNAL_REF_MV 1240
+
+/*
+ * offset/gain self-calibration, redone when VDD or the die temp drift
+ * more than this since the last one
+ */
+#define ADC_CAL_VDD_DRIFT   50      /* mV */
+#define ADC_CAL_TEMP_DRIFT  20      /* 12-bit codes of the die temp sensor, about 5 du */
+#define ADC_CAL_TEMP_CHECK_TIME 60000 /* ms, the die temp is read at most this often */
+#define ADC_CAL_SAMPLES     4
+#define ADC_CAL_GAIN_SHIFT  14
+#define ADC_14BIT_MAX       8191
+
+struct adc_cal {
+	bool valid;
+	unsigned char vref;
+	unsigned short offset; /* 14-bit */
+	unsigned short gain; /* 1 << ADC_CAL_GAIN_SHIFT is 1.0 */
+
+	/* at the last calibration */
+	unsigned short vdd; /* mV */
+	unsigned short die_temp;
+
+	unsigned long temp_check_time; /* ms */
+};
+
+struct ther_adc {
+	unsigned char task_id;
 
 	/*
-	* If Analog input channel is AIN0..AIN7, make sure corresponing P0 I/O pin is enabled.  The code
-	* does NOT disable the pin at the end of this function.  I think it is better to leave the pin
-	* enabled because the results will be more accurate.  Because of the inherent capacitance on the
-	* pin, it takes time for the voltage on the pin to charge up to its steady-state level.  If
-	* HalAdcRead() has to turn on the pin for every conversion, the results may show a lower voltage
-	* than actuality because the pin did not have time to fully charge.
-	*/
-	if (channel <= HAL_ADC_CHANNEL_7)
-	{
-		for (i=0; i < channel; i++)
-		{
-			adcChannel <<= 1;
-		}
+	 * async conversions, one after the other from the isr:
+	 *   busy: from the start until the result is delivered
+	 *   converting: from the start until the isr has the last one
+	 */
+	bool busy;
+	volatile bool converting;
+	unsigned char first, last;
+	unsigned char channel; /* converting now */
+	unsigned char resolution;
+	unsigned char vref;
+	unsigned short *buf; /* ADCH:ADCL until delivered */
+	unsigned char n;
+	volatile unsigned char count;
+	unsigned short single; /* buf of read_adc_async() */
+	void (*callback)(unsigned char channel, unsigned short adc_val);
+	void (*sequence_callback)(unsigned char n);
 
-		/* Enable channel */
-		ADCCFG |= adcChannel;
-	}
+	unsigned short vdd_last; /* mV, from the last read_vdd() */
+	struct adc_cal cal;
+};
+static struct ther_adc ther_adc;
 
+static uint8 adc_get_decimation(unsigned char resolution)
+{
 	/* Convert resolution to decimation rate */
 	switch (resolution)
 	{
 		case HAL_ADC_RESOLUTION_8:
-			resbits = HAL_ADC_DEC_064;
-			break;
+			return HAL_ADC_DEC_064;
 		case HAL_ADC_RESOLUTION_10:
-			resbits = HAL_ADC_DEC_128;
-			break;
+			return HAL_ADC_DEC_128;
 		case HAL_ADC_RESOLUTION_12:
-			resbits = HAL_ADC_DEC_256;
-			break;
+			return HAL_ADC_DEC_256;
 		case HAL_ADC_RESOLUTION_14:
 		default:
-			resbits = HAL_ADC_DEC_512;
-			break;
+			return HAL_ADC_DEC_512;
 	}
+}
 
-	/* writing to this register starts the extra conversion */
-	ADCCON3 = channel | resbits | vref;
-
-	/* Wait for the conversion to be done */
-	while (!(ADCCON1 & HAL_ADC_EOC));
-
-	/* Disable channel after done conversion */
-	if (channel <= HAL_ADC_CHANNEL_7)
-		ADCCFG &= (adcChannel ^ 0xFF);
-
-	/* Read the result */
-	reading = (int16) (ADCL);
-	reading |= (int16) (ADCH << 8);
-
+/*
+ * reading is the left justified value of ADCH:ADCL
+ */
+static uint16 adc_scale_reading(int16 reading, unsigned char resolution)
+{
 	/* Treat small negative as 0 */
 	if (reading < 0)
 		reading = 0;
@@ -96,5 +115,324 @@ unsigned short read_adc(unsigned char channel, unsigned char resolution, unsigne
 			reading >>= 2;
 			break;
 	}
+
 	return ((uint16)reading);
 }
+
+static void adc_start_conversion(unsigned char channel, unsigned char resolution, unsigned char vref)
+{
+	/*
+	* If Analog input channel is AIN0..AIN7, make sure corresponing P0 I/O pin is enabled.  The code
+	* does NOT disable the pin at the end of this function.  I think it is better to leave the pin
+	* enabled because the results will be more accurate.  Because of the inherent capacitance on the
+	* pin, it takes time for the voltage on the pin to charge up to its steady-state level.  If
+	* HalAdcRead() has to turn on the pin for every conversion, the results may show a lower voltage
+	* than actuality because the pin did not have time to fully charge.
+	*/
+	if (channel <= HAL_ADC_CHANNEL_7)
+	{
+		/* Enable channel */
+		ADCCFG |= BV(channel);
+	}
+
+	/* writing to this register starts the extra conversion */
+	ADCCON3 = channel | adc_get_decimation(resolution) | vref;
+}
+
+static int16 adc_end_conversion(unsigned char channel)
+{
+	int16 reading;
+
+	/* Disable channel after done conversion */
+	if (channel <= HAL_ADC_CHANNEL_7)
+		ADCCFG &= (BV(channel) ^ 0xFF);
+
+	/* Read the result */
+	reading = (int16) (ADCL);
+	reading |= (int16) (ADCH << 8);
+
+	return reading;
+}
+
+unsigned short read_adc(unsigned char channel, unsigned char resolution, unsigned char vref)
+{
+	/* wait for the async conversions, they own the ADC until the last isr */
+	while (ther_adc.converting);
+
+	adc_start_conversion(channel, resolution, vref);
+
+	/* Wait for the conversion to be done */
+	while (!(ADCCON1 & HAL_ADC_EOC));
+
+	return adc_scale_reading(adc_end_conversion(channel), resolution);
+}
+
+/*
+ * VDD in mV, from VDD/3 against the internal reference
+ */
+unsigned short read_vdd(void)
+{
+	unsigned long adc_val;
+
+	/* 12 bits: 2047 => ADC_INTERNAL_REF_MV */
+	adc_val = read_adc(HAL_ADC_CHN_VDD3, HAL_ADC_RESOLUTION_12, HAL_ADC_REF_125V);
+
+	ther_adc.vdd_last = (unsigned short)(adc_val * 3 * ADC_INTERNAL_REF_MV / 2047);
+
+	return ther_adc.vdd_last;
+}
+
+/*
+ * die temp sensor, 12 bits against the internal reference
+ */
+static unsigned short read_die_temp(void)
+{
+	unsigned short adc_val;
+
+	/* connect the temp sensor to the ADC */
+	TR0 |= 0x01;
+	ATEST = 0x01;
+
+	adc_val = read_adc(HAL_ADC_CHN_TEMP, HAL_ADC_RESOLUTION_12, HAL_ADC_REF_125V);
+
+	ATEST = 0x00;
+	TR0 &= ~0x01;
+
+	return adc_val;
+}
+
+static unsigned short read_adc_avg(unsigned char channel, unsigned char vref)
+{
+	unsigned long sum = 0;
+	unsigned char i;
+
+	for (i = 0; i < ADC_CAL_SAMPLES; i++)
+		sum += read_adc(channel, HAL_ADC_RESOLUTION_14, vref);
+
+	return (unsigned short)(sum / ADC_CAL_SAMPLES);
+}
+
+/*
+ * GND gives the offset, the reference itself gives the full scale
+ */
+static void adc_calibrate(unsigned char vref, unsigned short die_temp)
+{
+	struct adc_cal *cal = &ther_adc.cal;
+	unsigned short offset, full;
+
+	offset = read_adc_avg(HAL_ADC_CHN_GND, vref);
+	full = read_adc_avg(HAL_ADC_CHN_VREF, vref);
+
+	cal->vref = vref;
+	cal->vdd = ther_adc.vdd_last;
+	cal->die_temp = die_temp;
+
+	/* a gain above 2 means the reference is not there */
+	if (full <= offset || full - offset < ADC_14BIT_MAX / 2) {
+		print(LOG_WRANING, MODULE "cal failed, gnd %d, ref %d\r\n", offset, full);
+		cal->valid = FALSE;
+		return;
+	}
+
+	cal->offset = offset;
+	cal->gain = (unsigned short)(((unsigned long)ADC_14BIT_MAX << ADC_CAL_GAIN_SHIFT) / (full - offset));
+	cal->valid = TRUE;
+
+	print(LOG_INFO, MODULE "cal: offset %d, gain %d/%d, vdd %d mV\r\n",
+			cal->offset, cal->gain, 1 << ADC_CAL_GAIN_SHIFT, cal->vdd);
+}
+
+/*
+ * Redo the calibration for vref if VDD or the die temp have drifted.
+ * VDD comes from the last read_vdd(), which is done every measurement
+ * anyway, the die temp is only read every ADC_CAL_TEMP_CHECK_TIME, so
+ * this costs nothing most of the time.
+ *
+ * The reference must be up, e.g. the temp LDO for HAL_ADC_REF_AIN7.
+ */
+void adc_cal_update(unsigned char vref)
+{
+	struct adc_cal *cal = &ther_adc.cal;
+	unsigned long now = osal_GetSystemClock();
+	unsigned short vdd = ther_adc.vdd_last;
+	unsigned short die_temp;
+
+	if (cal->valid && cal->vref == vref) {
+		if (vdd == 0 || (vdd > cal->vdd ? vdd - cal->vdd : cal->vdd - vdd) <= ADC_CAL_VDD_DRIFT) {
+			if (now - cal->temp_check_time < ADC_CAL_TEMP_CHECK_TIME)
+				return;
+
+			cal->temp_check_time = now;
+			die_temp = read_die_temp();
+			if ((die_temp > cal->die_temp ? die_temp - cal->die_temp : cal->die_temp - die_temp) <= ADC_CAL_TEMP_DRIFT)
+				return;
+
+			adc_calibrate(vref, die_temp);
+			return;
+		}
+	}
+
+	cal->temp_check_time = now;
+	adc_calibrate(vref, read_die_temp());
+}
+
+/*
+ * 14-bit reading => corrected 14-bit reading
+ */
+unsigned short adc_cal_apply(unsigned short adc_val)
+{
+	struct adc_cal *cal = &ther_adc.cal;
+	unsigned long val;
+
+	if (!cal->valid)
+		return adc_val;
+
+	if (adc_val <= cal->offset)
+		return 0;
+
+	val = ((unsigned long)(adc_val - cal->offset) * cal->gain) >> ADC_CAL_GAIN_SHIFT;
+
+	return val > ADC_14BIT_MAX ? ADC_14BIT_MAX : (unsigned short)val;
+}
+
+static void adc_async_start(unsigned char first, unsigned char last,
+				unsigned char resolution, unsigned char vref,
+				unsigned short *buf, unsigned char n)
+{
+	struct ther_adc *a = &ther_adc;
+
+	a->busy = TRUE;
+	a->converting = TRUE;
+	a->first = first;
+	a->last = last;
+	a->channel = first;
+	a->resolution = resolution;
+	a->vref = vref;
+	a->buf = buf;
+	a->n = n;
+	a->count = 0;
+
+	/* PM2/PM3 stop the 32M clock, the ADC needs it */
+	ther_pwrmgr_hold();
+
+	ADCIF = 0;
+	ADCIE = 1;
+
+	adc_start_conversion(first, resolution, vref);
+}
+
+/*
+ * Start an extra conversion and return at once, the result is passed
+ * to callback from the thermometer task (TH_ADC_EVT), so the OSAL loop
+ * keeps running during the conversion.
+ *
+ * return: FALSE if the last async conversion is not delivered yet
+ */
+bool read_adc_async(unsigned char channel, unsigned char resolution, unsigned char vref,
+				void (*callback)(unsigned char channel, unsigned short adc_val))
+{
+	struct ther_adc *a = &ther_adc;
+
+	if (a->busy)
+		return FALSE;
+
+	a->callback = callback;
+	a->sequence_callback = NULL;
+	adc_async_start(channel, channel, resolution, vref, &a->single, 1);
+
+	return TRUE;
+}
+
+/*
+ * Convert AIN[first]..AIN[last] in turn, n conversions of all channels
+ * together, without waiting: the isr takes each conversion and starts
+ * the next one, the task gets callback(n) when buf has all n.
+ * buf[] is interleaved: AIN[first], ..., AIN[last], AIN[first], ...
+ *
+ * Every conversion is an extra conversion, so the inputs not in
+ * first..last are left alone.
+ *
+ * return: FALSE if the last async conversion is not delivered yet
+ */
+bool read_adc_sequence_async(unsigned char first, unsigned char last,
+				unsigned char resolution, unsigned char vref,
+				unsigned short *buf, unsigned char n,
+				void (*callback)(unsigned char n))
+{
+	struct ther_adc *a = &ther_adc;
+
+	if (a->busy || first > last || last > HAL_ADC_CHANNEL_7 || n == 0)
+		return FALSE;
+
+	a->callback = NULL;
+	a->sequence_callback = callback;
+	adc_async_start(first, last, resolution, vref, buf, n);
+
+	return TRUE;
+}
+
+/*
+ * TH_ADC_EVT handler
+ */
+void ther_adc_deliver_result(void)
+{
+	struct ther_adc *a = &ther_adc;
+	void (*callback)(unsigned char channel, unsigned short adc_val) = a->callback;
+	void (*sequence_callback)(unsigned char n) = a->sequence_callback;
+	unsigned char i;
+
+	if (!a->busy || a->converting)
+		return;
+
+	for (i = 0; i < a->n; i++)
+		a->buf[i] = adc_scale_reading((int16)a->buf[i], a->resolution);
+
+	a->busy = FALSE;
+	ther_pwrmgr_release();
+
+	/* the callback may start the next async conversion */
+	if (callback)
+		callback(a->first, a->single);
+	else if (sequence_callback)
+		sequence_callback(a->n);
+}
+
+void ther_adc_init(unsigned char task_id)
+{
+	struct ther_adc *a = &ther_adc;
+
+	a->task_id = task_id;
+	a->busy = FALSE;
+	a->converting = FALSE;
+	a->vdd_last = 0;
+	a->cal.valid = FALSE;
+
+	ADCIE = 0;
+}
+
+HAL_ISR_FUNCTION(adc_isr, ADC_VECTOR)
+{
+	struct ther_adc *a = &ther_adc;
+
+	HAL_ENTER_ISR();
+
+	ADCIE = 0;
+	ADCIF = 0;
+
+	a->buf[a->count++] = (unsigned short)adc_end_conversion(a->channel);
+
+	if (a->count < a->n) {
+		a->channel = a->channel < a->last ? a->channel + 1 : a->first;
+		adc_start_conversion(a->channel, a->resolution, a->vref);
+		ADCIE = 1;
+	} else {
+		a->converting = FALSE;
+		osal_set_event(a->task_id, TH_ADC_EVT);
+
+		CLEAR_SLEEP_MODE();
+	}
+
+	HAL_EXIT_ISR();
+
+	return;
+}
@@ -58,6 +58,17 @@
 #define HAL_ADC_REF_BITS          0xc0    /* Bits [7:6] */
 
 unsigned short read_adc(unsigned char channel, unsigned char resolution, unsigned char vref);
+unsigned short read_vdd(void);
+void adc_cal_update(unsigned char vref);
+unsigned short adc_cal_apply(unsigned short adc_val);
+bool read_adc_async(unsigned char channel, unsigned char resolution, unsigned char vref,
+				void (*callback)(unsigned char channel, unsigned short adc_val));
+bool read_adc_sequence_async(unsigned char first, unsigned char last,
+				unsigned char resolution, unsigned char vref,
+				unsigned short *buf, unsigned char n,
+				void (*callback)(unsigned char n));
+void ther_adc_deliver_result(void);
+void ther_adc_init(unsigned char task_id);
 
 #endif
 
@@ -26,6 +26,7 @@
 #include "ther_uart_comm.h"
 
 #include "ther_ble.h"
+#include "ther_setting.h"
 
 #define MODULE "[THER BLE] "
 
@@ -274,6 +275,10 @@ static void ble_gatt_accessed(uint8 event)
 			msg->type = GATT_INTERVAL_IND_DISABLED;
 			break;
 
+		case THERMOMETER_INTERVAL_SET:
+			msg->type = GATT_INTERVAL_SET;
+			break;
+
 		default:
 			msg->type = GATT_UNKNOWN;
 			break;
@@ -399,10 +404,14 @@ unsigned char ther_ble_init(uint8 task_id)
 
 	// Setup the Thermometer Characteristic Values
 	{
-		uint8 thermometerSite = THERMOMETER_TYPE_MOUTH;
+		uint8 thermometerSite = (uint8)ther_setting_get(SETTING_TEMP_TYPE);
 		Thermometer_SetParameter( THERMOMETER_TYPE, sizeof ( uint8 ), &thermometerSite );
 
-		thermometerIRange_t thermometerIRange= {4,60};
+		uint8 thermometerInterval = (uint8)ther_setting_get(SETTING_MEAS_INTERVAL);
+		Thermometer_SetParameter( THERMOMETER_INTERVAL, sizeof ( uint8 ), &thermometerInterval );
+
+		thermometerIRange_t thermometerIRange = {(uint8)ther_setting_get(SETTING_IRANGE_LOW),
+							(uint8)ther_setting_get(SETTING_IRANGE_HIGH)};
 		Thermometer_SetParameter( THERMOMETER_IRANGE, sizeof ( uint16 ), &thermometerIRange );
 	}
 
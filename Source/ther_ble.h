@@ -19,6 +19,7 @@ enum {
 
 	GATT_INTERVAL_IND_ENABLED,
 	GATT_INTERVAL_IND_DISABLED,
+	GATT_INTERVAL_SET,
 
 	GATT_UNKNOWN,
 };
@@ -26,6 +26,7 @@
 
 #include "ther_temp.h"
 #include "ther_comm.h"
+#include "ther_setting.h"
 
 #define MODULE "[THER COMM] "
 
@@ -37,6 +38,9 @@ static unsigned char encap_temp_data(unsigned char flag, unsigned short temp, un
 	unsigned char *start_start = buf;
 	unsigned long format_temp;
 
+	if (ther_setting_get(SETTING_TEMP_UNIT) == SETTING_UNIT_FAHRENHEIT)
+		flag |= THERMOMETER_FLAGS_FARENHEIT;
+
 	/* a). flag */
 	*buf++ = flag;
 
@@ -0,0 +1,241 @@
+/*
+ * runtime settings, saved in SNV
+ *
+ * All the settings are kept in RAM, ther_setting_get() is a table read.
+ * ther_setting_set() only changes RAM and restarts the save timer, so the
+ * changes made in a row, like a phone writing the GATT values after it
+ * connects, cost one SNV write. The SNV pages are already appended to and
+ * compacted by OSAL, the settings are a single item there.
+ */
+
+#include "Comdef.h"
+#include "OSAL.h"
+#include "bcomdef.h"
+#include "osal_snv.h"
+#include "gatt.h"
+
+#include "ther_uart.h"
+#include "ther_uart_comm.h"
+
+#include "ther_profile.h"
+#include "thermometer.h"
+#include "ther_setting.h"
+
+#define MODULE "[SETTING] "
+
+/* BLE_NVID_CUST_START is the temp calibration */
+#define SETTING_NV_ID (BLE_NVID_CUST_START + 1)
+#define SETTING_VERSION 1
+
+/* wait for more changes before writing SNV */
+#define SETTING_SAVE_DELAY 10000 /* ms */
+
+struct setting_data {
+	unsigned char version;
+	uint16 val[SETTING_NR];
+};
+
+struct ther_setting {
+	uint8 task_id;
+
+	struct setting_data data; /* RAM mirror of SNV */
+	bool dirty;
+};
+static struct ther_setting ther_setting;
+
+static const char *setting_name[SETTING_NR] = {
+	"interval", "type", "low", "high", "unit",
+};
+
+static const uint16 setting_default[SETTING_NR] = {
+	30,				/* SETTING_MEAS_INTERVAL, as ther_profile.c */
+	THERMOMETER_TYPE_MOUTH,		/* SETTING_TEMP_TYPE */
+	4,				/* SETTING_IRANGE_LOW */
+	60,				/* SETTING_IRANGE_HIGH */
+	SETTING_UNIT_CELSIUS,		/* SETTING_TEMP_UNIT */
+};
+
+uint16 ther_setting_get(uint8 key)
+{
+	return key < SETTING_NR ? ther_setting.data.val[key] : 0;
+}
+
+/*
+ * interval inside the range as the GATT write of ther_profile.c checks it,
+ * 0 is no periodic measurement; the range must keep the interval inside
+ */
+static bool setting_interval_valid(uint16 interval, uint16 low, uint16 high)
+{
+	return interval == 0 || (interval > low && interval < high);
+}
+
+static bool setting_valid(uint8 key, uint16 val)
+{
+	uint16 *v = ther_setting.data.val;
+
+	switch (key) {
+	case SETTING_MEAS_INTERVAL:
+		return setting_interval_valid(val, v[SETTING_IRANGE_LOW], v[SETTING_IRANGE_HIGH]);
+
+	case SETTING_TEMP_TYPE:
+		return val >= THERMOMETER_TYPE_ARMPIT && val <= THERMOMETER_TYPE_TYMPNUM;
+
+	case SETTING_IRANGE_LOW:
+		return val >= 1 && setting_interval_valid(v[SETTING_MEAS_INTERVAL], val, v[SETTING_IRANGE_HIGH]);
+
+	case SETTING_IRANGE_HIGH:
+		return val <= 0xFF && setting_interval_valid(v[SETTING_MEAS_INTERVAL], v[SETTING_IRANGE_LOW], val);
+
+	case SETTING_TEMP_UNIT:
+		return val <= SETTING_UNIT_FAHRENHEIT;
+	}
+
+	return FALSE;
+}
+
+/*
+ * return: FALSE if the value is out of the range of the setting
+ */
+bool ther_setting_set(uint8 key, uint16 val)
+{
+	struct ther_setting *s = &ther_setting;
+
+	if (key >= SETTING_NR || !setting_valid(key, val))
+		return FALSE;
+
+	if (s->data.val[key] == val)
+		return TRUE;
+
+	s->data.val[key] = val;
+	s->dirty = TRUE;
+
+	osal_start_timerEx(s->task_id, TH_SETTING_EVT, SETTING_SAVE_DELAY);
+
+	return TRUE;
+}
+
+/*
+ * write the changed settings to SNV, on TH_SETTING_EVT or before power off
+ */
+void ther_setting_save(void)
+{
+	struct ther_setting *s = &ther_setting;
+
+	if (!s->dirty)
+		return;
+
+	osal_stop_timerEx(s->task_id, TH_SETTING_EVT);
+
+	if (osal_snv_write(SETTING_NV_ID, sizeof(s->data), &s->data) != SUCCESS) {
+		print(LOG_ERR, MODULE "save failed\r\n");
+		return;
+	}
+
+	s->dirty = FALSE;
+	print(LOG_INFO, MODULE "saved\r\n");
+}
+
+static void setting_show(void)
+{
+	struct setting_data *d = &ther_setting.data;
+
+	print(LOG_INFO, MODULE "interval %d, type %d, range %d..%d, unit %d\r\n",
+			d->val[SETTING_MEAS_INTERVAL], d->val[SETTING_TEMP_TYPE],
+			d->val[SETTING_IRANGE_LOW], d->val[SETTING_IRANGE_HIGH], d->val[SETTING_TEMP_UNIT]);
+}
+
+/*
+ * the GATT values follow the settings at once
+ */
+static void setting_apply(uint8 key)
+{
+	thermometerIRange_t range;
+	uint8 val = (uint8)ther_setting_get(key);
+
+	switch (key) {
+	case SETTING_MEAS_INTERVAL:
+		Thermometer_SetParameter(THERMOMETER_INTERVAL, sizeof(uint8), &val);
+		break;
+
+	case SETTING_TEMP_TYPE:
+		Thermometer_SetParameter(THERMOMETER_TYPE, sizeof(uint8), &val);
+		break;
+
+	case SETTING_IRANGE_LOW:
+	case SETTING_IRANGE_HIGH:
+		range.low = (uint8)ther_setting_get(SETTING_IRANGE_LOW);
+		range.high = (uint8)ther_setting_get(SETTING_IRANGE_HIGH);
+		Thermometer_SetParameter(THERMOMETER_IRANGE, sizeof(range), &range);
+		break;
+	}
+}
+
+/*
+ * settings from the uart:
+ *
+ *   set              show the settings
+ *   set type 3       change a setting: interval, type, low, high or unit
+ */
+void ther_setting_cmd(unsigned char *buf, unsigned char len)
+{
+	unsigned char key, name_len, i;
+	uint32 val = 0;
+
+	while (len > 0 && (buf[len - 1] == '\r' || buf[len - 1] == '\n' || buf[len - 1] == ' '))
+		len--;
+	while (len > 0 && buf[0] == ' ') {
+		buf++;
+		len--;
+	}
+
+	if (len == 0) {
+		setting_show();
+		return;
+	}
+
+	for (key = 0; key < SETTING_NR; key++) {
+		name_len = osal_strlen((char *)setting_name[key]);
+		if (len > name_len && buf[name_len] == ' ' && osal_memcmp(buf, setting_name[key], name_len))
+			break;
+	}
+
+	if (key == SETTING_NR) {
+		print(LOG_WRANING, MODULE "unknown setting\r\n");
+		return;
+	}
+
+	/* 5 digits at most, a longer one is out of range anyway */
+	for (i = name_len + 1; i < len; i++) {
+		if (buf[i] < '0' || buf[i] > '9' || i > name_len + 5) {
+			print(LOG_WRANING, MODULE "bad value\r\n");
+			return;
+		}
+		val = val * 10 + (buf[i] - '0');
+	}
+
+	if (val > 0xFFFF || !ther_setting_set(key, (uint16)val)) {
+		print(LOG_WRANING, MODULE "%s out of range\r\n", setting_name[key]);
+		setting_show();
+		return;
+	}
+
+	setting_apply(key);
+	setting_show();
+}
+
+void ther_setting_init(uint8 task_id)
+{
+	struct ther_setting *s = &ther_setting;
+	struct setting_data *d = &s->data;
+
+	s->task_id = task_id;
+	s->dirty = FALSE;
+
+	if (osal_snv_read(SETTING_NV_ID, sizeof(*d), d) != SUCCESS ||
+		d->version != SETTING_VERSION) {
+		d->version = SETTING_VERSION;
+		osal_memcpy(d->val, setting_default, sizeof(d->val));
+	}
+
+	setting_show();
+}
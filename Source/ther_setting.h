@@ -0,0 +1,25 @@
+#ifndef __THER_SETTING_H__
+#define __THER_SETTING_H__
+
+enum {
+	SETTING_MEAS_INTERVAL = 0, /* second, the GATT measurement interval */
+	SETTING_TEMP_TYPE, /* THERMOMETER_TYPE_xxx */
+	SETTING_IRANGE_LOW, /* second, the valid range of SETTING_MEAS_INTERVAL */
+	SETTING_IRANGE_HIGH,
+	SETTING_TEMP_UNIT,
+
+	SETTING_NR,
+};
+
+enum {
+	SETTING_UNIT_CELSIUS = 0,
+	SETTING_UNIT_FAHRENHEIT,
+};
+
+void ther_setting_init(uint8 task_id);
+uint16 ther_setting_get(uint8 key);
+bool ther_setting_set(uint8 key, uint16 val);
+void ther_setting_save(void);
+void ther_setting_cmd(unsigned char *buf, unsigned char len);
+
+#endif
@@ -131,6 +131,15 @@ static uint32 ther_spi_xfer(struct ther_spi_message* message)
 	return message->length;
 }
 
+/*
+ * one message, CS is left as the message says, so a transfer can go on
+ * over several messages
+ */
+uint32 ther_spi_transfer(struct ther_spi_message *message)
+{
+	return ther_spi_xfer(message);
+}
+
 uint32 ther_spi_recv(void *recv_buf, uint32 length)
 {
 	struct ther_spi_message message;
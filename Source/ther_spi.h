@@ -17,6 +17,7 @@ struct ther_spi_message {
  * SPI common interface
  */
 void ther_spi_init(void);
+uint32 ther_spi_transfer(struct ther_spi_message *message);
 uint32 ther_spi_recv(void *recv_buf, uint32 length);
 uint32 ther_spi_send(const void *send_buf, uint32 length);
 uint32 ther_spi_send_then_send(const void *send_buf1, uint32 send_length1,
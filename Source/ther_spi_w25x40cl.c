@@ -13,14 +13,13 @@
 #include "ther_uart_comm.h"
 #include "ther_spi.h"
 #include "ther_spi_w25x40cl.h"
+#include "thermometer.h"
 
 #define MODULE  "[W25X] "
-#define W25X_DEBUG
 
 #define CONFIG_W25X40CL
 
 #define PAGE_SIZE            (256)
-#define NPAGE_SIZE           (4096)      //16 pages for logic
 
 #ifdef CONFIG_W25X40CL
 #define CHIP_SIZE           (512*1024) //512KB
@@ -55,11 +54,162 @@
 #define CMD_JEDEC_ID                (0x9F)  /* Read JEDEC ID */
 #define CMD_ERASE_CHIP              (0xC7)  /* Chip Erase */
 #define CMD_RELEASE_PWRDN           (0xAB)  /* Release device from power down state */
+#define CMD_POWER_DOWN              (0xB9)  /* Power down */
 
 #define DUMMY                       (0xFF)
 
+/*
+ * program() collects the bytes of a page in RAM and programs them at once
+ * when the page is full, on flush(), when a program() is not contiguous,
+ * or when the oldest byte has waited W25X_WC_DEADLINE. The deadline is
+ * checked by program() and by TH_FLASH_IDLE_EVT, which the power-down
+ * leaves set for it, so it holds without another program().
+ */
+#define W25X_WC_DEADLINE            (600000UL) /* ms */
+#define W25X_WC_NONE                (0xFFFFFFFFUL)
+
+enum {
+	WC_FLUSH_FULL,
+	WC_FLUSH_EXPLICIT,
+	WC_FLUSH_DEADLINE,
+	WC_FLUSH_OTHER,
+};
+
+struct w25x_wc {
+	uint32 page_addr; /* W25X_WC_NONE: nothing buffered */
+	uint16 start; /* buffered bytes: [start, end) of the page */
+	uint16 end;
+	uint32 since; /* ms, when the first byte is buffered */
+
+	/* the flash was busy, program the page once it is ready */
+	bool flush_pending;
+	uint8 flush_reason;
+
+	uint8 buf[PAGE_SIZE];
+
+	struct flash_program_stat stat;
+};
+static struct w25x_wc w25x_wc = { W25X_WC_NONE };
+
+/*
+ * streaming read: one FAST_READ, then the data is clocked out as long as
+ * CS stays low, across page and sector boundaries.
+ * Any other command deselects the flash, the next w25x_stream_read()
+ * sends a new FAST_READ at the stream position.
+ */
+struct w25x_stream {
+	bool open;
+	bool selected; /* FAST_READ sent, CS low */
+	uint32 addr; /* next byte */
+};
+static struct w25x_stream w25x_stream;
+
+/*
+ * erase() and the page programs of the write combiner do not wait for the
+ * flash, TH_FLASH_EVT polls the status register until it is ready, and
+ * then programs the page flushed meanwhile. Any other command waits for
+ * the flash first, see w25x_wait_ready().
+ *
+ * erase_range() covers the sectors with the fewest commands: the chip
+ * erase, then the 64KB and 32KB block erases where the range holds an
+ * aligned block, 4KB sector erases for the rest. TH_FLASH_EVT sends the
+ * next command when one is done, a command in between waits for the
+ * whole range.
+ */
+#define W25X_ERASE_POLL_TIME        (10) /* ms, 4K erase is 45ms typ. */
+#define W25X_BLOCK_ERASE_POLL_TIME  (50) /* ms, 32K/64K erase is 120/150ms typ. */
+#define W25X_CHIP_ERASE_POLL_TIME   (200) /* ms, chip erase is 1s typ. */
+#define W25X_PROGRAM_POLL_TIME      (2)  /* ms, page program is 0.8ms typ. */
+
+#define W25X_STATUS_BUSY            (0x01)
+
+struct w25x_job {
+	uint8 task_id;
+	bool busy; /* an erase or program is running */
+	uint16 poll_time;
+
+	/* sectors of erase_range() still to erase */
+	uint32 erase_next;
+	uint32 erase_left;
+};
+static struct w25x_job w25x_job;
+
+/*
+ * The flash goes to deep power-down (1uA instead of 25uA standby) once it
+ * has not been accessed for W25X_IDLE_TIME, TH_FLASH_IDLE_EVT checks it.
+ * Every command wakes it up first, the wake latency is measured in status
+ * reads (about 8us each at 2MHz), the flash answers busy until it is up.
+ */
+#define W25X_IDLE_TIME              (50) /* ms */
+#define W25X_WAKE_MAX_POLLS         (100)
+#define W25X_STATUS_POLL_US         (8)
+
+struct w25x_power {
+	bool power_down;
+	bool idle_timer;
+	uint32 last_access; /* ms */
+	uint32 state_since; /* ms */
+
+	struct flash_power_stat stat;
+};
+static struct w25x_power w25x_power;
+
+/*
+ * read cache: the small reads (sector headers) are served from RAM.
+ * A cache page is W25X_RCACHE_PAGE_SIZE bytes, aligned, the size of a
+ * storage header so a miss reads no more than without the cache. The
+ * pages are dropped when the flash under them is programmed or erased,
+ * the bytes still in the write combiner are copied over as for any read.
+ * Pages are taken back least recently used, a scan over more sectors
+ * than pages gets no hits. W25X_RCACHE_PAGES 0 leaves it out, the
+ * default: the storage reads every header once at mount and keeps the
+ * erase counts in RAM, no header is read again.
+ */
+#ifndef W25X_RCACHE_PAGES
+#define W25X_RCACHE_PAGES           (0)
+#endif
+#ifndef W25X_RCACHE_PAGE_SIZE
+#define W25X_RCACHE_PAGE_SIZE       (16)
+#endif
+#define W25X_RCACHE_NONE            (0xFFFFFFFFUL)
+
+#if W25X_RCACHE_PAGES
+struct w25x_rcache_page {
+	uint32 addr; /* W25X_RCACHE_NONE: empty */
+	uint16 used; /* w25x_rcache.tick of the last access */
+	uint8 buf[W25X_RCACHE_PAGE_SIZE];
+};
+
+struct w25x_rcache {
+	struct w25x_rcache_page page[W25X_RCACHE_PAGES];
+	uint16 tick;
+
+	struct flash_cache_stat stat;
+};
+static struct w25x_rcache w25x_rcache;
+#endif
+
 struct flash_device flash_dev;
 
+static void w25x_stream_suspend(void)
+{
+	struct w25x_stream *st = &w25x_stream;
+	struct ther_spi_message message;
+
+	if (!st->selected)
+		return;
+
+	/* release CS only */
+	message.send_buf   = NULL;
+	message.recv_buf   = NULL;
+	message.length     = 0;
+	message.cs_take    = 0;
+	message.cs_release = 1;
+	ther_spi_transfer(&message);
+
+	st->selected = FALSE;
+}
+
 static uint8 w25x_read_status(void)
 {
 	uint8 cmd = CMD_RDSR;
@@ -70,11 +220,114 @@ static uint8 w25x_read_status(void)
 	return value;
 }
 
+/*
+ * add the time since the last change to the current state
+ */
+static void w25x_power_account(uint32 now)
+{
+	struct w25x_power *pw = &w25x_power;
+
+	if (pw->power_down)
+		pw->stat.power_down_ms += now - pw->state_since;
+	else
+		pw->stat.standby_ms += now - pw->state_since;
+
+	pw->state_since = now;
+}
+
+/*
+ * before any command: leave deep power-down, keep the idle timer running
+ */
+static void w25x_wake(void)
+{
+	struct w25x_power *pw = &w25x_power;
+	uint32 now = osal_GetSystemClock();
+	uint8 cmd = CMD_RELEASE_PWRDN;
+	uint16 polls = 0;
+	uint16 wake_us;
+
+	pw->last_access = now;
+
+	if (!pw->idle_timer) {
+		pw->idle_timer = TRUE;
+		osal_start_timerEx(w25x_job.task_id, TH_FLASH_IDLE_EVT, W25X_IDLE_TIME);
+	}
+
+	if (!pw->power_down)
+		return;
+
+	ther_spi_send(&cmd, 1);
+
+	/* all ones until it is up */
+	while ((w25x_read_status() & W25X_STATUS_BUSY) && ++polls < W25X_WAKE_MAX_POLLS);
+
+	w25x_power_account(now);
+	pw->power_down = FALSE;
+
+	wake_us = (polls + 1) * W25X_STATUS_POLL_US;
+	pw->stat.wake_count++;
+	pw->stat.wake_us_total += wake_us;
+	if (wake_us > pw->stat.wake_us_max)
+		pw->stat.wake_us_max = wake_us;
+}
+
 static void w25x_wait_busy(void)
 {
+	w25x_wake();
+
 	while( w25x_read_status() & (0x01));
 }
 
+static void w25x_erase_range_next(void);
+static void w25x_wc_flush(uint8 reason);
+
+/*
+ * before any command: block until the running erase/program is done
+ */
+static void w25x_wait_ready(void)
+{
+	struct w25x_job *job = &w25x_job;
+	struct w25x_wc *wc = &w25x_wc;
+
+	while (job->busy) {
+		w25x_wait_busy();
+		job->busy = FALSE;
+
+		/* the rest of a range goes first, then the page held back */
+		if (job->erase_left)
+			w25x_erase_range_next();
+		else if (wc->flush_pending)
+			w25x_wc_flush(wc->flush_reason);
+	}
+}
+
+static void w25x_job_start(uint16 poll_time)
+{
+	struct w25x_job *job = &w25x_job;
+
+	job->busy = TRUE;
+	job->poll_time = poll_time;
+	osal_start_timerEx(job->task_id, TH_FLASH_EVT, poll_time);
+}
+
+/*
+ * drop the cache pages in [addr, addr + size), the flash is changed there
+ */
+static void w25x_rcache_invalidate(uint32 addr, uint32 size)
+{
+#if W25X_RCACHE_PAGES
+	struct w25x_rcache_page *page;
+	uint8 i;
+
+	for (i = 0; i < W25X_RCACHE_PAGES; i++) {
+		page = &w25x_rcache.page[i];
+		if (page->addr != W25X_RCACHE_NONE &&
+			page->addr < addr + size && addr < page->addr + W25X_RCACHE_PAGE_SIZE)
+			page->addr = W25X_RCACHE_NONE;
+	}
+#endif
+}
+
 /** \brief read [size] byte from [offset] to [buffer]
  *
  * \param offset uint32 unit : byte
@@ -87,8 +340,8 @@ static uint32 w25x_read(uint32 offset, uint8 *buffer, uint32 size)
 {
 	uint8 send_buffer[4];
 
-	send_buffer[0] = CMD_WRDI;
-	ther_spi_send(send_buffer, 1);
+	w25x_wait_ready();
+	w25x_wake();
 
 	send_buffer[0] = CMD_READ;
 	send_buffer[1] = (uint8)(offset >> 16);
@@ -100,68 +353,87 @@ static uint32 w25x_read(uint32 offset, uint8 *buffer, uint32 size)
 	return size;
 }
 
-static void w25x_sector_erase(uint32 sector_addr)
+/*
+ * [cmd] erases [size] bytes from [addr], the chip erase has no address
+ */
+static void w25x_erase_start(uint8 cmd, uint32 addr, uint32 size)
 {
 	uint8 send_buffer[4];
 
+	w25x_wait_ready();
+	w25x_wake();
+
 	send_buffer[0] = CMD_WREN;
 	ther_spi_send(send_buffer, 1);
 
-	send_buffer[0] = CMD_ERASE_4K;
-	send_buffer[1] = (sector_addr >> 16);
-	send_buffer[2] = (sector_addr >> 8);
-	send_buffer[3] = (sector_addr);
-	ther_spi_send(send_buffer, 4);
+	send_buffer[0] = cmd;
+	send_buffer[1] = (addr >> 16);
+	send_buffer[2] = (addr >> 8);
+	send_buffer[3] = (addr);
+	ther_spi_send(send_buffer, cmd == CMD_ERASE_CHIP ? 1 : 4);
 
-	w25x_wait_busy(); // wait erase done.
+	w25x_rcache_invalidate(addr, size);
 }
 
+static void w25x_sector_erase_start(uint32 sector_addr)
+{
+	w25x_erase_start(CMD_ERASE_4K, sector_addr, BYTES_PER_SECTOR);
+}
 
-/** \brief write N page on [page]
- *
- * \param page_addr uint32 unit : byte (4096 * N,1 page = 4096byte)
- * \param buffer const uint8*
- * \return uint32
- *
+/*
+ * the largest erase at [sector] within [count] sectors, return the
+ * sectors it covers
  */
-static uint32 w25x_npage_write(uint32 page_addr, const uint8 *buffer)
+static uint32 w25x_erase_plan(uint32 sector, uint32 count, uint8 *cmd, uint16 *poll_time)
 {
-	uint32 index;
-	uint8 send_buffer[4];
+	const uint32 block1_sectors = BLOCK1_SIZE / BYTES_PER_SECTOR;
+	const uint32 block2_sectors = BLOCK2_SIZE / BYTES_PER_SECTOR;
 
-	if ((page_addr & 0xFF) != 0) {
-		print(LOG_ERR, MODULE "page addr must align to 256bytes,dead here!\r\n");
-		while(1);
-	}
+	*poll_time = W25X_BLOCK_ERASE_POLL_TIME;
 
-	w25x_sector_erase(page_addr);
+	if (sector == 0 && count >= SECTOR_COUNT) {
+		*cmd = CMD_ERASE_CHIP;
+		*poll_time = W25X_CHIP_ERASE_POLL_TIME;
+		return SECTOR_COUNT;
+	}
 
-	for(index = 0; index < (NPAGE_SIZE / 256); index++) {
-		send_buffer[0] = CMD_WREN;
-		ther_spi_send(send_buffer, 1);
+	if (sector % block2_sectors == 0 && count >= block2_sectors) {
+		*cmd = CMD_ERASE_64K;
+		return block2_sectors;
+	}
 
-		send_buffer[0] = CMD_PP;
-		send_buffer[1] = (uint8)(page_addr >> 16);
-		send_buffer[2] = (uint8)(page_addr >> 8);
-		send_buffer[3] = (uint8)(page_addr);
+	if (sector % block1_sectors == 0 && count >= block1_sectors) {
+		*cmd = CMD_ERASE_32K;
+		return block1_sectors;
+	}
 
-		ther_spi_send_then_send(send_buffer, 4, buffer, 256);
+	*cmd = CMD_ERASE_4K;
+	*poll_time = W25X_ERASE_POLL_TIME;
+	return 1;
+}
 
-		buffer += 256;
-		page_addr += 256;
-		w25x_wait_busy();
-	}
+static void w25x_erase_range_next(void)
+{
+	struct w25x_job *job = &w25x_job;
+	uint16 poll_time;
+	uint32 n;
+	uint8 cmd;
 
-	send_buffer[0] = CMD_WRDI;
-	ther_spi_send(send_buffer, 1);
+	n = w25x_erase_plan(job->erase_next, job->erase_left, &cmd, &poll_time);
+	w25x_erase_start(cmd, job->erase_next * BYTES_PER_SECTOR, n * BYTES_PER_SECTOR);
 
-	return NPAGE_SIZE;
+	job->erase_next += n;
+	job->erase_left -= n;
+	w25x_job_start(poll_time);
 }
 
 static uint32 w25x_byte_write(uint32 addr, const uint8 *buffer, uint32 size)
 {
 	uint8 send_buffer[4];
 
+	w25x_wait_ready();
+	w25x_wake();
+
 	send_buffer[0] = CMD_WREN;
 	ther_spi_send(send_buffer, 1);
 
@@ -171,14 +443,203 @@ static uint32 w25x_byte_write(uint32 addr, const uint8 *buffer, uint32 size)
 	send_buffer[3] = (uint8)(addr);
 
 	ther_spi_send_then_send(send_buffer, 4, buffer, size);
+	w25x_rcache_invalidate(addr, size);
 
-	send_buffer[0] = CMD_WRDI;
-	ther_spi_send(send_buffer, 1);
+	/* no WRDI, the flash is busy and clears WEL itself when done */
 
 	return size;
 
 }
 
+static void w25x_wc_flush(uint8 reason)
+{
+	struct w25x_wc *wc = &w25x_wc;
+	struct flash_program_stat *stat = &wc->stat;
+	uint16 len = wc->end - wc->start;
+
+	if (wc->page_addr == W25X_WC_NONE)
+		return;
+
+	/* only a program/erase in the way needs the page out now */
+	if (w25x_job.busy && reason != WC_FLUSH_OTHER) {
+		wc->flush_pending = TRUE;
+		wc->flush_reason = reason;
+		return;
+	}
+
+	/* before the write, its w25x_wait_ready() must not flush it again */
+	wc->flush_pending = FALSE;
+
+	w25x_byte_write(wc->page_addr + wc->start, wc->buf + wc->start, len);
+	w25x_job_start(W25X_PROGRAM_POLL_TIME);
+
+	wc->page_addr = W25X_WC_NONE;
+
+	stat->program_count++;
+	stat->program_bytes += len;
+	switch (reason) {
+	case WC_FLUSH_FULL:
+		stat->flush_full++;
+		break;
+	case WC_FLUSH_EXPLICIT:
+		stat->flush_explicit++;
+		break;
+	case WC_FLUSH_DEADLINE:
+		stat->flush_deadline++;
+		break;
+	default:
+		stat->flush_other++;
+		break;
+	}
+
+	print(LOG_DBG, MODULE "program %d bytes, %ld bytes/program\r\n",
+			len, stat->program_bytes / stat->program_count);
+}
+
+/*
+ * the buffered bytes are not on the flash yet, copy them over what was read
+ */
+static void w25x_wc_overlay(uint32 addr, uint8 *buffer, uint32 size)
+{
+	struct w25x_wc *wc = &w25x_wc;
+	uint32 from, to;
+
+	if (wc->page_addr == W25X_WC_NONE)
+		return;
+
+	from = wc->page_addr + wc->start;
+	to = wc->page_addr + wc->end;
+	if (from < addr)
+		from = addr;
+	if (to > addr + size)
+		to = addr + size;
+
+	if (from < to)
+		osal_memcpy(buffer + (from - addr), wc->buf + (from - wc->page_addr), to - from);
+}
+
+static void w25x_wc_deadline(uint32 now)
+{
+	struct w25x_wc *wc = &w25x_wc;
+
+	if (wc->page_addr != W25X_WC_NONE && now - wc->since >= W25X_WC_DEADLINE)
+		w25x_wc_flush(WC_FLUSH_DEADLINE);
+}
+
+/*
+ * buffer [size] bytes for [addr], split at the page boundaries
+ */
+static uint32 w25x_program(uint32 addr, const uint8 *buffer, uint32 size)
+{
+	struct w25x_wc *wc = &w25x_wc;
+	uint32 left = size;
+	uint32 page;
+	uint16 offset, len;
+
+	while (left) {
+		page = addr & ~(uint32)(PAGE_SIZE - 1);
+		offset = (uint16)(addr & (PAGE_SIZE - 1));
+		len = PAGE_SIZE - offset;
+		if (len > left)
+			len = (uint16)left;
+
+		if (wc->page_addr != W25X_WC_NONE && (wc->page_addr != page || wc->end != offset))
+			w25x_wc_flush(WC_FLUSH_OTHER);
+
+		if (wc->page_addr == W25X_WC_NONE) {
+			wc->page_addr = page;
+			wc->start = offset;
+			wc->end = offset;
+			wc->since = osal_GetSystemClock();
+		}
+
+		osal_memcpy(wc->buf + offset, buffer, len);
+		wc->end += len;
+
+		if (wc->end == PAGE_SIZE)
+			w25x_wc_flush(WC_FLUSH_FULL);
+
+		addr += len;
+		buffer += len;
+		left -= len;
+	}
+
+	w25x_wc_deadline(osal_GetSystemClock());
+
+	return size;
+}
+
+static uint8 w25x_stream_open(uint32 addr)
+{
+	struct w25x_stream *st = &w25x_stream;
+
+	if (addr >= CHIP_SIZE)
+		return FL_EID;
+
+	/* carry on if the stream is already there */
+	if (st->open && st->addr == addr)
+		return FL_EOK;
+
+	w25x_stream_suspend();
+
+	st->open = TRUE;
+	st->addr = addr;
+
+	return FL_EOK;
+}
+
+static uint32 w25x_stream_read(uint8 *buffer, uint32 size)
+{
+	struct w25x_stream *st = &w25x_stream;
+	struct ther_spi_message message;
+	uint8 send_buffer[5];
+
+	if (!st->open)
+		return 0;
+
+	/* the flash wraps at the end */
+	if (size > CHIP_SIZE - st->addr)
+		size = CHIP_SIZE - st->addr;
+
+	if (!st->selected) {
+		w25x_wait_ready();
+		w25x_wake();
+
+		send_buffer[0] = CMD_FAST_READ;
+		send_buffer[1] = (uint8)(st->addr >> 16);
+		send_buffer[2] = (uint8)(st->addr >> 8);
+		send_buffer[3] = (uint8)(st->addr);
+		send_buffer[4] = DUMMY;
+
+		message.send_buf   = send_buffer;
+		message.recv_buf   = NULL;
+		message.length     = 5;
+		message.cs_take    = 1;
+		message.cs_release = 0;
+		ther_spi_transfer(&message);
+
+		st->selected = TRUE;
+	}
+
+	message.send_buf   = NULL;
+	message.recv_buf   = buffer;
+	message.length     = size;
+	message.cs_take    = 0;
+	message.cs_release = 0;
+	ther_spi_transfer(&message);
+
+	w25x_wc_overlay(st->addr, buffer, size);
+	st->addr += size;
+
+	return size;
+}
+
+static void w25x_stream_close(void)
+{
+	w25x_stream_suspend();
+	w25x_stream.open = FALSE;
+}
+
 static uint8 w25x_flash_init(void)
 {
 	return FL_EOK;
@@ -188,6 +649,10 @@ static uint8 w25x_flash_open(void)
 {
 	uint8 send_buffer[2];
 
+	w25x_stream_suspend();
+	w25x_wait_ready();
+	w25x_wake();
+
 	send_buffer[0] = CMD_WREN;
 	ther_spi_send(send_buffer, 1);
 
@@ -205,38 +670,350 @@ static uint8 w25x_flash_close(void)
 	return FL_EOK;
 }
 
+#if W25X_RCACHE_PAGES
+/*
+ * the cache page holding [addr], read from the flash on a miss
+ */
+static struct w25x_rcache_page *w25x_rcache_get(uint32 addr)
+{
+	struct w25x_rcache *rc = &w25x_rcache;
+	struct w25x_rcache_page *page, *victim = &rc->page[0];
+	uint8 i;
+
+	addr &= ~(uint32)(W25X_RCACHE_PAGE_SIZE - 1);
+	rc->tick++;
+
+	for (i = 0; i < W25X_RCACHE_PAGES; i++) {
+		page = &rc->page[i];
+		if (page->addr == addr) {
+			page->used = rc->tick;
+			rc->stat.hit++;
+			return page;
+		}
+
+		/* an empty page, or the least recently used */
+		if (victim->addr != W25X_RCACHE_NONE &&
+			(page->addr == W25X_RCACHE_NONE ||
+			(uint16)(rc->tick - page->used) > (uint16)(rc->tick - victim->used)))
+			victim = page;
+	}
+
+	rc->stat.miss++;
+	w25x_read(addr, victim->buf, W25X_RCACHE_PAGE_SIZE);
+	victim->addr = addr;
+	victim->used = rc->tick;
+
+	return victim;
+}
+#endif
+
 static uint32 w25x_flash_read(int32 addr, void* buffer, uint32 size)
 {
+#if W25X_RCACHE_PAGES
+	struct w25x_rcache_page *page;
+	uint8 *ptr = buffer;
+	uint32 pos = addr;
+	uint32 left = size;
+	uint16 offset, len;
+#endif
+
+	w25x_stream_suspend();
+
+#if W25X_RCACHE_PAGES
+	/* the big reads gain nothing, they would only push the headers out */
+	if (size <= W25X_RCACHE_PAGE_SIZE && pos + size <= CHIP_SIZE) {
+		while (left) {
+			page = w25x_rcache_get(pos);
+			offset = (uint16)(pos - page->addr);
+			len = W25X_RCACHE_PAGE_SIZE - offset;
+			if (len > left)
+				len = (uint16)left;
+
+			osal_memcpy(ptr, page->buf + offset, len);
+
+			pos += len;
+			ptr += len;
+			left -= len;
+		}
+
+		w25x_wc_overlay(addr, buffer, size);
+
+		return size;
+	}
+
+	w25x_rcache.stat.miss++;
+#endif
+
 	w25x_read(addr, buffer, size);
+	w25x_wc_overlay(addr, buffer, size);
 
 	return size;
 }
 
-static uint32 w25x_flash_write(int32 pos, const void* buffer, uint32 size)
+static uint8 w25x_flash_erase(uint32 sector)
 {
-	uint32 i = 0;
-	uint32 block = size;
-	const uint8 *ptr = buffer;
+	struct w25x_wc *wc = &w25x_wc;
+
+	if (sector >= SECTOR_COUNT)
+		return FL_EID;
 
-	while(block--) {
-		w25x_npage_write((pos + i)* BYTES_PER_SECTOR, ptr);
-		ptr += NPAGE_SIZE;
-		i++;
+	w25x_stream_suspend();
+
+	/* the buffered bytes of this sector go away with it */
+	if (wc->page_addr / BYTES_PER_SECTOR == sector) {
+		wc->page_addr = W25X_WC_NONE;
+		wc->flush_pending = FALSE;
+	} else {
+		w25x_wc_flush(WC_FLUSH_OTHER);
 	}
 
-	return size;
+	w25x_sector_erase_start(sector * BYTES_PER_SECTOR);
+	w25x_job_start(W25X_ERASE_POLL_TIME);
+
+	return FL_EOK;
+}
+
+static uint8 w25x_flash_erase_range(uint32 sector, uint32 count)
+{
+	struct w25x_job *job = &w25x_job;
+	struct w25x_wc *wc = &w25x_wc;
+	uint32 wc_sector;
+
+	if (sector >= SECTOR_COUNT || count > SECTOR_COUNT - sector)
+		return FL_EID;
+
+	if (count == 0)
+		return FL_EOK;
+
+	w25x_stream_suspend();
+
+	/* the buffered bytes in the range go away with it */
+	wc_sector = wc->page_addr / BYTES_PER_SECTOR;
+	if (wc->page_addr != W25X_WC_NONE && wc_sector >= sector && wc_sector < sector + count) {
+		wc->page_addr = W25X_WC_NONE;
+		wc->flush_pending = FALSE;
+	} else {
+		w25x_wc_flush(WC_FLUSH_OTHER);
+	}
+
+	/* a range still running is done first */
+	w25x_wait_ready();
+
+	job->erase_next = sector;
+	job->erase_left = count;
+	w25x_erase_range_next();
+
+	return FL_EOK;
+}
+
+static uint32 w25x_flash_program(uint32 addr, const void *buffer, uint32 size)
+{
+	w25x_stream_suspend();
+
+	return w25x_program(addr, buffer, size);
+}
+
+static uint8 w25x_flash_flush(void)
+{
+	w25x_stream_suspend();
+	w25x_wc_flush(WC_FLUSH_EXPLICIT);
+
+	return FL_EOK;
+}
+
+static uint8 w25x_flash_sync(void)
+{
+	w25x_stream_suspend();
+
+	/* no pending flush, the page goes out now */
+	w25x_wait_ready();
+	w25x_wc_flush(WC_FLUSH_EXPLICIT);
+	w25x_wait_ready();
+
+	return FL_EOK;
+}
+
+static bool w25x_flash_busy(void)
+{
+	return w25x_job.busy || w25x_wc.flush_pending;
 }
 
-uint8 ther_spi_w25x_init(void)
+static uint32 w25x_flash_stream_read(void *buffer, uint32 size)
+{
+	return w25x_stream_read(buffer, size);
+}
+
+/*
+ * TH_FLASH_EVT handler
+ *
+ * return: TRUE if the flash is ready, nothing is left running
+ */
+bool ther_spi_w25x_poll(void)
+{
+	struct w25x_job *job = &w25x_job;
+	struct w25x_wc *wc = &w25x_wc;
+
+	if (!job->busy)
+		return TRUE;
+
+	w25x_stream_suspend();
+
+	if (w25x_read_status() & W25X_STATUS_BUSY) {
+		osal_start_timerEx(job->task_id, TH_FLASH_EVT, job->poll_time);
+		return FALSE;
+	}
+
+	job->busy = FALSE;
+
+	if (job->erase_left) {
+		w25x_erase_range_next();
+		return FALSE;
+	}
+
+	if (wc->flush_pending)
+		w25x_wc_flush(wc->flush_reason);
+
+	return !job->busy;
+}
+
+/*
+ * powered down, TH_FLASH_IDLE_EVT comes back for the first deadline: the
+ * write buffer's or [wake]. It is not the idle timer, the next wake
+ * starts that one over it.
+ */
+static void w25x_idle_deadline(uint32 now, uint32 wake)
+{
+	struct w25x_wc *wc = &w25x_wc;
+	uint32 left;
+
+	if (wc->page_addr != W25X_WC_NONE) {
+		left = now - wc->since >= W25X_WC_DEADLINE ? 1 : W25X_WC_DEADLINE - (now - wc->since);
+		if (!wake || left < wake)
+			wake = left;
+	}
+
+	if (wake)
+		osal_start_timerEx(w25x_job.task_id, TH_FLASH_IDLE_EVT, wake);
+}
+
+/*
+ * TH_FLASH_IDLE_EVT handler
+ *
+ * wake: ms until the user of the flash needs this event again, 0: never
+ */
+void ther_spi_w25x_idle(uint32 wake)
+{
+	struct w25x_power *pw = &w25x_power;
+	uint32 now = osal_GetSystemClock();
+	uint32 idle = now - pw->last_access;
+	uint8 cmd = CMD_POWER_DOWN;
+
+	pw->idle_timer = FALSE;
+
+	/* wakes the flash and starts the idle timer */
+	w25x_wc_deadline(now);
+
+	if (pw->power_down) {
+		w25x_idle_deadline(now, wake);
+		return;
+	}
+
+	/* a page held back by a job must not wait for the next program() */
+	if (w25x_wc.flush_pending && !w25x_job.busy)
+		w25x_wc_flush(w25x_wc.flush_reason);
+
+	/* accessed meanwhile, an erase/program is running, a page is held back */
+	if (idle < W25X_IDLE_TIME || w25x_job.busy || w25x_wc.flush_pending) {
+		pw->idle_timer = TRUE;
+		osal_start_timerEx(w25x_job.task_id, TH_FLASH_IDLE_EVT,
+				idle < W25X_IDLE_TIME ? W25X_IDLE_TIME - idle : W25X_IDLE_TIME);
+		return;
+	}
+
+	/* an open stream sends a new FAST_READ after the wake */
+	w25x_stream_suspend();
+
+	ther_spi_send(&cmd, 1);
+
+	w25x_power_account(now);
+	pw->power_down = TRUE;
+
+	w25x_idle_deadline(now, wake);
+}
+
+/*
+ * before PM3: the write buffer and the running job done, then deep
+ * power-down without waiting for the idle timer
+ */
+void ther_spi_w25x_power_off(void)
+{
+	struct w25x_power *pw = &w25x_power;
+	uint8 cmd = CMD_POWER_DOWN;
+
+	w25x_flash_sync();
+
+	osal_stop_timerEx(w25x_job.task_id, TH_FLASH_IDLE_EVT);
+	pw->idle_timer = FALSE;
+
+	if (pw->power_down)
+		return;
+
+	ther_spi_send(&cmd, 1);
+
+	w25x_power_account(osal_GetSystemClock());
+	pw->power_down = TRUE;
+}
+
+const struct flash_power_stat *ther_spi_w25x_get_power_stat(void)
+{
+	w25x_power_account(osal_GetSystemClock());
+
+	return &w25x_power.stat;
+}
+
+const struct flash_program_stat *ther_spi_w25x_get_stat(void)
+{
+	return &w25x_wc.stat;
+}
+
+/*
+ * NULL if the read cache is left out
+ */
+const struct flash_cache_stat *ther_spi_w25x_get_cache_stat(void)
+{
+#if W25X_RCACHE_PAGES
+	return &w25x_rcache.stat;
+#else
+	return NULL;
+#endif
+}
+
+uint8 ther_spi_w25x_init(uint8 task_id)
 {
 	struct flash_device *fd = &flash_dev;
 	uint8 cmd;
 	uint8 id_recv[3] = {0, 0, 0};
 	uint16 memory_type_capacity;
 
+	w25x_job.task_id = task_id;
+	w25x_job.busy = FALSE;
+	w25x_job.erase_left = 0;
+
+#if W25X_RCACHE_PAGES
+	osal_memset(&w25x_rcache, 0, sizeof(w25x_rcache));
+	w25x_rcache_invalidate(0, CHIP_SIZE);
+#endif
+
+	/* it may still be powered down from before the reset */
+	osal_memset(&w25x_power, 0, sizeof(w25x_power));
+	w25x_power.power_down = TRUE;
+	w25x_power.state_since = osal_GetSystemClock();
+
 	/* init spi */
 	ther_spi_init();
 
+	w25x_wake();
+
 	/* read flash id */
 	cmd = CMD_JEDEC_ID;
 	ther_spi_send_then_recv(&cmd, 1, id_recv, 3);
@@ -267,38 +1044,15 @@ uint8 ther_spi_w25x_init(void)
 	fd->open    = w25x_flash_open;
 	fd->close   = w25x_flash_close;
 	fd->read    = w25x_flash_read;
-	fd->write   = w25x_flash_write;
+	fd->erase   = w25x_flash_erase;
+	fd->erase_range = w25x_flash_erase_range;
+	fd->program = w25x_flash_program;
+	fd->flush   = w25x_flash_flush;
+	fd->sync    = w25x_flash_sync;
+	fd->busy    = w25x_flash_busy;
+	fd->stream_open  = w25x_stream_open;
+	fd->stream_read  = w25x_flash_stream_read;
+	fd->stream_close = w25x_stream_close;
 
 	return FL_EOK;
 }
-
-#ifdef W25X_DEBUG
-void ther_spi_w25x_test(void)
-{
-	int i;
-	uint8 data_to_wr = 0x5a;
-	uint8 data_from_rd;
-
-	print(LOG_INFO, MODULE "start flash rd/wr test.\r\n");
-
-	if(FL_EOK != w25x_flash_open()) {
-		print(LOG_ERR, MODULE "flash open failed!\r\n");
-	}
-
-	w25x_sector_erase(0);
-
-	for(i = 0; i < 32; i++) {
-		w25x_byte_write(i, &data_to_wr, 1);
-
-		w25x_flash_read(i, &data_from_rd, 1);
-
-		if(data_from_rd != 0x5a) {
-			print(LOG_INFO, MODULE "flash test failed \r\n");
-		}
-	}
-
-	print(LOG_INFO, MODULE "finish flash rd/wr(%dB) test.\r\n", i);
-}
-#endif
-
-
@@ -16,11 +16,68 @@ struct flash_device {
 	uint8  (*open)   (void);
 	uint8  (*close)  (void);
 	uint32 (*read)  (int32 pos, void *buffer, uint32 size);
-	uint32 (*write) (int32 pos, const void *buffer, uint32 size);
+
+	/*
+	 * byte level access for the storage: erase a sector, program erased bytes.
+	 * They return before the flash is done, see ther_spi_w25x_poll().
+	 */
+	uint8  (*erase)  (uint32 sector);
+	/* [count] sectors from [sector], with the block erases where they fit */
+	uint8  (*erase_range)(uint32 sector, uint32 count);
+	uint32 (*program)(uint32 addr, const void *buffer, uint32 size);
+	uint8  (*flush)  (void);
+	/* flush and wait until the bytes are on the flash, to order two programs */
+	uint8  (*sync)   (void);
+	/* an erase or program is running, a command now would wait for it */
+	bool   (*busy)   (void);
+
+	/* sequential read keeping the flash selected, see w25x_stream_read() */
+	uint8  (*stream_open) (uint32 addr);
+	uint32 (*stream_read) (void *buffer, uint32 size);
+	void   (*stream_close)(void);
 };
 
+/*
+ * page program statistics of the write-combining buffer
+ */
+struct flash_program_stat {
+	uint32 program_count; /* page programs sent to the flash */
+	uint32 program_bytes; /* bytes in them */
+	uint32 flush_full;
+	uint32 flush_explicit;
+	uint32 flush_deadline;
+	uint32 flush_other; /* not contiguous, erase */
+};
+
+/*
+ * deep power-down of the flash
+ */
+struct flash_power_stat {
+	uint32 wake_count;
+	uint32 wake_us_total;
+	uint16 wake_us_max;
+	uint32 standby_ms;
+	uint32 power_down_ms;
+};
+
+/*
+ * read cache, reads larger than a cache page count as misses
+ */
+struct flash_cache_stat {
+	uint32 hit; /* cache pages found */
+	uint32 miss; /* reads sent to the flash */
+};
+
+extern struct flash_device flash_dev;
+
 //#define ther_spi_flash_init() ther_spi_w25x_init()
-uint8 ther_spi_w25x_init(void);
+uint8 ther_spi_w25x_init(uint8 task_id);
+bool ther_spi_w25x_poll(void);
+void ther_spi_w25x_idle(uint32 wake);
+void ther_spi_w25x_power_off(void);
+const struct flash_power_stat *ther_spi_w25x_get_power_stat(void);
+const struct flash_program_stat *ther_spi_w25x_get_stat(void);
+const struct flash_cache_stat *ther_spi_w25x_get_cache_stat(void);
 
 #endif
 
@@ -0,0 +1,1193 @@
+/*
+ * measurement storage on the spi flash
+ *
+ * The flash sectors are used as an append-only log. Every sector starts
+ * with a header holding a sequence number, which grows by one for every
+ * new sector, and the erase count of the sector, followed by records:
+ *
+ *	| header | record | record | ... | 0xFF ... |
+ *
+ * When the newest sector is full, the free sector with the lowest erase
+ * count is taken, so the log is not in sector order, only in sequence
+ * order. A free sector is one never used or released by
+ * ther_storage_clear(). Without a free sector the oldest one is erased,
+ * and its records are dropped.
+ *
+ * Records are delta coded against the record before them in the same
+ * sector, the first one of a sector against 0, so it holds the absolute
+ * values:
+ *
+ *	| check | varint zigzag(dtime) | varint zigzag(dtemp) << 2 | type |
+ *
+ * check is the crc-8 of the rest folded to 1..127, the bit 7 is never set,
+ * so an erased byte (0xFF) ends the records. A record is 3 bytes at a few
+ * seconds apart and a few 0.1 du change, against 8 bytes of the raw
+ * time/temp/type/crc, so a sector holds about 1360 records instead of 510.
+ *
+ * Records go through the page write buffer of the flash driver, so most of
+ * them cost no page program, ther_storage_flush() pushes them out.
+ *
+ * Mount reads the sector headers: the newest sector has the highest
+ * sequence number, the oldest one the lowest. A full sector has its
+ * record number programmed in the header when it is closed, so only the
+ * newest sector is decoded to find its end.
+ *
+ * The power can go at any point, the writes are ordered so that mount
+ * finds what was done:
+ *
+ *  - records are committed by a commit byte (0x80) after them, programmed
+ *    once they are on the flash, see storage_commit(). A torn commit byte
+ *    is never 0x80, while a torn record may pass its 7-bit check. At
+ *    mount, what comes after the last commit byte of the head is cut off
+ *    with a 0x00 byte, and the next record goes to a new sector.
+ *    Records are committed by ther_storage_flush() and every
+ *    STORAGE_COMMIT_TIME, a closed sector has all its records committed.
+ *  - record_nr is programmed with its complement, a torn one does not
+ *    match and the sector is decoded instead. Programming the right value
+ *    again only clears the missing bits, so closing it fixes it.
+ *  - a header is programmed after its sector is erased, a torn header
+ *    fails its crc and the sector is free again, a torn erase leaves the
+ *    old header or a bad one.
+ *
+ * So mount reads every header once and decodes the head sector, plus a
+ * sector whose closing was torn, whatever the number of records.
+ *
+ * The erase count of every sector is kept in RAM from the mount on, as
+ * an int16 from the count of the sector 0, so taking a new sector does
+ * not read all the headers again: the live sectors are the ones of the
+ * index, the others are free.
+ *
+ * A sector erase takes 45 ms, up to 400 ms, so the next heads are erased
+ * ahead, when the flash goes idle, see ther_storage_idle(). A new head
+ * from this pool only costs page programs. A sector in the pool has its
+ * new erase count programmed alone, with the magic left erased, so the
+ * count is not lost if the power goes before it is used. It is
+ * programmed once the erase is done, see ther_storage_ready(), so the
+ * write buffer of the flash holds no page waiting for the erase and the
+ * appends meanwhile do not wait. The pool is not kept across a mount,
+ * these sectors are erased again.
+ *
+ * The live sectors always have the sequence numbers from the tail to the
+ * head without a gap, and there are at most sector_nr of them, so the
+ * sector of a sequence number is kept in RAM at index[seq % sector_nr].
+ * A time query uses it to bisect the sectors on the time of their first
+ * record, and reads a few records instead of the whole flash.
+ */
+
+#include "Comdef.h"
+#include "OSAL.h"
+#include "OSAL_Clock.h"
+
+#include "ther_uart.h"
+#include "ther_uart_comm.h"
+
+#include "ther_spi_w25x40cl.h"
+#include "ther_storage.h"
+
+#define MODULE "[STORAGE] "
+
+#define STORAGE_MAGIC 0x5449 /* "TH" + 1, record_nr has a complement */
+
+#define STORAGE_SECTOR_SIZE 4096
+#define STORAGE_HEADER_SIZE sizeof(struct storage_header)
+
+#define STORAGE_NO_SECTOR 0xFF
+#define STORAGE_SECTOR_MAX 128 /* 512 KB */
+#define STORAGE_ERASE_DIFF_MAX 32767 /* erase count from erase_base, kept in an int16 */
+
+/*
+ * record_nr and state are programmed after the header, so they are not
+ * in the crc
+ */
+#define STORAGE_HEADER_CRC_LEN (STORAGE_HEADER_SIZE - 6)
+#define STORAGE_HEADER_RECORD_NR_OFFSET (STORAGE_HEADER_SIZE - 5)
+#define STORAGE_HEADER_STATE_OFFSET (STORAGE_HEADER_SIZE - 1)
+#define STORAGE_RECORD_NR_OPEN 0xFFFF
+
+/* check + 5 bytes of time + 3 bytes of temp/type */
+#define STORAGE_RECORD_MAX 9
+#define STORAGE_TYPE_BITS 2
+#define STORAGE_TYPE_MASK ((1 << STORAGE_TYPE_BITS) - 1)
+#define STORAGE_ERASED 0xFF
+#define STORAGE_COMMIT 0x80
+#define STORAGE_CUT 0x00 /* not a check, the records end here */
+
+#define STORAGE_COMMIT_TIME 600 /* second */
+
+/* sectors erased ahead, taken from the oldest ones when none is free */
+#define STORAGE_POOL_SIZE 2
+#define STORAGE_ERASE_COUNT_OFFSET 6
+
+enum {
+	STORAGE_SECTOR_RELEASED = 0x00,
+	STORAGE_SECTOR_LIVE = 0xFF,
+};
+
+enum {
+	RECORD_OK,
+	RECORD_COMMIT,
+	RECORD_END,
+	RECORD_BAD,
+};
+
+struct storage_header {
+	uint16 magic;
+	uint32 seq;
+	uint32 erase_count;
+	uint8 crc;
+	uint16 record_nr;
+	uint16 record_nr_inv; /* ~record_nr, programmed with it */
+	uint8 state;
+};
+
+struct storage_spare {
+	uint8 sector;
+	uint32 erase_count; /* for the header */
+	bool counted; /* erase_count programmed alone after the erase */
+};
+
+struct ther_storage {
+	struct flash_device *fd;
+	bool mounted;
+
+	uint8 sector_nr;
+	uint8 sector_used;
+	uint32 record_count;
+
+	/* the newest sector, the next record goes at head.offset */
+	struct storage_cursor head;
+	uint16 head_records;
+	uint16 head_uncommitted;
+	uint32 commit_time; /* UTC second */
+
+	uint32 head_seq; /* the highest sequence number, released sectors included */
+	uint8 tail; /* the oldest sector */
+	uint32 tail_seq;
+
+	/* the sector of each live sequence number, at [seq % sector_nr] */
+	uint8 index[STORAGE_SECTOR_MAX];
+
+	/*
+	 * as on the flash, in the header or alone for a spare sector, less
+	 * erase_base: the count of the sector 0 at mount. The sectors are worn
+	 * evenly, so they are far closer than 32K to each other
+	 */
+	uint32 erase_base;
+	int16 erase_count[STORAGE_SECTOR_MAX];
+
+	/* erased sectors for the next heads, in the order they are taken */
+	struct storage_spare pool[STORAGE_POOL_SIZE];
+	uint8 pool_nr;
+
+	/* the next sector to get its erase count after a format */
+	uint8 format_next;
+};
+static struct ther_storage ther_storage;
+
+/*
+ * crc-8, x^8 + x^2 + x + 1
+ */
+static uint8 storage_crc8(const uint8 *buf, uint8 len)
+{
+	uint8 crc = 0;
+	uint8 i;
+
+	while (len--) {
+		crc ^= *buf++;
+		for (i = 0; i < 8; i++)
+			crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+	}
+
+	return crc;
+}
+
+static uint8 record_check(const uint8 *buf, uint8 len)
+{
+	return storage_crc8(buf, len) % 127 + 1;
+}
+
+static uint32 zigzag(int32 val)
+{
+	return val < 0 ? ((uint32)(-(val + 1)) << 1) | 1 : (uint32)val << 1;
+}
+
+static int32 unzigzag(uint32 val)
+{
+	return (val & 1) ? -(int32)(val >> 1) - 1 : (int32)(val >> 1);
+}
+
+static uint8 put_varint(uint8 *buf, uint32 val)
+{
+	uint8 n = 0;
+
+	while (val >= 0x80) {
+		buf[n++] = (uint8)val | 0x80;
+		val >>= 7;
+	}
+	buf[n++] = (uint8)val;
+
+	return n;
+}
+
+/*
+ * return the record length
+ */
+static uint8 encode_record(uint8 *buf, struct storage_record *rec, struct storage_cursor *prev)
+{
+	uint8 n = 1;
+
+	n += put_varint(buf + n, zigzag((int32)(rec->time - prev->time)));
+	n += put_varint(buf + n, (zigzag((int32)rec->temp - (int32)prev->temp) << STORAGE_TYPE_BITS) |
+						(rec->type & STORAGE_TYPE_MASK));
+	buf[0] = record_check(buf + 1, n - 1);
+
+	return n;
+}
+
+static uint32 sector_addr(uint8 sector)
+{
+	return (uint32)sector * STORAGE_SECTOR_SIZE;
+}
+
+static bool read_header(struct ther_storage *s, uint8 sector, struct storage_header *hdr)
+{
+	s->fd->read(sector_addr(sector), hdr, STORAGE_HEADER_SIZE);
+
+	return hdr->magic == STORAGE_MAGIC &&
+		hdr->crc == storage_crc8((uint8 *)hdr, STORAGE_HEADER_CRC_LEN);
+}
+
+static bool header_live(struct storage_header *hdr)
+{
+	return hdr->state == STORAGE_SECTOR_LIVE;
+}
+
+/*
+ * erase count of a sector without a good header: erased for the pool,
+ * or never used
+ */
+static uint32 spare_erase_count(struct storage_header *hdr)
+{
+	if (hdr->magic == 0xFFFF && hdr->erase_count != 0xFFFFFFFF)
+		return hdr->erase_count;
+
+	return 0;
+}
+
+static uint32 erase_count_get(struct ther_storage *s, uint8 sector)
+{
+	return s->erase_base + s->erase_count[sector];
+}
+
+static void erase_count_set(struct ther_storage *s, uint8 sector, uint32 count)
+{
+	int32 diff = (int32)(count - s->erase_base);
+
+	if (diff > STORAGE_ERASE_DIFF_MAX)
+		diff = STORAGE_ERASE_DIFF_MAX;
+	else if (diff < -STORAGE_ERASE_DIFF_MAX)
+		diff = -STORAGE_ERASE_DIFF_MAX;
+
+	s->erase_count[sector] = (int16)diff;
+}
+
+static bool in_pool(struct ther_storage *s, uint8 sector)
+{
+	uint8 i;
+
+	for (i = 0; i < s->pool_nr; i++) {
+		if (s->pool[i].sector == sector)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/*
+ * FALSE if the sector is not closed, or the power was lost closing it
+ */
+static bool header_closed(struct storage_header *hdr)
+{
+	return hdr->record_nr != STORAGE_RECORD_NR_OPEN &&
+		hdr->record_nr_inv == (uint16)~hdr->record_nr;
+}
+
+/*
+ * the live sector holding [seq]
+ */
+static uint8 find_sector(struct ther_storage *s, uint32 seq)
+{
+	if (s->sector_used == 0 || seq < s->tail_seq || seq > s->head_seq)
+		return STORAGE_NO_SECTOR;
+
+	return s->index[seq % s->sector_nr];
+}
+
+/*
+ * a bit for each live sector, from the index
+ */
+static void live_map(struct ther_storage *s, uint8 *live)
+{
+	uint8 sector, i;
+
+	osal_memset(live, 0, STORAGE_SECTOR_MAX / 8);
+
+	for (i = 0; i < s->sector_used; i++) {
+		sector = s->index[(s->tail_seq + i) % s->sector_nr];
+		live[sector >> 3] |= BV(sector & 7);
+	}
+}
+
+static void cursor_start(struct storage_cursor *cursor, uint8 sector, uint32 seq)
+{
+	cursor->sector = sector;
+	cursor->seq = seq;
+	cursor->offset = STORAGE_HEADER_SIZE;
+	cursor->time = 0;
+	cursor->temp = 0;
+}
+
+/*
+ * decode the record at the cursor and move it to the next one.
+ * The records are read with the streaming read of the flash, so going
+ * through a sector is a single flash command.
+ */
+static uint8 cursor_next(struct ther_storage *s, struct storage_cursor *cursor,
+				struct storage_record *record)
+{
+	uint8 buf[STORAGE_RECORD_MAX];
+	uint16 room = STORAGE_SECTOR_SIZE - cursor->offset;
+	uint32 val[2];
+	uint8 n = 1, field, shift;
+
+	if (room == 0)
+		return RECORD_END;
+
+	/* the stream carries on if it is already at this record */
+	s->fd->stream_open(sector_addr(cursor->sector) + cursor->offset);
+	s->fd->stream_read(buf, 1);
+	if (buf[0] == STORAGE_ERASED)
+		return RECORD_END;
+
+	if (buf[0] == STORAGE_COMMIT) {
+		cursor->offset++;
+		return RECORD_COMMIT;
+	}
+
+	/* cut, or a torn commit byte */
+	if (buf[0] == STORAGE_CUT || (buf[0] & 0x80))
+		return RECORD_BAD;
+
+	for (field = 0; field < 2; field++) {
+		val[field] = 0;
+		shift = 0;
+
+		do {
+			if (n >= STORAGE_RECORD_MAX || n >= room)
+				return RECORD_BAD;
+
+			s->fd->stream_read(buf + n, 1);
+			val[field] |= (uint32)(buf[n] & 0x7F) << shift;
+			shift += 7;
+		} while (buf[n++] & 0x80);
+	}
+
+	if (record_check(buf + 1, n - 1) != buf[0])
+		return RECORD_BAD;
+
+	cursor->offset += n;
+	cursor->time += unzigzag(val[0]);
+	cursor->temp += (uint16)unzigzag(val[1] >> STORAGE_TYPE_BITS);
+
+	record->time = cursor->time;
+	record->temp = cursor->temp;
+	record->type = (uint8)(val[1] & STORAGE_TYPE_MASK);
+
+	return RECORD_OK;
+}
+
+/*
+ * the next record, over the commit bytes
+ */
+static uint8 cursor_next_record(struct ther_storage *s, struct storage_cursor *cursor,
+				struct storage_record *record)
+{
+	uint8 status;
+
+	while ((status = cursor_next(s, cursor, record)) == RECORD_COMMIT)
+		;
+
+	return status;
+}
+
+/*
+ * walk a sector to its end, return the number of good records
+ */
+static uint16 scan_sector(struct ther_storage *s, struct storage_cursor *cursor)
+{
+	struct storage_record record;
+	uint16 records = 0;
+
+	while (cursor_next_record(s, cursor, &record) == RECORD_OK)
+		records++;
+
+	s->fd->stream_close();
+
+	return records;
+}
+
+/*
+ * records in a sector which is not the head
+ */
+static uint16 sector_records(struct ther_storage *s, uint8 sector, struct storage_header *hdr)
+{
+	struct storage_cursor cursor;
+
+	if (header_closed(hdr))
+		return hdr->record_nr;
+
+	/* not closed, the power was lost, its records were on the flash already */
+	cursor_start(&cursor, sector, hdr->seq);
+	return scan_sector(s, &cursor);
+}
+
+/*
+ * TRUE if nothing is programmed from the cursor to the end of its sector
+ */
+static bool sector_erased_after(struct ther_storage *s, struct storage_cursor *cursor)
+{
+	uint8 buf[16];
+	uint16 offset, len, i;
+
+	s->fd->stream_open(sector_addr(cursor->sector) + cursor->offset);
+
+	for (offset = cursor->offset; offset < STORAGE_SECTOR_SIZE; offset += len) {
+		len = STORAGE_SECTOR_SIZE - offset < sizeof(buf) ? STORAGE_SECTOR_SIZE - offset : sizeof(buf);
+		s->fd->stream_read(buf, len);
+
+		for (i = 0; i < len; i++) {
+			if (buf[i] != STORAGE_ERASED) {
+				s->fd->stream_close();
+				return FALSE;
+			}
+		}
+	}
+
+	s->fd->stream_close();
+
+	return TRUE;
+}
+
+/*
+ * the head was being written when the power was lost, find where the
+ * committed records end
+ */
+static void recover_head(struct ther_storage *s, struct storage_header *hdr)
+{
+	struct storage_cursor commit;
+	struct storage_record record;
+	uint16 records = 0;
+	uint8 status, cut = STORAGE_CUT;
+
+	if (header_closed(hdr)) {
+		/* closed, the power was lost before the next sector got its header */
+		s->head_records = hdr->record_nr;
+		s->head.offset = STORAGE_SECTOR_SIZE;
+		return;
+	}
+
+	cursor_start(&s->head, s->head.sector, s->head_seq);
+	commit = s->head;
+	s->head_records = 0;
+
+	while ((status = cursor_next(s, &s->head, &record)) == RECORD_OK ||
+		status == RECORD_COMMIT) {
+		if (status == RECORD_OK) {
+			records++;
+		} else {
+			commit = s->head;
+			s->head_records = records;
+		}
+	}
+	s->fd->stream_close();
+
+	s->record_count += s->head_records;
+
+	if (s->head.offset == commit.offset && status == RECORD_END &&
+		sector_erased_after(s, &s->head))
+		return;
+
+	/* records not committed or torn, cut them off and go on in a new sector */
+	print(LOG_WRANING, MODULE "sector %d: %d records not committed, cut at %d\r\n",
+			s->head.sector, records - s->head_records, commit.offset);
+
+	if (commit.offset < STORAGE_SECTOR_SIZE) {
+		s->fd->program(sector_addr(commit.sector) + commit.offset, &cut, 1);
+		s->fd->flush();
+	}
+
+	s->head = commit;
+	s->head.offset = STORAGE_SECTOR_SIZE;
+}
+
+static void release_sector(struct ther_storage *s, uint8 sector)
+{
+	uint8 state = STORAGE_SECTOR_RELEASED;
+
+	s->fd->program(sector_addr(sector) + STORAGE_HEADER_STATE_OFFSET, &state, 1);
+}
+
+static void storage_mount(struct ther_storage *s)
+{
+	struct storage_header hdr, head_hdr;
+	uint32 live_seq = 0, count;
+	uint8 sector, open_nr = 0;
+	bool good;
+
+	s->head.sector = STORAGE_NO_SECTOR;
+	s->head_records = 0;
+	s->head_seq = 0;
+	s->tail = STORAGE_NO_SECTOR;
+	s->tail_seq = 0;
+	s->sector_used = 0;
+	s->record_count = 0;
+	s->pool_nr = 0;
+	s->format_next = STORAGE_NO_SECTOR;
+
+	for (sector = 0; sector < s->sector_nr; sector++) {
+		good = read_header(s, sector, &hdr);
+		count = good ? hdr.erase_count : spare_erase_count(&hdr);
+		if (sector == 0)
+			s->erase_base = count;
+		erase_count_set(s, sector, count);
+
+		if (!good)
+			continue;
+
+		if (hdr.seq > s->head_seq)
+			s->head_seq = hdr.seq;
+
+		if (!header_live(&hdr))
+			continue;
+
+		s->sector_used++;
+		s->index[hdr.seq % s->sector_nr] = sector;
+
+		if (s->head.sector == STORAGE_NO_SECTOR || hdr.seq > live_seq) {
+			s->head.sector = sector;
+			live_seq = hdr.seq;
+			head_hdr = hdr;
+		}
+
+		if (s->tail == STORAGE_NO_SECTOR || hdr.seq < s->tail_seq) {
+			s->tail = sector;
+			s->tail_seq = hdr.seq;
+		}
+
+		if (header_closed(&hdr))
+			s->record_count += hdr.record_nr;
+		else
+			open_nr++;
+	}
+
+	/*
+	 * a newer sector is released or there is a gap, the power was lost in
+	 * ther_storage_clear(), finish it so the live sequence numbers have no gap
+	 */
+	if (s->sector_used &&
+		(live_seq != s->head_seq || s->sector_used != live_seq - s->tail_seq + 1)) {
+		print(LOG_WRANING, MODULE "clear was broken, release the rest\r\n");
+
+		for (sector = 0; sector < s->sector_nr; sector++) {
+			if (read_header(s, sector, &hdr) && header_live(&hdr))
+				release_sector(s, sector);
+		}
+		s->fd->flush();
+
+		s->head.sector = STORAGE_NO_SECTOR;
+		s->tail = STORAGE_NO_SECTOR;
+		s->sector_used = 0;
+		s->record_count = 0;
+		open_nr = 0;
+	}
+
+	if (s->head.sector != STORAGE_NO_SECTOR && !header_closed(&head_hdr))
+		open_nr--;
+
+	/* only the head should be open, the others lost the power before closing */
+	if (open_nr) {
+		for (sector = 0; sector < s->sector_nr; sector++) {
+			if (sector != s->head.sector && read_header(s, sector, &hdr) && header_live(&hdr) &&
+				!header_closed(&hdr))
+				s->record_count += sector_records(s, sector, &hdr);
+		}
+	}
+
+	if (s->head.sector != STORAGE_NO_SECTOR)
+		recover_head(s, &head_hdr);
+
+	s->head_uncommitted = 0;
+	s->commit_time = osal_getClock();
+
+	print(LOG_INFO, MODULE "mount: %d sectors used, %ld records, head %d/%d, tail %d\r\n",
+			s->sector_used, s->record_count, s->head.sector, s->head.offset, s->tail);
+}
+
+/*
+ * the free sector with the lowest erase count, the oldest sector if none
+ * is free. Sectors in the pool are not free.
+ */
+static uint8 alloc_sector(struct ther_storage *s, uint32 *erase_count)
+{
+	struct storage_header hdr;
+	uint8 live[STORAGE_SECTOR_MAX / 8];
+	uint8 i, sector, best = STORAGE_NO_SECTOR;
+	uint32 best_count = 0;
+
+	live_map(s, live);
+
+	for (i = 1; i <= s->sector_nr; i++) {
+		/* start after the head, so equally worn sectors are used in turn */
+		sector = (s->head.sector == STORAGE_NO_SECTOR) ? i - 1 : (s->head.sector + i) % s->sector_nr;
+
+		if ((live[sector >> 3] & BV(sector & 7)) || in_pool(s, sector))
+			continue;
+
+		if (best == STORAGE_NO_SECTOR || erase_count_get(s, sector) < best_count) {
+			best = sector;
+			best_count = erase_count_get(s, sector);
+		}
+	}
+
+	if (best == STORAGE_NO_SECTOR) {
+		/* the oldest sector is gone */
+		best = s->tail;
+		best_count = erase_count_get(s, best);
+		if (read_header(s, best, &hdr))
+			s->record_count -= sector_records(s, best, &hdr);
+
+		s->sector_used--;
+		s->tail_seq++;
+		s->tail = find_sector(s, s->tail_seq);
+	}
+
+	*erase_count = best_count;
+
+	return best;
+}
+
+/*
+ * close the head and make a newly erased sector the new head
+ */
+static bool start_sector(struct ther_storage *s)
+{
+	struct storage_header hdr;
+	uint32 erase_count;
+	uint16 record_nr[2];
+	uint8 sector;
+
+	if (s->head.sector != STORAGE_NO_SECTOR) {
+		/* closing commits the records, they must be on the flash first */
+		s->fd->sync();
+
+		record_nr[0] = s->head_records;
+		record_nr[1] = ~s->head_records;
+		s->fd->program(sector_addr(s->head.sector) + STORAGE_HEADER_RECORD_NR_OFFSET,
+				record_nr, sizeof(record_nr));
+	}
+
+	if (s->pool_nr) {
+		/* erased already */
+		sector = s->pool[0].sector;
+		erase_count = s->pool[0].erase_count;
+
+		s->pool_nr--;
+		osal_memcpy(s->pool, s->pool + 1, s->pool_nr * sizeof(s->pool[0]));
+	} else {
+		sector = alloc_sector(s, &erase_count);
+		erase_count++;
+
+		if (s->fd->erase(sector) != FL_EOK) {
+			print(LOG_ERR, MODULE "erase sector %d failed\r\n", sector);
+			return FALSE;
+		}
+	}
+
+	/* the erase count of a pool sector is programmed again with its value */
+	hdr.magic = STORAGE_MAGIC;
+	hdr.seq = s->head_seq + 1;
+	hdr.erase_count = erase_count;
+	hdr.crc = storage_crc8((uint8 *)&hdr, STORAGE_HEADER_CRC_LEN);
+	hdr.record_nr = STORAGE_RECORD_NR_OPEN;
+	hdr.record_nr_inv = STORAGE_RECORD_NR_OPEN;
+	hdr.state = STORAGE_SECTOR_LIVE;
+	s->fd->program(sector_addr(sector), &hdr, STORAGE_HEADER_SIZE);
+	erase_count_set(s, sector, erase_count);
+
+	/* the erase count must survive a power loss */
+	s->fd->flush();
+
+	if (s->sector_used == 0) {
+		s->tail = sector;
+		s->tail_seq = hdr.seq;
+	}
+
+	cursor_start(&s->head, sector, hdr.seq);
+	s->head_records = 0;
+	s->head_uncommitted = 0;
+	s->head_seq = hdr.seq;
+	s->sector_used++;
+	s->index[hdr.seq % s->sector_nr] = sector;
+
+	return TRUE;
+}
+
+/*
+ * program a commit byte after the records once they are on the flash
+ */
+static void storage_commit(struct ther_storage *s)
+{
+	uint8 commit = STORAGE_COMMIT;
+
+	s->commit_time = osal_getClock();
+
+	if (s->head_uncommitted == 0) {
+		s->fd->flush();
+		return;
+	}
+
+	s->fd->sync();
+	s->fd->program(sector_addr(s->head.sector) + s->head.offset, &commit, 1);
+	s->fd->flush();
+
+	s->head.offset++;
+	s->head_uncommitted = 0;
+}
+
+bool ther_storage_append(uint8 type, uint16 temp)
+{
+	struct ther_storage *s = &ther_storage;
+	struct storage_record rec;
+	uint8 buf[STORAGE_RECORD_MAX];
+	uint8 len = 0;
+
+	if (!s->mounted)
+		return FALSE;
+
+	rec.time = osal_getClock();
+	rec.temp = temp;
+	rec.type = type;
+
+	if (s->head.sector != STORAGE_NO_SECTOR)
+		len = encode_record(buf, &rec, &s->head);
+
+	/* keep a byte for the commit */
+	if (s->head.sector == STORAGE_NO_SECTOR || len >= STORAGE_SECTOR_SIZE - s->head.offset) {
+		if (!start_sector(s))
+			return FALSE;
+
+		len = encode_record(buf, &rec, &s->head);
+	}
+
+	s->fd->program(sector_addr(s->head.sector) + s->head.offset, buf, len);
+
+	s->head.offset += len;
+	s->head.time = rec.time;
+	s->head.temp = rec.temp;
+	s->head_records++;
+	s->head_uncommitted++;
+	s->record_count++;
+
+	if (rec.time - s->commit_time >= STORAGE_COMMIT_TIME)
+		storage_commit(s);
+
+	return TRUE;
+}
+
+/*
+ * commit the records, the ones still in the write buffer of the flash
+ * included, they survive a power loss after this
+ */
+void ther_storage_flush(void)
+{
+	struct ther_storage *s = &ther_storage;
+
+	if (s->mounted)
+		storage_commit(s);
+}
+
+/*
+ * the flash is ready: program the erase counts of a format, then the ones
+ * of the pool sectors, a page program at a time, the next one when that
+ * one is done
+ */
+static void storage_flash_ready(struct ther_storage *s)
+{
+	struct storage_spare *spare;
+	uint32 count;
+	uint8 i;
+
+	/* a sector taken as the head meanwhile gets the count of its header again */
+	while (s->format_next != STORAGE_NO_SECTOR && !s->fd->busy()) {
+		count = erase_count_get(s, s->format_next);
+		s->fd->program(sector_addr(s->format_next) + STORAGE_ERASE_COUNT_OFFSET, &count, sizeof(count));
+		s->fd->flush();
+
+		if (++s->format_next == s->sector_nr) {
+			s->format_next = STORAGE_NO_SECTOR;
+			print(LOG_INFO, MODULE "format: erase counts done\r\n");
+		}
+	}
+
+	for (i = 0; i < s->pool_nr && !s->fd->busy(); i++) {
+		spare = &s->pool[i];
+		if (spare->counted)
+			continue;
+
+		s->fd->program(sector_addr(spare->sector) + STORAGE_ERASE_COUNT_OFFSET,
+				&spare->erase_count, sizeof(spare->erase_count));
+		s->fd->flush();
+		spare->counted = TRUE;
+	}
+}
+
+/*
+ * erase a sector for the pool. The erase runs in the background, the
+ * flash stays up until it is done and the next idle event erases the
+ * next one.
+ */
+static void storage_erase_ahead(struct ther_storage *s)
+{
+	struct storage_spare *spare;
+	uint32 erase_count;
+	uint8 sector;
+
+	/* the oldest sector must not be the head */
+	if (s->pool_nr >= STORAGE_POOL_SIZE || s->sector_nr <= STORAGE_POOL_SIZE + 1)
+		return;
+
+	sector = alloc_sector(s, &erase_count);
+	erase_count++;
+
+	if (s->fd->erase(sector) != FL_EOK) {
+		print(LOG_ERR, MODULE "erase sector %d failed\r\n", sector);
+		return;
+	}
+	erase_count_set(s, sector, erase_count);
+
+	spare = &s->pool[s->pool_nr++];
+	spare->sector = sector;
+	spare->erase_count = erase_count;
+	spare->counted = FALSE;
+
+	/* a flash without a background erase is done already */
+	storage_flash_ready(s);
+
+	print(LOG_DBG, MODULE "sector %d erased ahead, %d in the pool\r\n", sector, s->pool_nr);
+}
+
+/*
+ * TH_FLASH_IDLE_EVT, before the flash goes to power-down: commit the
+ * records that have waited STORAGE_COMMIT_TIME, erase ahead for the pool.
+ * The commit time holds without another append, when the records stop.
+ *
+ * return: ms until the records waiting now must be committed, 0: none
+ */
+uint32 ther_storage_idle(void)
+{
+	struct ther_storage *s = &ther_storage;
+	uint32 waited;
+
+	if (!s->mounted)
+		return 0;
+
+	/* both would wait for the erase/program, the event comes back after it */
+	if (!s->fd->busy()) {
+		if (s->head_uncommitted && osal_getClock() - s->commit_time >= STORAGE_COMMIT_TIME)
+			storage_commit(s);
+
+		storage_erase_ahead(s);
+	}
+
+	if (!s->head_uncommitted)
+		return 0;
+
+	waited = osal_getClock() - s->commit_time;
+	if (waited >= STORAGE_COMMIT_TIME)
+		return 1;
+
+	return (STORAGE_COMMIT_TIME - waited) * 1000UL;
+}
+
+/*
+ * TH_FLASH_EVT, the flash is done with its erase/program
+ */
+void ther_storage_ready(void)
+{
+	struct ther_storage *s = &ther_storage;
+
+	if (s->mounted)
+		storage_flash_ready(s);
+}
+
+/*
+ * before PM3, no flash event comes: commit the records and wait until
+ * they and the erase counts left for the flash events are programmed
+ */
+void ther_storage_sync(void)
+{
+	struct ther_storage *s = &ther_storage;
+
+	if (!s->mounted)
+		return;
+
+	storage_commit(s);
+	do {
+		s->fd->sync();
+		storage_flash_ready(s);
+	} while (s->fd->busy());
+}
+
+/*
+ * release all the sectors, their records are gone. The newest first: a
+ * clear cut in the middle leaves a released sector newer than the live
+ * ones, so the mount sees it and finishes the clear
+ */
+void ther_storage_clear(void)
+{
+	struct ther_storage *s = &ther_storage;
+	uint8 i;
+
+	if (!s->mounted)
+		return;
+
+	for (i = s->sector_used; i > 0; i--)
+		release_sector(s, s->index[(s->tail_seq + i - 1) % s->sector_nr]);
+	s->fd->flush();
+
+	s->head.sector = STORAGE_NO_SECTOR;
+	s->head_records = 0;
+	s->tail = STORAGE_NO_SECTOR;
+	s->sector_used = 0;
+	s->record_count = 0;
+}
+
+/*
+ * factory reset: erase all the sectors, with the block erases of the
+ * flash. It returns once the erase is started. The erase counts are
+ * kept: once the erase is done, every sector gets its count + 1
+ * programmed alone, as a sector of the pool has it, from the flash events,
+ * see storage_flash_ready(). A power loss before that leaves the sectors
+ * not done yet at 0. The sectors with the lowest counts go to the pool,
+ * the records appended meanwhile wait in the write buffer for the erase.
+ */
+void ther_storage_format(void)
+{
+	struct ther_storage *s = &ther_storage;
+	struct storage_spare *spare;
+	uint8 sector;
+
+	if (!s->mounted)
+		return;
+
+	if (s->fd->erase_range(0, s->sector_nr) != FL_EOK) {
+		print(LOG_ERR, MODULE "format failed\r\n");
+		return;
+	}
+
+	for (sector = 0; sector < s->sector_nr; sector++)
+		erase_count_set(s, sector, erase_count_get(s, sector) + 1);
+
+	s->head.sector = STORAGE_NO_SECTOR;
+	s->head_records = 0;
+	s->head_uncommitted = 0;
+	s->head_seq = 0;
+	s->tail = STORAGE_NO_SECTOR;
+	s->tail_seq = 0;
+	s->sector_used = 0;
+	s->record_count = 0;
+	s->pool_nr = 0;
+
+	/* erased, and counted with the others */
+	while (s->pool_nr < STORAGE_POOL_SIZE && s->pool_nr < s->sector_nr) {
+		spare = &s->pool[s->pool_nr];
+		spare->sector = alloc_sector(s, &spare->erase_count);
+		spare->counted = TRUE;
+		s->pool_nr++;
+	}
+
+	/* a flash without a background erase is done already */
+	s->format_next = 0;
+	storage_flash_ready(s);
+
+	print(LOG_INFO, MODULE "format: %d sectors\r\n", s->sector_nr);
+}
+
+/*
+ * erase counts of all the sectors
+ */
+void ther_storage_get_wear(struct storage_wear_stat *stat)
+{
+	struct ther_storage *s = &ther_storage;
+	uint32 count;
+	uint8 sector;
+
+	stat->erase_min = 0;
+	stat->erase_max = 0;
+	stat->erase_total = 0;
+
+	if (!s->mounted)
+		return;
+
+	for (sector = 0; sector < s->sector_nr; sector++) {
+		count = erase_count_get(s, sector);
+
+		if (sector == 0 || count < stat->erase_min)
+			stat->erase_min = count;
+		if (count > stat->erase_max)
+			stat->erase_max = count;
+		stat->erase_total += count;
+	}
+
+	print(LOG_INFO, MODULE "erase count: min %ld, max %ld, avg %ld\r\n",
+			stat->erase_min, stat->erase_max, stat->erase_total / s->sector_nr);
+}
+
+uint32 ther_storage_count(void)
+{
+	struct ther_storage *s = &ther_storage;
+
+	return s->mounted ? s->record_count : 0;
+}
+
+void ther_storage_rewind(struct storage_cursor *cursor)
+{
+	struct ther_storage *s = &ther_storage;
+
+	cursor_start(cursor, s->mounted ? s->tail : STORAGE_NO_SECTOR, s->tail_seq);
+}
+
+/*
+ * return FALSE after the newest record. A sector is left at its first bad
+ * record, the deltas after it cannot be trusted.
+ */
+bool ther_storage_read_next(struct storage_cursor *cursor, struct storage_record *record)
+{
+	struct ther_storage *s = &ther_storage;
+
+	while (cursor->sector != STORAGE_NO_SECTOR) {
+		if (cursor_next_record(s, cursor, record) == RECORD_OK)
+			return TRUE;
+
+		if (cursor->seq == s->head_seq)
+			break;
+
+		cursor_start(cursor, find_sector(s, cursor->seq + 1), cursor->seq + 1);
+	}
+
+	s->fd->stream_close();
+
+	return FALSE;
+}
+
+/*
+ * move the cursor to the first record of the sector [seq], or of the oldest
+ * sector if [seq] is gone already.
+ * return FALSE if there is no such sector
+ */
+bool ther_storage_seek_seq(struct storage_cursor *cursor, uint32 seq)
+{
+	struct ther_storage *s = &ther_storage;
+
+	if (!s->mounted || s->sector_used == 0 || seq > s->head_seq)
+		return FALSE;
+
+	if (seq < s->tail_seq)
+		seq = s->tail_seq;
+
+	cursor_start(cursor, find_sector(s, seq), seq);
+
+	return TRUE;
+}
+
+/*
+ * time of the first record of the sector [seq], a sector without a good
+ * first record is taken as older than any time
+ */
+static uint32 sector_first_time(struct ther_storage *s, uint32 seq, bool *empty)
+{
+	struct storage_cursor cursor;
+	struct storage_record record;
+	uint8 status;
+
+	cursor_start(&cursor, find_sector(s, seq), seq);
+	status = cursor_next_record(s, &cursor, &record);
+	s->fd->stream_close();
+
+	*empty = (status == RECORD_END);
+
+	return status == RECORD_OK ? record.time : 0;
+}
+
+/*
+ * move the cursor to the first record at or after [time], the records are
+ * taken in time order. Only the first record of log2(sector_used) sectors
+ * and the records of one sector before [time] are read.
+ * return FALSE if there is no record that new
+ */
+bool ther_storage_seek_time(struct storage_cursor *cursor, uint32 time)
+{
+	struct ther_storage *s = &ther_storage;
+	struct storage_cursor prev;
+	struct storage_record record;
+	uint32 lo, hi, mid;
+	bool empty;
+
+	if (!s->mounted || s->sector_used == 0)
+		return FALSE;
+
+	/* the newest sector with the first record not after [time] */
+	lo = s->tail_seq;
+	hi = s->head_seq;
+	while (lo < hi) {
+		mid = lo + (hi - lo + 1) / 2;
+		if (sector_first_time(s, mid, &empty) <= time && !empty)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	cursor_start(cursor, find_sector(s, lo), lo);
+
+	for (;;) {
+		prev = *cursor;
+		if (!ther_storage_read_next(cursor, &record))
+			return FALSE;
+
+		if (record.time >= time) {
+			*cursor = prev;
+			return TRUE;
+		}
+	}
+}
+
+uint8 ther_storage_init(struct flash_device *fd)
+{
+	struct ther_storage *s = &ther_storage;
+	uint8 ret;
+
+	s->mounted = FALSE;
+	s->fd = fd;
+
+	ret = fd->open();
+	if (ret != FL_EOK) {
+		print(LOG_ERR, MODULE "flash open failed\r\n");
+		return ret;
+	}
+
+	s->sector_nr = fd->sector_count < STORAGE_SECTOR_MAX ? (uint8)fd->sector_count : STORAGE_SECTOR_MAX;
+	storage_mount(s);
+	s->mounted = TRUE;
+
+	return FL_EOK;
+}
@@ -0,0 +1,51 @@
+#ifndef __THER_STORAGE_H__
+#define __THER_STORAGE_H__
+
+enum {
+	STORAGE_TYPE_TEMP = 1,
+};
+
+/*
+ * one measurement, delta coded on the flash
+ */
+struct storage_record {
+	uint32 time; /* UTC second */
+	uint16 temp; /* 0.1 du */
+	uint8 type; /* 0..3 */
+};
+
+/*
+ * read position, from the oldest record to the newest one
+ */
+struct storage_cursor {
+	uint8 sector;
+	uint16 offset; /* of the next record in the sector */
+	uint32 seq; /* of the sector */
+
+	/* the record before, the next one is a delta of it */
+	uint32 time;
+	uint16 temp;
+};
+
+struct storage_wear_stat {
+	uint32 erase_min;
+	uint32 erase_max;
+	uint32 erase_total;
+};
+
+uint8 ther_storage_init(struct flash_device *fd);
+bool ther_storage_append(uint8 type, uint16 temp);
+void ther_storage_flush(void);
+uint32 ther_storage_idle(void);
+void ther_storage_ready(void);
+void ther_storage_sync(void);
+void ther_storage_clear(void);
+void ther_storage_format(void);
+void ther_storage_get_wear(struct storage_wear_stat *stat);
+uint32 ther_storage_count(void);
+void ther_storage_rewind(struct storage_cursor *cursor);
+bool ther_storage_read_next(struct storage_cursor *cursor, struct storage_record *record);
+bool ther_storage_seek_seq(struct storage_cursor *cursor, uint32 seq);
+bool ther_storage_seek_time(struct storage_cursor *cursor, uint32 time);
+
+#endif
@@ -10,6 +10,7 @@
 
 #include "ther_adc.h"
 #include "ther_temp_cal.h"
+#include "ther_temp.h"
 
 #define MODULE "[THER TEMP] "
 
@@ -32,50 +33,127 @@
 #define HIGH_PRESISION_TEMP_MIN 290
 #define HIGH_PRESISION_TEMP_MAX 450
 
+/*
+ * switch to high presision inside [MIN + HYST, MAX - HYST],
+ * back to low presision outside [MIN - HYST, MAX + HYST]
+ */
+#define PRESISION_TEMP_HYST 5
+
+/*
+ * Every reading is a burst of TEMP_BURST_SAMPLES conversions (132us each)
+ * on both channels, the TEMP_BURST_TRIM lowest and highest samples of each
+ * channel are dropped and the rest are averaged. "make bench" in Tools/
+ * gives the noise left and the LDO on-time for other values.
+ */
+#ifndef TEMP_BURST_SAMPLES
+#define TEMP_BURST_SAMPLES 8
+#endif
+#ifndef TEMP_BURST_TRIM
+#define TEMP_BURST_TRIM 2
+#endif
+
+/*
+ * After the LDO is on, Vref(AIN7) is polled with fast 10-bit conversions
+ * against AVDD, it is settled once TEMP_SETTLE_COUNT readings in a row are
+ * above TEMP_SETTLE_MIN_ADC and within TEMP_SETTLE_DELTA of each other.
+ * The measurement goes on anyway after TEMP_SETTLE_MAX_TIME.
+ */
+#define TEMP_SETTLE_MAX_TIME 100 /* ms */
+#define TEMP_SETTLE_MIN_ADC 64
+#define TEMP_SETTLE_DELTA 2
+#define TEMP_SETTLE_COUNT 2
+
 struct ther_temp {
 	unsigned char presision_used;
 
 	unsigned short low_presision_pre_adc;
 	unsigned short low_presision_pre_temp;
+
+	/* LDO settling */
+	unsigned long power_on_time; /* ms */
+	unsigned short vref_last;
+	unsigned char settle_count;
+
+	struct ther_temp_power_stat power_stat;
+
+	/* of ther_temp_measure() */
+	void (*callback)(unsigned short temp);
 };
 static struct ther_temp ther_temp;
 
+/* AIN0, AIN1, AIN0, AIN1, ... */
+static unsigned short adc_burst_buf[TEMP_BURST_SAMPLES * 2];
+static unsigned short adc_channel_buf[TEMP_BURST_SAMPLES];
+
 
 static void enable_ldo(void)
 {
+	struct ther_temp *t = &ther_temp;
+
 	LDO_ENABLE_PIN = 1;
+
+	t->power_on_time = osal_GetSystemClock();
+	t->vref_last = 0;
+	t->settle_count = 0;
 }
 
 static void disable_ldo(void)
 {
+	struct ther_temp *t = &ther_temp;
+	struct ther_temp_power_stat *stat = &t->power_stat;
+
 	LDO_ENABLE_PIN = 0;
+
+	stat->ldo_on_last = (unsigned short)(osal_GetSystemClock() - t->power_on_time);
+	stat->ldo_on_total += stat->ldo_on_last;
+	stat->measure_count++;
+
+	print(LOG_DBG, MODULE "ldo on %d ms, avg %ld ms\r\n",
+			stat->ldo_on_last, stat->ldo_on_total / stat->measure_count);
 }
 
 /*
- *  channel 0(AIN0) is high presision
- *  channel 1(AIN1) is low presision
+ * sort, drop the outliers, average the rest
  */
-static unsigned short ther_get_temp(unsigned char presision)
+static unsigned short trimmed_mean(unsigned short *buf, unsigned char n, unsigned char trim)
 {
-	unsigned short adc_val, temp;
-	float sensor_res;
-	unsigned char channel;
-
-	if (presision == HIGH_PRESISION) {
-		channel = HAL_ADC_CHANNEL_0;
-	} else {
-		channel = HAL_ADC_CHANNEL_1;
+	unsigned char i, j;
+	unsigned short val;
+	unsigned long sum = 0;
+
+	/* insertion sort, n is small */
+	for (i = 1; i < n; i++) {
+		val = buf[i];
+		for (j = i; j > 0 && buf[j - 1] > val; j--)
+			buf[j] = buf[j - 1];
+		buf[j] = val;
 	}
 
-	adc_val = read_adc(channel, HAL_ADC_RESOLUTION_14, HAL_ADC_REF_AIN7);
+	if (n <= trim * 2)
+		return buf[n / 2];
 
-	sensor_res = temp_cal_get_res_by_adc(presision, adc_val);
-	temp = temp_cal_get_temp_by_res(sensor_res);
+	for (i = trim; i < n - trim; i++)
+		sum += buf[i];
 
-	print(LOG_DBG, MODULE "ch %d adc %d, Rsensor %f, temp %d\r\n",
-			channel, adc_val, sensor_res, temp);
+	n -= trim * 2;
 
-	return temp;
+	return (unsigned short)((sum + n / 2) / n);
+}
+
+/*
+ * adc_burst_buf => adc[HIGH_PRESISION], adc[LOW_PRESISION]
+ */
+static void ther_filter_adc(unsigned short *adc)
+{
+	unsigned char i, presision;
+
+	/* HIGH_PRESISION is AIN0, the first one of each pair */
+	for (presision = HIGH_PRESISION; presision <= LOW_PRESISION; presision++) {
+		for (i = 0; i < TEMP_BURST_SAMPLES; i++)
+			adc_channel_buf[i] = adc_burst_buf[i * 2 + presision];
+
+		adc[presision] = trimmed_mean(adc_channel_buf, TEMP_BURST_SAMPLES, TEMP_BURST_TRIM);
+	}
 }
 
 void ther_temp_power_on(void)
@@ -84,29 +162,118 @@ void ther_temp_power_on(void)
 }
 
 /*
+ * return TRUE when the measurement can start
+ */
+bool ther_temp_power_settled(void)
+{
+	struct ther_temp *t = &ther_temp;
+	unsigned short vref, delta;
+
+	if (osal_GetSystemClock() - t->power_on_time >= TEMP_SETTLE_MAX_TIME) {
+		print(LOG_WRANING, MODULE "vref not settled in %d ms\r\n", TEMP_SETTLE_MAX_TIME);
+		t->power_stat.settle_timeout++;
+		return TRUE;
+	}
+
+	vref = read_adc(HAL_ADC_CHANNEL_7, HAL_ADC_RESOLUTION_10, HAL_ADC_REF_AVDD);
+
+	/* read_adc() disables the input, but AIN7 is the reference of the temp channels */
+	ADCCFG |= BV(ADC_REF_VOLTAGE_BIT);
+
+	delta = vref > t->vref_last ? vref - t->vref_last : t->vref_last - vref;
+	t->vref_last = vref;
+
+	if (vref < TEMP_SETTLE_MIN_ADC || delta > TEMP_SETTLE_DELTA) {
+		t->settle_count = 0;
+		return FALSE;
+	}
+
+	return ++t->settle_count >= TEMP_SETTLE_COUNT;
+}
+
+const struct ther_temp_power_stat *ther_temp_get_power_stat(void)
+{
+	return &ther_temp.power_stat;
+}
+
+/*
+ * adc of both channels => temp, with the presision switch, LDO off
+ *
  * return value: 377 => 37.7 du
  */
-unsigned short ther_get_current_temp(void)
+static unsigned short ther_temp_by_adc(unsigned short *adc)
 {
 	struct ther_temp *t = &ther_temp;
-	unsigned short temp; /* 377 => 37.7 du */
+	unsigned short temp_high, temp_low; /* 377 => 37.7 du */
+	unsigned short temp;
+
+	adc[HIGH_PRESISION] = adc_cal_apply(adc[HIGH_PRESISION]);
+	adc[LOW_PRESISION] = adc_cal_apply(adc[LOW_PRESISION]);
+
+	temp_high = temp_cal_get_temp(HIGH_PRESISION, adc[HIGH_PRESISION]);
+	temp_low = temp_cal_get_temp(LOW_PRESISION, adc[LOW_PRESISION]);
 
-	temp = ther_get_temp(t->presision_used);
+	print(LOG_DBG, MODULE "adc %d/%d, temp %d/%d (high/low)\r\n",
+			adc[HIGH_PRESISION], adc[LOW_PRESISION], temp_high, temp_low);
 
-	if ((t->presision_used == LOW_PRESISION) && (temp > HIGH_PRESISION_TEMP_MIN) && (temp < HIGH_PRESISION_TEMP_MAX)) {
+	/*
+	 * high presision is only valid around HIGH_PRESISION_TEMP_MIN..MAX,
+	 * so the low presision one decides when to switch to it
+	 */
+	if ((t->presision_used == LOW_PRESISION) &&
+		(temp_low > HIGH_PRESISION_TEMP_MIN + PRESISION_TEMP_HYST) &&
+		(temp_low < HIGH_PRESISION_TEMP_MAX - PRESISION_TEMP_HYST)) {
 		print(LOG_INFO, MODULE "change to high presision\r\n");
 		t->presision_used = HIGH_PRESISION;
 
-	} else if ((t->presision_used == HIGH_PRESISION) && (temp < HIGH_PRESISION_TEMP_MIN || temp > HIGH_PRESISION_TEMP_MAX)) {
+	} else if ((t->presision_used == HIGH_PRESISION) &&
+		(temp_high < HIGH_PRESISION_TEMP_MIN - PRESISION_TEMP_HYST ||
+		temp_high > HIGH_PRESISION_TEMP_MAX + PRESISION_TEMP_HYST)) {
 		print(LOG_INFO, MODULE "change to low presision\r\n");
 		t->presision_used = LOW_PRESISION;
 	}
 
+	temp = (t->presision_used == HIGH_PRESISION) ? temp_high : temp_low;
+
 	disable_ldo();
 
 	return temp;
 }
 
+static void ther_temp_burst_done(unsigned char n)
+{
+	struct ther_temp *t = &ther_temp;
+	unsigned short adc[2];
+
+	ther_filter_adc(adc);
+
+	t->callback(ther_temp_by_adc(adc));
+}
+
+/*
+ *  channel 0(AIN0) is high presision
+ *  channel 1(AIN1) is low presision
+ *
+ *  Both are converted in the same LDO window, so the presision used
+ *  can be changed without waiting for the next measurement. The burst
+ *  is converted from the ADC isr, callback gets the temp (377 => 37.7 du)
+ *  from the thermometer task (TH_ADC_EVT). The LDO must be settled.
+ *
+ * return: FALSE if the ADC is busy with another async conversion
+ */
+bool ther_temp_measure(void (*callback)(unsigned short temp))
+{
+	struct ther_temp *t = &ther_temp;
+
+	adc_cal_update(HAL_ADC_REF_AIN7);
+
+	t->callback = callback;
+
+	return read_adc_sequence_async(HAL_ADC_CHANNEL_0, HAL_ADC_CHANNEL_1, HAL_ADC_RESOLUTION_14,
+					HAL_ADC_REF_AIN7, adc_burst_buf, TEMP_BURST_SAMPLES * 2,
+					ther_temp_burst_done);
+}
+
 
 void ther_temp_init(void)
 {
@@ -115,6 +282,9 @@ void ther_temp_init(void)
 	print(LOG_INFO, MODULE "temp init\r\n");
 
 	t->presision_used = LOW_PRESISION;
+	osal_memset(&t->power_stat, 0, sizeof(t->power_stat));
+
+	temp_cal_init();
 
 	/*
 	 * init adc pins:
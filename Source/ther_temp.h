@@ -4,11 +4,25 @@
 
 enum {
 	TEMP_STAGE_SETUP,
+	TEMP_STAGE_SETTLE,
 	TEMP_STAGE_MEASURE,
+	TEMP_STAGE_CONVERT, /* until the callback of ther_temp_measure() */
 };
 
-unsigned short ther_get_current_temp(void);
+/*
+ * LDO on-time of the measurements
+ */
+struct ther_temp_power_stat {
+	unsigned long measure_count;
+	unsigned long ldo_on_total; /* ms */
+	unsigned short ldo_on_last; /* ms */
+	unsigned long settle_timeout;
+};
+
+bool ther_temp_measure(void (*callback)(unsigned short temp));
 void ther_temp_power_on(void);
+bool ther_temp_power_settled(void);
+const struct ther_temp_power_stat *ther_temp_get_power_stat(void);
 void ther_temp_init(void);
 
 #endif
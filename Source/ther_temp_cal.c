@@ -2,7 +2,8 @@
 #include "Comdef.h"
 #include "OSAL.h"
 #include "hal_board.h"
-#include "math.h"
+#include "bcomdef.h"
+#include "osal_snv.h"
 
 #include "ther_uart.h"
 #include "ther_uart_comm.h"
@@ -11,52 +12,387 @@
 
 #define MODULE "[TEMP CAL] "
 
-float temp_cal_get_res_by_adc(unsigned char channel, unsigned short adc_val)
+/*
+ * per-device correction, saved in SNV
+ *
+ * Every point maps a temp read by this device (raw) to the temp of the
+ * reference thermometer (ref), both in 0.1 du. Points are sorted by raw,
+ * temps between two points are linearly interpolated, temps outside of the
+ * points get the offset of the nearest point.
+ */
+#define TEMP_CAL_NV_ID BLE_NVID_CUST_START
+#define TEMP_CAL_VERSION 1
+#define TEMP_CAL_POINT_NR 4
+
+/* reject points that correct more than this */
+#define TEMP_CAL_MAX_OFFSET 50 /* 0.1 du */
+
+/*
+ * a point takes the last raw temp, it must be from the temp the reference
+ * reads now: in calibration the thermometer task measures every 2 s
+ */
+#define TEMP_CAL_MAX_AGE 10000 /* ms */
+
+struct temp_cal_point {
+	unsigned short raw;
+	unsigned short ref;
+};
+
+struct temp_cal_data {
+	unsigned char version;
+	unsigned char count[2]; /* indexed by HIGH_PRESISION/LOW_PRESISION */
+	struct temp_cal_point point[2][TEMP_CAL_POINT_NR];
+};
+
+struct temp_cal {
+	struct temp_cal_data data; /* RAM mirror of SNV */
+
+	bool cal_mode; /* capturing points, data is not saved yet */
+
+	/* last raw temp of each channel, 0: out of the table */
+	unsigned short last_raw[2];
+	unsigned long last_time; /* ms, of last_raw */
+};
+static struct temp_cal temp_cal;
+
+/*
+ * adc => temp tables, unit: 0.01 du
+ *
+ * Entry i is the temp of adc ((i + FIRST) << SHIFT), values between two
+ * entries are linearly interpolated. Generated by Tools/temp_cal_table.py
+ * from the formulas below, run it with --sweep to check the max error
+ * against the float formulas over all adc codes.
+ *
+ * High presision, from the Schematics
+ *
+ * 		(Vsensor * (Rsensor / (Rsensor + R9)) - Vsensor * (R50 / (R49 + R50))) * 5 = Vsensor * (adc / 8192)
+ * 	=>	Rsensor = R9 / (1 / (adc / (5 * 8192) + R50 / (R49 + R50)) - 1)
+ *
+ * Low presision, from the Schematics
+ *
+ * 		R9 / Rsensor = Vr9 / Vsensor
+ * =>	56 / Rsensor = (8192 - adc) / adc
+ * => 	Rsensor = 56 * adc / (8192 - adc)
+ *
+ * From Sensor SPEC:
+ *
+ * 3950.0 = ln(R25/Rsensor) / (1 / (25 + 273.15) - 1 / (temp + 273.15))
+ * 	R25 is the resistance in 25 du
+ *
+ * temp = 1 / (1 / (25 + 273.15) - ln(Rt25/Rsensor) / 3950)) - 273.15
+ */
+#define HIGH_PRESISION_SHIFT 7
+#define HIGH_PRESISION_FIRST 0
+static const unsigned short high_presision_table[] = {
+	4662, 4629, 4596, 4563, 4530, 4498, 4465, 4433,
+	4400, 4368, 4336, 4304, 4273, 4241, 4209, 4178,
+	4146, 4115, 4083, 4052, 4021, 3990, 3959, 3928,
+	3897, 3866, 3836, 3805, 3774, 3744, 3713, 3683,
+	3652, 3622, 3592, 3561, 3531, 3501, 3471, 3440,
+	3410, 3380, 3350, 3320, 3290, 3260, 3230, 3200,
+	3170, 3140, 3110, 3080, 3050, 3020, 2990, 2960,
+	2930, 2899, 2869, 2839, 2809, 2779, 2749, 2718,
+	2688,
+};
+
+#define LOW_PRESISION_SHIFT 5
+#define LOW_PRESISION_FIRST 29
+static const unsigned short low_presision_table[] = {
+	9911, 9777, 9648, 9523, 9402, 9285, 9172, 9062,
+	8956, 8852, 8751, 8652, 8557, 8463, 8372, 8283,
+	8196, 8111, 8027, 7946, 7866, 7788, 7711, 7636,
+	7562, 7489, 7418, 7348, 7279, 7211, 7144, 7078,
+	7014, 6950, 6887, 6825, 6764, 6704, 6645, 6586,
+	6528, 6471, 6414, 6359, 6303, 6249, 6195, 6142,
+	6089, 6037, 5985, 5934, 5883, 5833, 5783, 5734,
+	5685, 5637, 5589, 5542, 5495, 5448, 5401, 5355,
+	5310, 5264, 5219, 5175, 5130, 5086, 5042, 4999,
+	4956, 4913, 4870, 4827, 4785, 4743, 4701, 4660,
+	4618, 4577, 4536, 4496, 4455, 4415, 4374, 4334,
+	4294, 4255, 4215, 4176, 4136, 4097, 4058, 4019,
+	3980, 3942, 3903, 3865, 3826, 3788, 3750, 3711,
+	3673, 3635, 3597, 3560, 3522, 3484, 3446, 3409,
+	3371, 3333, 3296, 3258, 3221, 3183, 3145, 3108,
+	3070, 3033, 2995, 2958, 2920, 2883, 2845, 2807,
+	2770, 2732, 2694, 2656, 2618, 2580, 2542, 2504,
+	2466, 2427, 2389, 2350, 2312, 2273, 2234, 2195,
+	2156, 2117, 2077, 2038, 1998, 1958, 1918, 1878,
+	1837, 1797, 1756, 1715, 1673, 1632, 1590, 1548,
+	1505, 1463, 1420, 1376, 1333, 1289, 1245, 1200,
+	1155, 1110, 1064, 1018, 971, 924, 876, 828,
+	779, 730, 680, 630, 579, 527, 475, 422,
+	368, 313, 258, 202, 144, 86, 27,
+};
+
+struct temp_cal_table {
+	const unsigned short *temp;
+	unsigned char len;
+	unsigned char shift;
+	unsigned short first_adc;
+};
+
+/* indexed by HIGH_PRESISION/LOW_PRESISION */
+static const struct temp_cal_table temp_cal_tables[] = {
+	{
+		high_presision_table,
+		sizeof(high_presision_table) / sizeof(high_presision_table[0]),
+		HIGH_PRESISION_SHIFT,
+		HIGH_PRESISION_FIRST << HIGH_PRESISION_SHIFT,
+	},
+	{
+		low_presision_table,
+		sizeof(low_presision_table) / sizeof(low_presision_table[0]),
+		LOW_PRESISION_SHIFT,
+		LOW_PRESISION_FIRST << LOW_PRESISION_SHIFT,
+	},
+};
+
+/*
+ * 377 => 37.7 du
+ *
+ * adc out of the table is clamped to the first/last entry
+ */
+unsigned short temp_cal_get_temp_by_adc(unsigned char presision, unsigned short adc_val)
 {
-	float sensor_resistance;
+	const struct temp_cal_table *tab = &temp_cal_tables[presision];
+	unsigned short offset, index, frac;
+	long temp; /* 0.01 du << shift */
 
-	if (channel == HIGH_PRESISION) {
-		/*
-		 * From the Schematics
-		 *
-		 * 		(Vsensor * (Rsensor / (Rsensor + R9)) - Vsensor * (R50 / (R49 + R50))) * 5 = Vsensor * (adc / 8192)
-		 * 	=>	Rsensor = R9 / (1 / (adc / (5 * 8192) + R50 / (R49 + R50)) - 1)
-		 */
-		sensor_resistance = 56.0 / (1.0 / ((float)adc_val / 40960.0 + 56.0 / (56.0 + 76.8)) - 1);
-	} else {
-		/*
-		 * From the Schematics
-		 *
-		 * 		R9 / Rsensor = Vr9 / Vsensor
-		 * =>	56 / Rsensor = (8192 - adc) / adc
-		 * => 	Rsensor = 56 * adc / (8192 - adc)
-		 */
-		sensor_resistance = 56.0 * (float)adc_val / (8192.0 - (float)adc_val);
+	if (adc_val <= tab->first_adc)
+		return (tab->temp[0] + 5) / 10;
+
+	offset = adc_val - tab->first_adc;
+	index = offset >> tab->shift;
+	if (index >= tab->len - 1)
+		return (tab->temp[tab->len - 1] + 5) / 10;
+
+	frac = offset & ((1 << tab->shift) - 1);
+
+	temp = ((long)tab->temp[index] << tab->shift) +
+			((long)tab->temp[index + 1] - (long)tab->temp[index]) * frac;
+
+	return (unsigned short)((temp + (5L << tab->shift)) / (10L << tab->shift));
+}
+
+/*
+ * a temp near 0 du with a negative offset must not wrap around
+ */
+static unsigned short temp_cal_clamp(long temp)
+{
+	if (temp < 0)
+		return 0;
+	if (temp > 0xFFFF)
+		return 0xFFFF;
+
+	return (unsigned short)temp;
+}
+
+/*
+ * raw temp of the table, corrected by the points of this device
+ */
+unsigned short temp_cal_get_temp(unsigned char presision, unsigned short adc_val)
+{
+	struct temp_cal *c = &temp_cal;
+	const struct temp_cal_table *tab = &temp_cal_tables[presision];
+	struct temp_cal_point *point = c->data.point[presision];
+	unsigned char count = c->data.count[presision];
+	unsigned short raw;
+	unsigned char i;
+
+	raw = temp_cal_get_temp_by_adc(presision, adc_val);
+
+	if (adc_val > tab->first_adc &&
+		((adc_val - tab->first_adc) >> tab->shift) < tab->len - 1)
+		c->last_raw[presision] = raw;
+	else
+		c->last_raw[presision] = 0;
+	c->last_time = osal_GetSystemClock();
+
+	if (c->cal_mode || count == 0)
+		return raw;
+
+	if (raw <= point[0].raw)
+		return temp_cal_clamp((long)raw + (long)point[0].ref - (long)point[0].raw);
+
+	for (i = 0; i + 1 < count; i++) {
+		if (raw < point[i + 1].raw)
+			return temp_cal_clamp((long)point[i].ref +
+				((long)point[i + 1].ref - (long)point[i].ref) * ((long)raw - (long)point[i].raw) /
+				((long)point[i + 1].raw - (long)point[i].raw));
+	}
+
+	return temp_cal_clamp((long)raw + (long)point[count - 1].ref - (long)point[count - 1].raw);
+}
+
+static void temp_cal_show(void)
+{
+	struct temp_cal_data *d = &temp_cal.data;
+	unsigned char ch, i;
+
+	for (ch = HIGH_PRESISION; ch <= LOW_PRESISION; ch++) {
+		print(LOG_INFO, MODULE "%s: %d points\r\n", ch == HIGH_PRESISION ? "high" : "low", d->count[ch]);
+		for (i = 0; i < d->count[ch]; i++)
+			print(LOG_INFO, MODULE "  %d => %d\r\n", d->point[ch][i].raw, d->point[ch][i].ref);
+	}
+}
+
+/*
+ * keep the points sorted by raw, a point with the same raw is replaced
+ */
+static void temp_cal_add_point(unsigned char presision, unsigned short raw, unsigned short ref)
+{
+	struct temp_cal_data *d = &temp_cal.data;
+	struct temp_cal_point *point = d->point[presision];
+	unsigned char i, j;
+
+	if ((raw > ref ? raw - ref : ref - raw) > TEMP_CAL_MAX_OFFSET) {
+		print(LOG_WRANING, MODULE "%d => %d: offset too big\r\n", raw, ref);
+		return;
+	}
+
+	for (i = 0; i < d->count[presision] && point[i].raw < raw; i++)
+		;
+
+	if (i == d->count[presision] || point[i].raw != raw) {
+		if (d->count[presision] == TEMP_CAL_POINT_NR) {
+			print(LOG_WRANING, MODULE "too many points\r\n");
+			return;
+		}
+
+		for (j = d->count[presision]; j > i; j--)
+			point[j] = point[j - 1];
+		d->count[presision]++;
+	}
+
+	point[i].raw = raw;
+	point[i].ref = ref;
+
+	print(LOG_INFO, MODULE "%s: %d => %d\r\n", presision == HIGH_PRESISION ? "high" : "low", raw, ref);
+}
+
+static void temp_cal_load(void)
+{
+	struct temp_cal_data *d = &temp_cal.data;
+
+	if (osal_snv_read(TEMP_CAL_NV_ID, sizeof(*d), d) != SUCCESS ||
+		d->version != TEMP_CAL_VERSION ||
+		d->count[HIGH_PRESISION] > TEMP_CAL_POINT_NR ||
+		d->count[LOW_PRESISION] > TEMP_CAL_POINT_NR) {
+		osal_memset(d, 0, sizeof(*d));
+		d->version = TEMP_CAL_VERSION;
+	}
+}
+
+static void temp_cal_save(void)
+{
+	if (osal_snv_write(TEMP_CAL_NV_ID, sizeof(temp_cal.data), &temp_cal.data) != SUCCESS)
+		print(LOG_ERR, MODULE "save failed\r\n");
+	else
+		print(LOG_INFO, MODULE "saved\r\n");
+}
+
+static bool parse_number(unsigned char *buf, unsigned char len, unsigned short *val)
+{
+	unsigned char i;
+
+	*val = 0;
+	for (i = 0; i < len; i++) {
+		if (buf[i] < '0' || buf[i] > '9')
+			return FALSE;
+		*val = *val * 10 + (buf[i] - '0');
 	}
 
-	return sensor_resistance;
+	return len > 0;
+}
+
+static bool cmd_is(unsigned char *buf, unsigned char len, char *cmd)
+{
+	return len == osal_strlen(cmd) && osal_memcmp(buf, cmd, len);
 }
 
 /*
- * 377 => 37.7 du
+ * calibration commands from the uart, on the production line:
+ *
+ *   cal start    drop the points in RAM, report raw temps
+ *   cal 370      the probe is at 37.0 du now, add a point to every channel in range
+ *   cal save     save the points to SNV and use them
+ *   cal abort    reload the points from SNV
+ *   cal clear    erase the points in SNV
+ *   cal          show the points
  */
-unsigned short temp_cal_get_temp_by_res(float res)
+void temp_cal_cmd(unsigned char *buf, unsigned char len)
 {
-	float temp;
+	struct temp_cal *c = &temp_cal;
+	unsigned long age;
+	unsigned short ref;
+	unsigned char ch;
 
-	/*
-	 * From Sensor SPEC:
-	 *
-	 * 3950.0 = ln(R25/Rsensor) / (1 / (25 + 273.15) - 1 / (temp + 273.15))
-	 * 	R25 is the resistance in 25 du
-	 *
-	 * temp = 1 / (1 / (25 + 273.15) - ln(Rt25/Rsensor) / 3950)) - 273.15
-	 */
-	temp = 1.0 / (1.0 / (25.0 + 273.15) - log(100.0 / res) / 3950) - 273.15;
+	while (len > 0 && (buf[len - 1] == '\r' || buf[len - 1] == '\n' || buf[len - 1] == ' '))
+		len--;
+	while (len > 0 && buf[0] == ' ') {
+		buf++;
+		len--;
+	}
 
-	temp = temp * 10.0;
+	if (cmd_is(buf, len, "start")) {
+		osal_memset(&c->data, 0, sizeof(c->data));
+		c->data.version = TEMP_CAL_VERSION;
+		c->cal_mode = TRUE;
+		print(LOG_INFO, MODULE "calibration start\r\n");
 
-	return (unsigned short)temp;
+	} else if (cmd_is(buf, len, "save")) {
+		temp_cal_save();
+		c->cal_mode = FALSE;
+
+	} else if (cmd_is(buf, len, "abort")) {
+		temp_cal_load();
+		c->cal_mode = FALSE;
+
+	} else if (cmd_is(buf, len, "clear")) {
+		osal_memset(&c->data, 0, sizeof(c->data));
+		c->data.version = TEMP_CAL_VERSION;
+		temp_cal_save();
+		c->cal_mode = FALSE;
+
+	} else if (parse_number(buf, len, &ref)) {
+		if (!c->cal_mode) {
+			print(LOG_WRANING, MODULE "not in calibration\r\n");
+			return;
+		}
+
+		age = osal_GetSystemClock() - c->last_time;
+		if (!c->last_time || age > TEMP_CAL_MAX_AGE) {
+			print(LOG_WRANING, MODULE "last temp is %ld ms old, try again\r\n", age);
+			return;
+		}
+
+		for (ch = HIGH_PRESISION; ch <= LOW_PRESISION; ch++) {
+			if (c->last_raw[ch])
+				temp_cal_add_point(ch, c->last_raw[ch], ref);
+		}
+
+	} else if (len == 0) {
+		temp_cal_show();
+
+	} else {
+		print(LOG_WRANING, MODULE "unknown cmd\r\n");
+	}
 }
 
+bool temp_cal_in_progress(void)
+{
+	return temp_cal.cal_mode;
+}
+
+void temp_cal_init(void)
+{
+	struct temp_cal *c = &temp_cal;
+
+	c->cal_mode = FALSE;
+	c->last_raw[HIGH_PRESISION] = 0;
+	c->last_raw[LOW_PRESISION] = 0;
+	c->last_time = 0;
 
+	temp_cal_load();
+	temp_cal_show();
+}
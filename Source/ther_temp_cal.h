@@ -7,8 +7,12 @@ enum {
 	LOW_PRESISION,
 };
 
-float temp_cal_get_res_by_adc(unsigned char channel, unsigned short adc_val);
-unsigned short temp_cal_get_temp_by_res(float res);
+unsigned short temp_cal_get_temp_by_adc(unsigned char presision, unsigned short adc_val);
+unsigned short temp_cal_get_temp(unsigned char presision, unsigned short adc_val);
+void temp_cal_cmd(unsigned char *buf, unsigned char len);
+/* capturing points, the raw temps must be fresh */
+bool temp_cal_in_progress(void);
+void temp_cal_init(void);
 
 #endif
 
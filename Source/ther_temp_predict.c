@@ -0,0 +1,317 @@
+/*
+ * predictive temp: report the equilibrium temp before the probe gets there
+ *
+ * The probe temp rises like T(t) = Tf - (Tf - T0) * e^(-t / tau).
+ * Pick 3 points of the curve h apart, T1, T2, T3:
+ *
+ * 		d1 = T2 - T1, d2 = T3 - T2, r = d2 / d1 = e^(-h / tau)
+ * 	=>	Tf = T3 + d2 * r / (1 - r) = T3 + d2 * d2 / (d1 - d2)
+ *
+ * T1, T2 are interpolated from the sample history, so the samples need not
+ * be evenly spaced. Every new sample gives an estimate, the result is
+ * reported once the estimates have agreed within +/- PREDICT_TOLERANCE
+ * for PREDICT_STABLE_TIME.
+ *
+ * The result is let go, and the raw temp reported again, once the probe
+ * gets there, once it falls, or after PREDICT_HOLD_TIME.
+ *
+ * A rise with a slow tail, a part of it with a tau of minutes, does not
+ * fit one exponential. Within the 2 * PREDICT_SPAN of the history the tail
+ * moves about as much as the 0.1 du the samples are rounded to, so the
+ * estimates agree on a temp as far below the final one as the tail is
+ * big, no gate on them tells it from a curve at its end. Such a result is
+ * about the raw temp, so it is let go at once when the probe gets there.
+ */
+
+#include "Comdef.h"
+#include "OSAL.h"
+
+#include "ther_uart.h"
+#include "ther_uart_comm.h"
+
+#include "ther_temp_predict.h"
+
+#define MODULE "[TEMP PREDICT] "
+
+/* below this the probe is not on the body */
+#define PREDICT_START_TEMP 300 /* 0.1 du */
+
+/* distance between the 3 points of the curve */
+#define PREDICT_SPAN 30000 /* ms */
+
+/* samples closer than PREDICT_SAMPLE_GAP replace the newest one in the history */
+#define PREDICT_SAMPLE_GAP 3000 /* ms */
+#define PREDICT_HISTORY_NR 24
+
+/* every point of the curve is the average of the samples around it */
+#define PREDICT_SMOOTH_NR 4
+
+#define PREDICT_HISTORY_TIME (2L * PREDICT_SPAN + (PREDICT_SMOOTH_NR - 1) * (long)PREDICT_SAMPLE_GAP)
+
+/* estimates too far above the current temp are from the linear part of the curve */
+#define PREDICT_MAX_RISE 300 /* 0.01 du */
+
+/*
+ * estimates in a row share most of their samples, so count the time they
+ * stay together, not the number of them
+ */
+#define PREDICT_STABLE_TIME 20000 /* ms */
+#define PREDICT_STABLE_COUNT 3
+#define PREDICT_TOLERANCE 10 /* 0.01 du */
+
+/* when the result is let go */
+#define PREDICT_CONVERGED 1 /* 0.1 du, raw temp this close below the result */
+#define PREDICT_FALL 2 /* 0.1 du, raw temp this far below its max since the result */
+#define PREDICT_FALL_NR 3 /* samples in a row, not one low by noise */
+#define PREDICT_HOLD_TIME 300000 /* ms */
+
+struct predict_sample {
+	unsigned long time; /* ms */
+	unsigned short temp; /* 0.1 du */
+};
+
+struct ther_temp_predict {
+	unsigned char state;
+
+	struct predict_sample history[PREDICT_HISTORY_NR];
+	unsigned char head; /* next slot to write */
+	unsigned char count;
+
+	unsigned short estimate_min; /* 0.01 du */
+	unsigned short estimate_max;
+	unsigned long estimate_sum;
+	unsigned char stable_count;
+	unsigned long stable_since; /* ms */
+
+	unsigned short result; /* 0.1 du */
+	unsigned long result_time; /* ms */
+	unsigned short result_max; /* raw temp since the result, 0.1 du */
+	unsigned char fall_count;
+};
+static struct ther_temp_predict ther_temp_predict;
+
+static struct predict_sample *get_sample(struct ther_temp_predict *p, unsigned char age)
+{
+	return &p->history[(p->head + PREDICT_HISTORY_NR - 1 - age) % PREDICT_HISTORY_NR];
+}
+
+/*
+ * temp at [time] in 0.01 du, interpolated from the history
+ *
+ * return FALSE if the history does not go back that far
+ */
+static bool get_temp_at(struct ther_temp_predict *p, unsigned long time, long *temp)
+{
+	struct predict_sample *newer, *older;
+	unsigned char age;
+
+	for (age = 0; age + 1 < p->count; age++) {
+		newer = get_sample(p, age);
+		older = get_sample(p, age + 1);
+
+		if (older->time <= time) {
+			*temp = (long)older->temp * 10 +
+				((long)newer->temp - (long)older->temp) * 10 *
+				(long)(time - older->time) / (long)(newer->time - older->time);
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/*
+ * average of PREDICT_SMOOTH_NR points PREDICT_SAMPLE_GAP apart, ending at [time].
+ * Averaging keeps the shape of the exponential curve, so the 3 points can
+ * still be used as is.
+ */
+static bool get_smooth_temp_at(struct ther_temp_predict *p, unsigned long time, long *temp)
+{
+	long sum = 0, t;
+	unsigned char i;
+
+	for (i = 0; i < PREDICT_SMOOTH_NR; i++) {
+		if (!get_temp_at(p, time - (unsigned long)i * PREDICT_SAMPLE_GAP, &t))
+			return FALSE;
+		sum += t;
+	}
+
+	*temp = sum / PREDICT_SMOOTH_NR;
+
+	return TRUE;
+}
+
+/*
+ * return FALSE if the 3 points are not on a rising, slowing down curve
+ */
+static bool get_estimate(struct ther_temp_predict *p, unsigned long now, unsigned short *estimate)
+{
+	long t1, t2, t3, d1, d2, rise;
+
+	if (now < PREDICT_HISTORY_TIME)
+		return FALSE;
+
+	if (!get_smooth_temp_at(p, now, &t3) ||
+		!get_smooth_temp_at(p, now - PREDICT_SPAN, &t2) ||
+		!get_smooth_temp_at(p, now - 2L * PREDICT_SPAN, &t1))
+		return FALSE;
+
+	d1 = t2 - t1;
+	d2 = t3 - t2;
+
+	if (d1 > 0 && d2 >= 0 && d2 < d1) {
+		rise = d2 * d2 / (d1 - d2);
+		if (rise > PREDICT_MAX_RISE)
+			return FALSE;
+
+		*estimate = (unsigned short)(t3 + rise);
+		return TRUE;
+	}
+
+	/* already flat, the noise is bigger than the rise */
+	if (d1 <= PREDICT_TOLERANCE && d1 >= -PREDICT_TOLERANCE &&
+		d2 <= PREDICT_TOLERANCE && d2 >= -PREDICT_TOLERANCE) {
+		*estimate = (unsigned short)t3;
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+static void reset_estimate(struct ther_temp_predict *p)
+{
+	p->stable_count = 0;
+	p->estimate_sum = 0;
+}
+
+void ther_temp_predict_reset(void)
+{
+	struct ther_temp_predict *p = &ther_temp_predict;
+
+	p->state = PREDICT_IDLE;
+	p->head = 0;
+	p->count = 0;
+	reset_estimate(p);
+}
+
+/*
+ * return TRUE if the raw temp does not need the result any more
+ */
+static bool release_result(struct ther_temp_predict *p, unsigned short temp, unsigned long now)
+{
+	if (temp > p->result_max)
+		p->result_max = temp;
+
+	if (temp + PREDICT_CONVERGED >= p->result) {
+		print(LOG_INFO, MODULE "temp %d got to predict %d\r\n", temp, p->result);
+		return TRUE;
+	}
+
+	if (temp + PREDICT_FALL > p->result_max)
+		p->fall_count = 0;
+	else if (++p->fall_count >= PREDICT_FALL_NR) {
+		print(LOG_INFO, MODULE "temp %d falls, max %d\r\n", temp, p->result_max);
+		return TRUE;
+	}
+
+	if (now - p->result_time >= PREDICT_HOLD_TIME) {
+		print(LOG_INFO, MODULE "temp %d did not get to predict %d\r\n", temp, p->result);
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+/*
+ * feed one sample, return PREDICT_DONE with *result (0.1 du) once the
+ * estimate is stable. It keeps returning PREDICT_DONE with the same result
+ * until release_result(), then PREDICT_RELEASED until the temp drops below
+ * PREDICT_START_TEMP.
+ */
+unsigned char ther_temp_predict_add(unsigned short temp, unsigned short *result)
+{
+	struct ther_temp_predict *p = &ther_temp_predict;
+	struct predict_sample *s;
+	unsigned short estimate;
+	unsigned long now;
+
+	if (temp < PREDICT_START_TEMP) {
+		if (p->state != PREDICT_IDLE)
+			print(LOG_INFO, MODULE "probe removed\r\n");
+
+		ther_temp_predict_reset();
+		return PREDICT_IDLE;
+	}
+
+	if (p->state == PREDICT_RELEASED)
+		return PREDICT_RELEASED;
+
+	now = osal_GetSystemClock();
+
+	if (p->state == PREDICT_DONE) {
+		if (release_result(p, temp, now)) {
+			p->state = PREDICT_RELEASED;
+			return PREDICT_RELEASED;
+		}
+
+		*result = p->result;
+		return PREDICT_DONE;
+	}
+
+	p->state = PREDICT_RUNNING;
+
+	/*
+	 * keep the history PREDICT_SAMPLE_GAP apart so that it covers 2 * PREDICT_SPAN,
+	 * the newest one is replaced until it is far enough from the one before
+	 */
+	if (p->count >= 2 && get_sample(p, 0)->time - get_sample(p, 1)->time < PREDICT_SAMPLE_GAP) {
+		s = get_sample(p, 0);
+	} else {
+		s = &p->history[p->head];
+		p->head = (p->head + 1) % PREDICT_HISTORY_NR;
+		if (p->count < PREDICT_HISTORY_NR)
+			p->count++;
+	}
+
+	s->time = now;
+	s->temp = temp;
+
+	/* keep the stable window, only a different estimate breaks it */
+	if (!get_estimate(p, now, &estimate))
+		return PREDICT_RUNNING;
+
+	if (p->stable_count == 0 || estimate < p->estimate_min)
+		p->estimate_min = estimate;
+	if (p->stable_count == 0 || estimate > p->estimate_max)
+		p->estimate_max = estimate;
+
+	if (p->estimate_max - p->estimate_min > 2 * PREDICT_TOLERANCE) {
+		/* start over from this estimate */
+		reset_estimate(p);
+		p->estimate_min = estimate;
+		p->estimate_max = estimate;
+	}
+
+	if (p->stable_count == 0)
+		p->stable_since = now;
+
+	p->estimate_sum += estimate;
+	p->stable_count++;
+
+	print(LOG_DBG, MODULE "temp %d, estimate %d (%d)\r\n", temp, estimate, p->stable_count);
+
+	if (p->stable_count < PREDICT_STABLE_COUNT || now - p->stable_since < PREDICT_STABLE_TIME)
+		return PREDICT_RUNNING;
+
+	/* 0.01 du => 0.1 du */
+	p->result = (unsigned short)((p->estimate_sum / p->stable_count + 5) / 10);
+	p->state = PREDICT_DONE;
+	p->result_time = now;
+	p->result_max = temp;
+	p->fall_count = 0;
+
+	print(LOG_INFO, MODULE "predict %d, +/- %d (0.01 du)\r\n", p->result, PREDICT_TOLERANCE);
+
+	*result = p->result;
+	return PREDICT_DONE;
+}
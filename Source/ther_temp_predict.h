@@ -0,0 +1,16 @@
+
+#ifndef __THER_TEMP_PREDICT_H__
+#define __THER_TEMP_PREDICT_H__
+
+enum {
+	PREDICT_IDLE = 0,
+	PREDICT_RUNNING,
+	PREDICT_DONE,
+	PREDICT_RELEASED, /* the raw temp is reported again */
+};
+
+void ther_temp_predict_reset(void);
+unsigned char ther_temp_predict_add(unsigned short temp, unsigned short *result);
+
+#endif
+
@@ -6,6 +6,10 @@
 
 #include "ther_uart.h"
 #include "ther_uart_comm.h"
+#include "ther_temp_cal.h"
+#include "ther_setting.h"
+#include "ther_spi_w25x40cl.h"
+#include "ther_storage.h"
 
 #define MODULE "[UART COMM] "
 
@@ -21,6 +25,21 @@ static char print_buf[PRINT_BUF_LEN];
 
 static void msg_dispatch(unsigned char port, unsigned char *buf, unsigned char len)
 {
+	if (len >= 3 && osal_memcmp(buf, "cal", 3)) {
+		temp_cal_cmd(buf + 3, len - 3);
+		return;
+	}
+
+	if (len >= 3 && osal_memcmp(buf, "set", 3)) {
+		ther_setting_cmd(buf + 3, len - 3);
+		return;
+	}
+
+	if (len >= 6 && osal_memcmp(buf, "format", 6)) {
+		ther_storage_format();
+		return;
+	}
+
 	uart_send(port, buf, len);
 
 	return;
@@ -32,7 +32,12 @@
 #include "ther_buzzer.h"
 #include "ther_oled9639_display.h"
 #include "ther_spi_w25x40cl.h"
+#include "ther_storage.h"
+#include "ther_adc.h"
 #include "ther_temp.h"
+#include "ther_temp_predict.h"
+#include "ther_temp_cal.h"
+#include "ther_setting.h"
 
 #define MODULE "[THER] "
 
@@ -72,15 +77,26 @@ struct ther_info {
 	/* temp */
 	unsigned char temp_stage;
 	unsigned short temp_last_saved;
-	unsigned short temp_current; /* every TEMP_MEASURE_INTERVAL */
+	unsigned short temp_current; /* every temp_measure_interval */
 	unsigned long temp_measure_interval;
+	unsigned short temp_raw; /* raw temp the rate is taken from */
+	unsigned long temp_measure_time; /* ms, when temp_raw is measured */
+	unsigned short temp_rate; /* |dT/dt|, 0.1 du per minute */
+	unsigned long temp_rate_smooth; /* temp_rate << TEMP_RATE_SHIFT */
+	unsigned short batt_voltage; /* mV */
 	bool has_history_temp;
+	bool temp_predicted;
+
+	unsigned char pwrmgr_hold; /* see ther_pwrmgr_hold() */
 };
 
 static struct ther_info ther_info;
 
 #define SEC_TO_MS(sec) ((sec) * 1000)
 
+/* the measurement interval setting is 0, no periodic indication asked */
+#define TEMP_INDICATION_INTERVAL 5 /* second */
+
 /**
  * Display
  */
@@ -93,8 +109,133 @@ static struct ther_info ther_info;
  * Temp measurement
  */
 #define TEMP_POWER_SETUP_TIME 100 /* ms */
+#define TEMP_POWER_POLL_TIME 2 /* ms, LDO settling */
 #define TEMP_MEASURE_INTERVAL SEC_TO_MS(5)
 #define TEMP_MEASURE_MIN_INTERVAL SEC_TO_MS(2)
+#define TEMP_MEASURE_MAX_INTERVAL SEC_TO_MS(180)
+
+/*
+ * |dT/dt| in 0.1 du per minute:
+ *   above TEMP_RATE_FAST, measure every TEMP_MEASURE_MIN_INTERVAL
+ *   above TEMP_RATE_SLOW, measure every TEMP_MEASURE_INTERVAL
+ *   otherwise the interval doubles every measurement, up to TEMP_MEASURE_MAX_INTERVAL
+ */
+#define TEMP_RATE_FAST 5
+#define TEMP_RATE_SLOW 1
+
+/*
+ * A change of 1 (0.1 du) is the noise of the last digit, at 2 s it
+ * would be a rate of 30: the rate is taken from the last temp that
+ * moved more than TEMP_RATE_DEADBAND, over the time since then. Inside
+ * the deadband the rate can only fall, to what the deadband still allows,
+ * and after TEMP_RATE_WINDOW to the change over the window.
+ */
+#define TEMP_RATE_DEADBAND 1 /* 0.1 du */
+#define TEMP_RATE_WINDOW SEC_TO_MS(60)
+
+/* fraction bits of the smoothed rate, so small rates do not round to 0 */
+#define TEMP_RATE_SHIFT 4
+
+/* below this the intervals are doubled, except when the display is on */
+#define BATT_LOW_VOLTAGE 2400 /* mV */
+
+/*
+ * Every measurement powers the LDO until it settles, so measure
+ * as seldom as the temp change, the display and the BLE peer allow.
+ *
+ * backoff: a new measurement is done, the flat interval can grow
+ */
+static unsigned long ther_get_measure_interval(struct ther_info *ti, bool backoff)
+{
+	unsigned long interval;
+
+	if (ti->temp_rate >= TEMP_RATE_FAST) {
+		interval = TEMP_MEASURE_MIN_INTERVAL;
+	} else if (ti->temp_rate >= TEMP_RATE_SLOW) {
+		interval = TEMP_MEASURE_INTERVAL;
+	} else {
+		interval = backoff ? ti->temp_measure_interval * 2 : ti->temp_measure_interval;
+		if (interval < TEMP_MEASURE_INTERVAL)
+			interval = TEMP_MEASURE_INTERVAL;
+		if (interval > TEMP_MEASURE_MAX_INTERVAL)
+			interval = TEMP_MEASURE_MAX_INTERVAL;
+	}
+
+	if (ti->batt_voltage && ti->batt_voltage < BATT_LOW_VOLTAGE)
+		interval *= 2;
+
+	if (ti->temp_indication_enable && interval > SEC_TO_MS(ti->indication_interval))
+		interval = SEC_TO_MS(ti->indication_interval);
+
+	if (ti->temp_notification_enable && interval > SEC_TO_MS(ti->notification_interval))
+		interval = SEC_TO_MS(ti->notification_interval);
+
+	/* the user is watching */
+	if (ti->display_picture < OLED_DISPLAY_MAX_PICTURE && interval > TEMP_MEASURE_MIN_INTERVAL)
+		interval = TEMP_MEASURE_MIN_INTERVAL;
+
+	/* a calibration point takes the last raw temp */
+	if (temp_cal_in_progress() && interval > TEMP_MEASURE_MIN_INTERVAL)
+		interval = TEMP_MEASURE_MIN_INTERVAL;
+
+	return interval;
+}
+
+/*
+ * temp: the raw temp just measured
+ */
+static void ther_update_temp_rate(struct ther_info *ti, unsigned short temp)
+{
+	unsigned long now = osal_GetSystemClock();
+	unsigned long elapse = now - ti->temp_measure_time;
+	unsigned long rate;
+	unsigned short diff;
+
+	if (!ti->temp_measure_time) {
+		ti->temp_raw = temp;
+		ti->temp_measure_time = now;
+		return;
+	}
+
+	if (!elapse)
+		return;
+
+	diff = temp > ti->temp_raw ? temp - ti->temp_raw : ti->temp_raw - temp;
+	if (diff > TEMP_RATE_DEADBAND) {
+		rate = (unsigned long)diff * SEC_TO_MS(60) / elapse;
+		if (rate > 0xFFFF)
+			rate = 0xFFFF;
+
+		ti->temp_raw = temp;
+		ti->temp_measure_time = now;
+	} else if (elapse < TEMP_RATE_WINDOW) {
+		/* any faster and it would be out of the deadband by now */
+		rate = (TEMP_RATE_DEADBAND + 1) * SEC_TO_MS(60) / elapse;
+		if (rate >= ti->temp_rate)
+			return;
+	} else {
+		rate = (unsigned long)diff * SEC_TO_MS(60) / elapse;
+	}
+
+	/* smooth out the noise */
+	ti->temp_rate_smooth = (ti->temp_rate_smooth + (rate << TEMP_RATE_SHIFT)) / 2;
+	ti->temp_rate = (unsigned short)((ti->temp_rate_smooth + BV(TEMP_RATE_SHIFT - 1)) >> TEMP_RATE_SHIFT);
+}
+
+/*
+ * display or BLE state changed, take a new interval now
+ */
+static void restart_measure_timer(struct ther_info *ti)
+{
+	/* LDO is on, the measurement is coming */
+	if (ti->temp_stage != TEMP_STAGE_SETUP)
+		return;
+
+	osal_stop_timerEx(ti->task_id, TH_TEMP_MEASURE_EVT);
+
+	ti->temp_measure_interval = ther_get_measure_interval(ti, FALSE);
+	osal_start_timerEx( ti->task_id, TH_TEMP_MEASURE_EVT, ti->temp_measure_interval);
+}
 
 static void ther_temp_periodic_meas(struct ther_info *ti)
 {
@@ -117,16 +258,26 @@ static void ther_temp_periodic_imeas(struct ther_info *ti)
 	return;
 }
 
+static unsigned char ther_get_indication_interval(void)
+{
+	unsigned char interval = (unsigned char)ther_setting_get(SETTING_MEAS_INTERVAL);
+
+	return interval ? interval : TEMP_INDICATION_INTERVAL;
+}
+
 static void ther_handle_gatt_access_msg(struct ther_info *ti, struct ble_gatt_access_msg *msg)
 {
+	uint8 interval;
+
 	switch (msg->type) {
 
 	case GATT_TEMP_IND_ENABLED:
 		print(LOG_INFO, MODULE "start temp indication\r\n");
 
 		ti->temp_indication_enable = TRUE;
-		ti->indication_interval = 5;
+		ti->indication_interval = ther_get_indication_interval();
 		osal_start_timerEx(ti->task_id, TH_PERIODIC_MEAS_EVT, SEC_TO_MS(1));
+		restart_measure_timer(ti);
 
 		break;
 
@@ -134,6 +285,7 @@ static void ther_handle_gatt_access_msg(struct ther_info *ti, struct ble_gatt_ac
 		print(LOG_INFO, MODULE "stop temp indication\r\n");
 
 		ti->temp_indication_enable = FALSE;
+		restart_measure_timer(ti);
 
 		break;
 
@@ -143,12 +295,14 @@ static void ther_handle_gatt_access_msg(struct ther_info *ti, struct ble_gatt_ac
 		ti->temp_notification_enable = TRUE;
 		ti->notification_interval = 5;
 		osal_start_timerEx(ti->task_id, TH_PERIODIC_IMEAS_EVT, SEC_TO_MS(3));
+		restart_measure_timer(ti);
 
 		break;
 
 	case GATT_IMEAS_NOTI_DISABLED:
 		print(LOG_INFO, MODULE "stop imeas notification\r\n");
 		ti->temp_notification_enable = FALSE;
+		restart_measure_timer(ti);
 
 		break;
 
@@ -162,6 +316,24 @@ static void ther_handle_gatt_access_msg(struct ther_info *ti, struct ble_gatt_ac
 
 		break;
 
+	case GATT_INTERVAL_SET:
+		Thermometer_GetParameter(THERMOMETER_INTERVAL, &interval);
+		print(LOG_INFO, MODULE "measurement interval %d\r\n", interval);
+
+		if (!ther_setting_set(SETTING_MEAS_INTERVAL, interval)) {
+			print(LOG_WRANING, MODULE "measurement interval %d out of range\r\n", interval);
+
+			/* the characteristic shows the interval still in use */
+			interval = (uint8)ther_setting_get(SETTING_MEAS_INTERVAL);
+			Thermometer_SetParameter(THERMOMETER_INTERVAL, sizeof(uint8), &interval);
+			break;
+		}
+
+		ti->indication_interval = ther_get_indication_interval();
+		restart_measure_timer(ti);
+
+		break;
+
 	case GATT_UNKNOWN:
 		print(LOG_INFO, MODULE "unknown gatt access type\r\n");
 		break;
@@ -177,6 +349,7 @@ static void ther_handle_ble_status_change(struct ther_info *ti, struct ble_statu
 		ti->temp_notification_enable = FALSE;
 
 		ti->ble_connect = FALSE;
+		restart_measure_timer(ti);
 	} else if (msg->type == BLE_CONNECT) {
 		ti->ble_connect = TRUE;
 	}
@@ -190,6 +363,13 @@ static void ther_power_off(struct ther_info *ti)
 
 	ti->power_mode = PM_3;
 
+	/* the settings changed in the last seconds, the records in the write buffer */
+	ther_setting_save();
+	ther_storage_sync();
+
+	/* the idle timer would not run in PM3, the flash stays in standby */
+	ther_spi_w25x_power_off();
+
 	/* go to PM3 */
     SLEEPCMD |= BV(0) | BV(1);
     PCON |=BV(0);
@@ -217,14 +397,6 @@ static void ther_power_on(struct ther_info *ti)
 	return;
 }
 
-static void restart_measure_timer(struct ther_info *ti, unsigned long new_interval)
-{
-	osal_stop_timerEx(ti->task_id, TH_TEMP_MEASURE_EVT);
-
-	ti->temp_measure_interval = new_interval;
-	osal_start_timerEx( ti->task_id, TH_TEMP_MEASURE_EVT, ti->temp_measure_interval);
-}
-
 static void ther_handle_button(struct ther_info *ti, struct button_msg *msg)
 {
 	switch (msg->type) {
@@ -242,8 +414,8 @@ static void ther_handle_button(struct ther_info *ti, struct button_msg *msg)
 				ti->display_time = DISPLAY_TIME;
 				osal_start_timerEx(ti->task_id, TH_DISPLAY_EVT, DISPLAY_POWER_SETUP_TIME);
 
-				/* change temp measure to 1 sec */
-				restart_measure_timer(ti, TEMP_MEASURE_MIN_INTERVAL);
+				/* measure faster while displaying */
+				restart_measure_timer(ti);
 			} else {
 
 				/*
@@ -342,6 +514,30 @@ static void ther_display_show_picture(struct ther_info *ti)
 
 }
 
+/*
+ * Once the predict module is confident about the final temp, report it
+ * instead of the raw one, until the module lets it go.
+ */
+static void ther_handle_temp_predict(struct ther_info *ti)
+{
+	unsigned short result;
+
+	if (ther_temp_predict_add(ti->temp_current, &result) != PREDICT_DONE) {
+		ti->temp_predicted = FALSE;
+		return;
+	}
+
+	if (!ti->temp_predicted) {
+		print(LOG_INFO, MODULE "predicted temp %d (now %d)\r\n", result, ti->temp_current);
+		ther_play_music(BUZZER_MUSIC_SEND_TEMP);
+		ti->temp_predicted = TRUE;
+	}
+
+	/* the probe goes on above the prediction, trust the probe */
+	if (ti->temp_current < result)
+		ti->temp_current = result;
+}
+
 static void ther_display_update_temp(struct ther_info *ti)
 {
 	if (ti->display_picture == OLED_DISPLAY_PICTURE1 &&
@@ -369,13 +565,27 @@ static void ther_init_device(struct ther_info *ti)
 	ti->display_picture = OLED_DISPLAY_OFF;
 
 	/* spi flash */
-	ther_spi_w25x_init();
+	if (ther_spi_w25x_init(ti->task_id) == FL_EOK)
+		ther_storage_init(&flash_dev);
+
+	/* adc init */
+	ther_adc_init(ti->task_id);
 
 	/* temp init */
 	ther_temp_init();
+	ther_temp_predict_reset();
+	ti->temp_predicted = FALSE;
 	ti->temp_measure_interval = TEMP_MEASURE_INTERVAL;
+	ti->temp_raw = 0;
+	ti->temp_measure_time = 0;
+	ti->temp_rate = 0;
+	ti->temp_rate_smooth = 0;
+	ti->batt_voltage = 0;
 	ti->temp_stage = TEMP_STAGE_SETUP;
 
+	/* settings, before ble init uses them */
+	ther_setting_init(ti->task_id);
+
 	/* ble init */
 	ther_ble_init(ti->task_id);
 
@@ -387,9 +597,6 @@ static void ther_start_system(struct ther_info *ti)
 
 	ther_init_device(ti);
 
-	/* test */
-	osal_start_timerEx(ti->task_id, TH_TEST_EVT, 5000);
-
 	/*
 	 * show welcome picture
 	 */
@@ -404,6 +611,67 @@ static void ther_start_system(struct ther_info *ti)
 
 
 
+/*
+ * the burst of ther_temp_measure() is done, from TH_ADC_EVT
+ */
+static void ther_temp_measured(unsigned short temp)
+{
+	struct ther_info *ti = &ther_info;
+
+	ti->temp_last_saved = ti->temp_current;
+	ti->temp_current = temp;
+	ther_update_temp_rate(ti, ti->temp_current);
+	ther_handle_temp_predict(ti);
+	ti->batt_voltage = read_vdd();
+
+	if (ti->ble_connect) {
+		if (ti->temp_notification_enable)
+			ther_send_temp_notify(ble_get_gap_handle(), ti->temp_current);
+		if (ti->temp_indication_enable)
+			ther_send_temp_indicate(ble_get_gap_handle(), ti->task_id, ti->temp_current);
+	} else {
+		ther_storage_append(STORAGE_TYPE_TEMP, ti->temp_current);
+
+		/* the battery may go away, do not keep records in RAM */
+		if (ti->batt_voltage && ti->batt_voltage < BATT_LOW_VOLTAGE)
+			ther_storage_flush();
+	}
+
+	if (ti->display_picture < OLED_DISPLAY_MAX_PICTURE) {
+		/* update temp */
+		ther_display_update_temp(ti);
+	}
+
+	ti->temp_measure_interval = ther_get_measure_interval(ti, TRUE);
+	osal_start_timerEx( ti->task_id, TH_TEMP_MEASURE_EVT, ti->temp_measure_interval);
+	ti->temp_stage = TEMP_STAGE_SETUP;
+}
+
+/*
+ * The task state is one for all its users, the ADC, ... so it is
+ * counted: one ther_pwrmgr_release() for every ther_pwrmgr_hold()
+ */
+void ther_pwrmgr_hold(void)
+{
+	struct ther_info *ti = &ther_info;
+
+	if (ti->pwrmgr_hold++ == 0)
+		osal_pwrmgr_task_state(ti->task_id, PWRMGR_HOLD);
+}
+
+void ther_pwrmgr_release(void)
+{
+	struct ther_info *ti = &ther_info;
+
+	if (!ti->pwrmgr_hold) {
+		print(LOG_WRANING, MODULE "pwrmgr released without a hold\r\n");
+		return;
+	}
+
+	if (--ti->pwrmgr_hold == 0)
+		osal_pwrmgr_task_state(ti->task_id, PWRMGR_CONSERVE);
+}
+
 /*********************************************************************
  * @fn      Thermometer_ProcessEvent
  *
@@ -447,31 +715,27 @@ uint16 Thermometer_ProcessEvent(uint8 task_id, uint16 events)
 		case TEMP_STAGE_SETUP:
 			ther_temp_power_on();
 
-			osal_start_timerEx( ti->task_id, TH_TEMP_MEASURE_EVT, TEMP_POWER_SETUP_TIME);
-			ti->temp_stage = TEMP_STAGE_MEASURE;
+			osal_start_timerEx( ti->task_id, TH_TEMP_MEASURE_EVT, TEMP_POWER_POLL_TIME);
+			ti->temp_stage = TEMP_STAGE_SETTLE;
 			break;
 
-		case TEMP_STAGE_MEASURE:
-
-			ti->temp_last_saved = ti->temp_current;
-			ti->temp_current = ther_get_current_temp();
-
-			if (ti->ble_connect) {
-				if (ti->temp_notification_enable)
-					ther_send_temp_notify(ble_get_gap_handle(), ti->temp_current);
-				if (ti->temp_indication_enable)
-					ther_send_temp_indicate(ble_get_gap_handle(), ti->task_id, ti->temp_current);
-			} else {
-				// TODO: save to local
+		case TEMP_STAGE_SETTLE:
+			if (!ther_temp_power_settled()) {
+				osal_start_timerEx( ti->task_id, TH_TEMP_MEASURE_EVT, TEMP_POWER_POLL_TIME);
+				break;
 			}
 
-			if (ti->display_picture < OLED_DISPLAY_MAX_PICTURE) {
-				/* update temp */
-				ther_display_update_temp(ti);
+			ti->temp_stage = TEMP_STAGE_MEASURE;
+			/* fall through */
+
+		case TEMP_STAGE_MEASURE:
+			/* the ADC is still busy with another async conversion */
+			if (!ther_temp_measure(ther_temp_measured)) {
+				osal_start_timerEx( ti->task_id, TH_TEMP_MEASURE_EVT, TEMP_POWER_POLL_TIME);
+				break;
 			}
 
-			osal_start_timerEx( ti->task_id, TH_TEMP_MEASURE_EVT, ti->temp_measure_interval);
-			ti->temp_stage = TEMP_STAGE_SETUP;
+			ti->temp_stage = TEMP_STAGE_CONVERT;
 			break;
 
 		default:
@@ -481,6 +745,32 @@ uint16 Thermometer_ProcessEvent(uint8 task_id, uint16 events)
 		return (events ^ TH_TEMP_MEASURE_EVT);
 	}
 
+	/* async adc conversion done */
+	if (events & TH_ADC_EVT) {
+		ther_adc_deliver_result();
+
+		return (events ^ TH_ADC_EVT);
+	}
+
+	/* spi flash erase/program done? */
+	if (events & TH_FLASH_EVT) {
+		/* done, the storage programs what waited for the erase */
+		if (ther_spi_w25x_poll())
+			ther_storage_ready();
+
+		return (events ^ TH_FLASH_EVT);
+	}
+
+	/*
+	 * spi flash idle, or a deadline of the data not on it yet: commit and
+	 * erase ahead for the storage, then power it down
+	 */
+	if (events & TH_FLASH_IDLE_EVT) {
+		ther_spi_w25x_idle(ther_storage_idle());
+
+		return (events ^ TH_FLASH_IDLE_EVT);
+	}
+
 	/* Display event */
 	if (events & TH_DISPLAY_EVT) {
 
@@ -493,8 +783,8 @@ uint16 Thermometer_ProcessEvent(uint8 task_id, uint16 events)
 			ti->display_picture = OLED_DISPLAY_OFF;
 			oled_power_off();
 
-			/* change temp measure interval to 5 sec */
-			restart_measure_timer(ti, TEMP_MEASURE_INTERVAL);
+			/* back to the normal measure interval */
+			restart_measure_timer(ti);
 		}
 
 		return (events ^ TH_DISPLAY_EVT);
@@ -521,6 +811,13 @@ uint16 Thermometer_ProcessEvent(uint8 task_id, uint16 events)
 		return (events ^ TH_BUZZER_EVT);
 	}
 
+	/* settings changed a while ago, save them */
+	if (events & TH_SETTING_EVT) {
+		ther_setting_save();
+
+		return (events ^ TH_SETTING_EVT);
+	}
+
 	/* button event */
 	if (events & TH_BUTTON_EVT) {
 		ther_measure_button_time();
@@ -528,20 +825,6 @@ uint16 Thermometer_ProcessEvent(uint8 task_id, uint16 events)
 		return (events ^ TH_BUTTON_EVT);
 	}
 
-	if (events & TH_TEST_EVT) {
-//		oled_picture_inverse();
-
-//		print(LOG_DBG, MODULE "live\r\n");
-
-//		oled_show_temp(TRUE, ti->current_temp);
-
-		ther_spi_w25x_test();
-
-		osal_start_timerEx(ti->task_id, TH_TEST_EVT, 5000);
-
-		return (events ^ TH_TEST_EVT);
-	}
-
 	return 0;
 }
 
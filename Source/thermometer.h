@@ -57,15 +57,18 @@ extern "C"
 // Thermomometer Task Events
 #define TH_START_SYSTEM_EVT                              0x0001
 #define TH_PERIODIC_MEAS_EVT                             0x0002
+#define TH_SETTING_EVT                                   0x0004
 #define TH_PERIODIC_IMEAS_EVT                            0x0008
 #define TH_START_DISCOVERY_EVT                           0x0010
 #define TH_CLOCK_UPDATE_EVT                              0x0020
 #define TH_DISCONNECT_EVT                                0x0040  
 #define TH_BUZZER_EVT									 0x0080
 #define TH_BUTTON_EVT									 0x0100
-#define TH_TEST_EVT										 0x0200
 #define TH_TEMP_MEASURE_EVT								 0x0400
 #define TH_DISPLAY_EVT                                   0x0800
+#define TH_ADC_EVT                                       0x1000
+#define TH_FLASH_EVT                                     0x2000
+#define TH_FLASH_IDLE_EVT                                0x4000
 
 /*********************************************************************
  * MACROS
@@ -101,6 +104,13 @@ extern void Thermometer_Init( uint8 task_id );
  */
 extern uint16 Thermometer_ProcessEvent( uint8 task_id, uint16 events );
 
+/*
+ * PWRMGR_HOLD of the thermometer task, counted: it goes back to
+ * PWRMGR_CONSERVE when the last holder releases it
+ */
+extern void ther_pwrmgr_hold(void);
+extern void ther_pwrmgr_release(void);
+
 
 
 /*********************************************************************
@@ -0,0 +1,341 @@
+/*
+ * flash_device on a memory-mapped image file, for host builds of the
+ * storage (Source/ther_storage.c) and the code above it
+ *
+ * It behaves like the NOR flash: erase sets a sector to 0xFF, program can
+ * only clear bits. program() goes to the file at once, split at the 256
+ * byte pages, every piece is one page program; flush() and sync() have
+ * nothing to do. The image keeps the flash between runs, a new one is
+ * erased.
+ *
+ * flash_file_power_cut(n) drops the power after n units, a unit is one
+ * programmed byte or one erase. The page program or erase it falls in is
+ * torn: the bytes of the page get any of their bits cleared, a random
+ * part of the sector is erased. Nothing is written after, until
+ * flash_file_power_on(). A fault test runs its work once without a cut
+ * to count the units, then once per unit with a cut, and mounts again.
+ *
+ *	struct flash_device fd;
+ *	struct flash_file_timing timing = { 30000, 800, FALSE };
+ *
+ *	flash_file_init(&fd, "flash.img", 128, &timing);
+ *	ther_storage_init(&fd);
+ *
+ * It is built with the firmware headers and the stubs of Tools/host, see
+ * Tools/Makefile.
+ */
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "Comdef.h"
+
+#include "ther_spi_w25x40cl.h"
+#include "flash_file.h"
+
+#define FLASH_FILE_SECTOR_SIZE 4096
+#define FLASH_FILE_PAGE_SIZE 256
+#define FLASH_FILE_ERASED 0xFF
+
+struct flash_file {
+	int fd;
+	uint8 *mem;
+	uint32 size;
+
+	struct flash_file_timing timing;
+	struct flash_file_stat stat;
+
+	uint32 stream_addr;
+
+	long power_units; /* left before the power goes, < 0: never */
+	bool power_lost;
+};
+static struct flash_file flash_file;
+
+static void flash_file_busy(uint32 us)
+{
+	struct flash_file *f = &flash_file;
+
+	f->stat.busy_us += us;
+	if (f->timing.sleep && us)
+		usleep(us);
+}
+
+/*
+ * TRUE if the power is there for [units] more, FALSE if it goes in them
+ */
+static bool flash_file_spend(long units)
+{
+	struct flash_file *f = &flash_file;
+
+	if (f->power_lost)
+		return FALSE;
+
+	if (f->power_units < 0)
+		return TRUE;
+
+	if (f->power_units < units) {
+		f->power_lost = TRUE;
+		return FALSE;
+	}
+
+	f->power_units -= units;
+
+	return TRUE;
+}
+
+static uint8 flash_file_dev_init(void)
+{
+	return FL_EOK;
+}
+
+static uint8 flash_file_open(void)
+{
+	return flash_file.mem ? FL_EOK : FL_EID;
+}
+
+static uint8 flash_file_close(void)
+{
+	return FL_EOK;
+}
+
+static uint32 flash_file_read(int32 pos, void *buffer, uint32 size)
+{
+	struct flash_file *f = &flash_file;
+
+	if (pos < 0 || (uint32)pos >= f->size)
+		return 0;
+	if (size > f->size - pos)
+		size = f->size - pos;
+
+	memcpy(buffer, f->mem + pos, size);
+	f->stat.read_bytes += size;
+
+	return size;
+}
+
+static uint8 flash_file_erase(uint32 sector)
+{
+	struct flash_file *f = &flash_file;
+	uint8 *mem;
+
+	if ((sector + 1) * FLASH_FILE_SECTOR_SIZE > f->size)
+		return FL_EID;
+	mem = f->mem + sector * FLASH_FILE_SECTOR_SIZE;
+
+	if (f->power_lost)
+		return FL_EOK;
+
+	if (!flash_file_spend(1)) {
+		/* torn, a part of the sector is erased */
+		memset(mem, FLASH_FILE_ERASED, rand() % FLASH_FILE_SECTOR_SIZE);
+		return FL_EOK;
+	}
+
+	memset(mem, FLASH_FILE_ERASED, FLASH_FILE_SECTOR_SIZE);
+	f->stat.erase_count++;
+	flash_file_busy(f->timing.erase_us);
+
+	return FL_EOK;
+}
+
+static void flash_file_page_program(uint32 addr, const uint8 *buffer, uint32 size)
+{
+	struct flash_file *f = &flash_file;
+	uint32 i;
+
+	if (f->power_lost)
+		return;
+
+	if (!flash_file_spend(size)) {
+		for (i = 0; i < size; i++)
+			f->mem[addr + i] &= buffer[i] | (uint8)rand();
+		return;
+	}
+
+	for (i = 0; i < size; i++)
+		f->mem[addr + i] &= buffer[i];
+
+	f->stat.program_count++;
+	f->stat.program_bytes += size;
+	flash_file_busy(f->timing.program_us);
+}
+
+static uint32 flash_file_program(uint32 addr, const void *buffer, uint32 size)
+{
+	struct flash_file *f = &flash_file;
+	const uint8 *ptr = buffer;
+	uint32 left, len;
+
+	if (addr >= f->size)
+		return 0;
+	if (size > f->size - addr)
+		size = f->size - addr;
+
+	for (left = size; left; left -= len) {
+		len = FLASH_FILE_PAGE_SIZE - (addr & (FLASH_FILE_PAGE_SIZE - 1));
+		if (len > left)
+			len = left;
+
+		flash_file_page_program(addr, ptr, len);
+
+		addr += len;
+		ptr += len;
+	}
+
+	return size;
+}
+
+static uint8 flash_file_erase_range(uint32 sector, uint32 count)
+{
+	uint32 i;
+
+	if (sector >= flash_file.size / FLASH_FILE_SECTOR_SIZE ||
+		count > flash_file.size / FLASH_FILE_SECTOR_SIZE - sector)
+		return FL_EID;
+
+	for (i = 0; i < count; i++)
+		flash_file_erase(sector + i);
+
+	return FL_EOK;
+}
+
+static uint8 flash_file_flush(void)
+{
+	return FL_EOK;
+}
+
+/* erase and program are done when they return */
+static bool flash_file_dev_busy(void)
+{
+	return FALSE;
+}
+
+static uint8 flash_file_stream_open(uint32 addr)
+{
+	flash_file.stream_addr = addr;
+
+	return FL_EOK;
+}
+
+static uint32 flash_file_stream_read(void *buffer, uint32 size)
+{
+	struct flash_file *f = &flash_file;
+	uint32 n = flash_file_read(f->stream_addr, buffer, size);
+
+	f->stream_addr += n;
+
+	return n;
+}
+
+static void flash_file_stream_close(void)
+{
+}
+
+/*
+ * map [path] as a flash of [sector_count] sectors, [timing] may be NULL
+ */
+uint8 flash_file_init(struct flash_device *fd, const char *path, uint32 sector_count,
+			const struct flash_file_timing *timing)
+{
+	struct flash_file *f = &flash_file;
+	off_t old_size;
+
+	memset(f, 0, sizeof(*f));
+	f->size = sector_count * FLASH_FILE_SECTOR_SIZE;
+	f->power_units = -1;
+	if (timing)
+		f->timing = *timing;
+
+	f->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (f->fd < 0)
+		return FL_EID;
+
+	/* no fstat(), struct stat is a libc struct and these builds are packed */
+	old_size = lseek(f->fd, 0, SEEK_END);
+	if (old_size < 0 || ftruncate(f->fd, f->size) < 0) {
+		close(f->fd);
+		return FL_EID;
+	}
+
+	f->mem = mmap(NULL, f->size, PROT_READ | PROT_WRITE, MAP_SHARED, f->fd, 0);
+	if (f->mem == MAP_FAILED) {
+		f->mem = NULL;
+		close(f->fd);
+		return FL_EID;
+	}
+
+	/* a new image is an erased flash, a grown one gets erased sectors */
+	if ((uint32)old_size < f->size)
+		memset(f->mem + old_size, FLASH_FILE_ERASED, f->size - old_size);
+
+	fd->sector_count = sector_count;
+	fd->bytes_per_sector = FLASH_FILE_SECTOR_SIZE;
+	fd->page_size = FLASH_FILE_PAGE_SIZE;
+
+	fd->init    = flash_file_dev_init;
+	fd->open    = flash_file_open;
+	fd->close   = flash_file_close;
+	fd->read    = flash_file_read;
+	fd->erase   = flash_file_erase;
+	fd->erase_range = flash_file_erase_range;
+	fd->program = flash_file_program;
+	fd->flush   = flash_file_flush;
+	fd->sync    = flash_file_flush;
+	fd->busy    = flash_file_dev_busy;
+	fd->stream_open  = flash_file_stream_open;
+	fd->stream_read  = flash_file_stream_read;
+	fd->stream_close = flash_file_stream_close;
+
+	return FL_EOK;
+}
+
+void flash_file_exit(void)
+{
+	struct flash_file *f = &flash_file;
+
+	if (!f->mem)
+		return;
+
+	msync(f->mem, f->size, MS_SYNC);
+	munmap(f->mem, f->size);
+	close(f->fd);
+	f->mem = NULL;
+}
+
+/*
+ * the power goes after [units] programmed bytes and erases, < 0: never
+ */
+void flash_file_power_cut(long units)
+{
+	struct flash_file *f = &flash_file;
+
+	f->power_units = units;
+	f->power_lost = FALSE;
+}
+
+/*
+ * units left before the power goes, < 0: never
+ */
+long flash_file_power_left(void)
+{
+	return flash_file.power_units;
+}
+
+bool flash_file_power_lost(void)
+{
+	return flash_file.power_lost;
+}
+
+void flash_file_power_on(void)
+{
+	flash_file_power_cut(-1);
+}
+
+const struct flash_file_stat *flash_file_get_stat(void)
+{
+	return &flash_file.stat;
+}
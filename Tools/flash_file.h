@@ -0,0 +1,33 @@
+#ifndef __FLASH_FILE_H__
+#define __FLASH_FILE_H__
+
+/*
+ * time the flash takes, added to flash_file_stat.busy_us, and slept for
+ * if sleep is set. 0 leaves it out.
+ */
+struct flash_file_timing {
+	uint32 erase_us; /* one 4 KB sector */
+	uint32 program_us; /* one page program */
+	bool sleep;
+};
+
+struct flash_file_stat {
+	uint32 erase_count;
+	uint32 program_count; /* page programs */
+	uint32 program_bytes;
+	uint32 read_bytes;
+	uint32 busy_us;
+};
+
+uint8 flash_file_init(struct flash_device *fd, const char *path, uint32 sector_count,
+			const struct flash_file_timing *timing);
+void flash_file_exit(void);
+
+void flash_file_power_cut(long units);
+long flash_file_power_left(void);
+bool flash_file_power_lost(void);
+void flash_file_power_on(void);
+
+const struct flash_file_stat *flash_file_get_stat(void);
+
+#endif
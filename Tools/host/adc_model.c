@@ -0,0 +1,296 @@
+/*
+ * the ADC of the CC2541 with the thermometer front end, for host builds
+ * of Source/ther_adc.c and Source/ther_temp.c
+ *
+ * The firmware drives the registers as on the chip (see Comdef.h of
+ * Tools/host): a write to ADCCON3 starts an extra conversion, ADCL:ADCH
+ * give its result, left justified. With ADCIE set, the conversion ends
+ * in adc_isr() at the adc_model_step() of the ms it is done in.
+ *
+ * The inputs:
+ *
+ *  - AIN0, AIN1: the high and low presision sensor bridges, powered by the
+ *    LDO, from the formulas of Tools/temp_cal_table.py
+ *  - AIN7: the LDO, it rises with ldo_tau_ms after P2.3 goes high
+ *  - GND, VREF, VDD/3, the die temp sensor
+ *
+ * Every conversion gets gaussian noise and now and then a spike, and the
+ * offset and gain error of the config.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "Comdef.h"
+
+#include "ther_adc.h"
+#include "host_osal.h"
+#include "adc_model.h"
+
+#define ADC_R25 100.0 /* kohm, sensor at 25 du */
+#define ADC_B 3950.0
+#define ADC_R9 56.0
+#define ADC_R49 76.8
+#define ADC_R50 56.0
+#define ADC_KELVIN 273.15
+
+#define ADC_FULL 8192.0 /* 14-bit conversion, >> 2 */
+#define ADC_INTERNAL_REF_MV 1240.0
+
+/* die temp sensor, 12 bits against the internal reference */
+#define ADC_DIE_CODE_25 1480.0
+#define ADC_DIE_CODE_PER_DU 4.5
+
+#define ADC_EOC 0x80
+#define ADC_DEC_BITS 0x30
+
+void adc_isr(void);
+
+struct adc_model {
+	struct adc_model_config config;
+	struct adc_model_stat stat;
+
+	double temp;
+
+	bool ldo_on;
+	uint32 ldo_on_time; /* ms */
+
+	unsigned char con1, con3;
+	bool pending; /* ADCCON3 written, result not read */
+	uint16 async_us; /* left of the last ms for the isr chain */
+	unsigned char result_low, result_high;
+};
+static struct adc_model adc_model;
+
+/* about what the CC2541 datasheet gives, and a spike now and then */
+const struct adc_model_config adc_model_default = {
+	.noise_lsb = 4.0,
+	.spike_rate = 0.02,
+	.spike_lsb = 80.0,
+	.offset_lsb = 6.0,
+	.gain_error = 0.005,
+	.ldo_mv = 1800.0,
+	.ldo_tau_ms = 0.5,
+	.avdd_mv = 3000.0,
+	.die_temp = 30.0,
+	.seed = 1,
+};
+
+void adc_model_init(const struct adc_model_config *config)
+{
+	struct adc_model *m = &adc_model;
+
+	m->config = *config;
+	m->temp = 25.0;
+	m->ldo_on = FALSE;
+	m->pending = FALSE;
+	m->async_us = 0;
+	m->con1 = 0x33;
+	adc_model_reset_stat();
+
+	srand(config->seed);
+}
+
+void adc_model_set_temp(double temp)
+{
+	adc_model.temp = temp;
+}
+
+static double adc_sensor_res(double temp)
+{
+	return ADC_R25 * exp(ADC_B * (1.0 / (temp + ADC_KELVIN) - 1.0 / (25.0 + ADC_KELVIN)));
+}
+
+double adc_model_code(unsigned char channel, double temp)
+{
+	double r = adc_sensor_res(temp);
+
+	if (channel == HAL_ADC_CHANNEL_0)
+		return 5.0 * ADC_FULL * (r / (r + ADC_R9) - ADC_R50 / (ADC_R49 + ADC_R50));
+
+	return ADC_FULL * r / (r + ADC_R9);
+}
+
+static void adc_model_ldo(void)
+{
+	struct adc_model *m = &adc_model;
+
+	if (P2_3 && !m->ldo_on)
+		m->ldo_on_time = host_osal_get_time();
+	m->ldo_on = P2_3 ? TRUE : FALSE;
+}
+
+static double adc_ldo_mv(void)
+{
+	struct adc_model *m = &adc_model;
+
+	adc_model_ldo();
+	if (!m->ldo_on)
+		return 0.0;
+
+	return m->config.ldo_mv *
+		(1.0 - exp(-(double)(host_osal_get_time() - m->ldo_on_time) / m->config.ldo_tau_ms));
+}
+
+static double adc_gauss(void)
+{
+	double u1 = (rand() + 1.0) / (RAND_MAX + 2.0);
+	double u2 = (rand() + 1.0) / (RAND_MAX + 2.0);
+
+	return sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+}
+
+/*
+ * (decimation + 16) cycles of the 4 MHz ADC clock
+ */
+static uint16 adc_conversion_us(unsigned char dec)
+{
+	static const unsigned short rate[] = { 64, 128, 256, 512 };
+
+	return (rate[(dec & ADC_DEC_BITS) >> 4] + 16) / 4;
+}
+
+/*
+ * one conversion, the left justified ADCH:ADCL
+ */
+static unsigned short adc_convert(unsigned char channel, unsigned char ref, unsigned char dec)
+{
+	struct adc_model *m = &adc_model;
+	struct adc_model_config *c = &m->config;
+	double ldo = adc_ldo_mv();
+	double ref_mv, in_mv, code;
+	long val;
+	static const unsigned char low_bits[] = { 0xFF, 0x3F, 0x0F, 0x03 };
+
+	switch (ref) {
+	case HAL_ADC_REF_125V:
+		ref_mv = ADC_INTERNAL_REF_MV;
+		break;
+	case HAL_ADC_REF_AIN7:
+		ref_mv = ldo;
+		break;
+	default:
+		ref_mv = c->avdd_mv;
+		break;
+	}
+
+	switch (channel) {
+	case HAL_ADC_CHN_AIN0:
+	case HAL_ADC_CHN_AIN1:
+		in_mv = adc_model_code(channel, m->temp) / ADC_FULL * ldo;
+		break;
+	case HAL_ADC_CHN_AIN7:
+		in_mv = ldo;
+		break;
+	case HAL_ADC_CHN_VREF:
+		in_mv = ref_mv;
+		break;
+	case HAL_ADC_CHN_TEMP:
+		in_mv = (ADC_DIE_CODE_25 + ADC_DIE_CODE_PER_DU * (c->die_temp - 25.0)) / 2048.0 *
+			ADC_INTERNAL_REF_MV;
+		break;
+	case HAL_ADC_CHN_VDD3:
+		in_mv = c->avdd_mv / 3.0;
+		break;
+	default:
+		in_mv = 0.0;
+		break;
+	}
+
+	code = ref_mv < 1.0 ? 0.0 : in_mv / ref_mv * ADC_FULL;
+	code = code * (1.0 + c->gain_error) + c->offset_lsb + c->noise_lsb * adc_gauss();
+	if (c->spike_rate > 0.0 && rand() < c->spike_rate * RAND_MAX)
+		code += rand() & 1 ? c->spike_lsb : -c->spike_lsb;
+
+	val = lround(code);
+	if (val > (long)ADC_FULL - 1)
+		val = (long)ADC_FULL - 1;
+	if (val < -(long)ADC_FULL)
+		val = -(long)ADC_FULL;
+
+	m->stat.conversions++;
+	m->stat.conversion_us += adc_conversion_us(dec);
+
+	return (unsigned short)(val * 4) & ~low_bits[(dec & ADC_DEC_BITS) >> 4];
+}
+
+static void adc_latch(void)
+{
+	struct adc_model *m = &adc_model;
+	unsigned short val;
+
+	if (!m->pending)
+		return;
+
+	val = adc_convert(m->con3 & HAL_ADC_CHN_BITS, m->con3 & HAL_ADC_REF_BITS, m->con3);
+	m->result_low = val & 0xFF;
+	m->result_high = val >> 8;
+	m->pending = FALSE;
+}
+
+volatile unsigned char *host_adccon1(void)
+{
+	adc_model.con1 |= ADC_EOC;
+
+	return &adc_model.con1;
+}
+
+/* it is only ever written */
+volatile unsigned char *host_adccon3(void)
+{
+	adc_model.pending = TRUE;
+
+	return &adc_model.con3;
+}
+
+volatile unsigned char *host_adcl(void)
+{
+	adc_latch();
+
+	return &adc_model.result_low;
+}
+
+volatile unsigned char *host_adch(void)
+{
+	return &adc_model.result_high;
+}
+
+/*
+ * the conversions of the ms that are done by now end in the isr, which
+ * may start the next one
+ */
+void adc_model_step(void)
+{
+	struct adc_model *m = &adc_model;
+	uint16 budget = m->async_us + 1000;
+	uint16 us;
+
+	adc_model_ldo();
+
+	while (m->pending && ADCIE) {
+		us = adc_conversion_us(m->con3);
+		if (us > budget)
+			break;
+		budget -= us;
+
+		ADCIF = 1;
+		m->stat.async++;
+		adc_isr();
+	}
+
+	m->async_us = m->pending && ADCIE ? budget : 0;
+}
+
+const struct adc_model_stat *adc_model_get_stat(void)
+{
+	return &adc_model.stat;
+}
+
+void adc_model_reset_stat(void)
+{
+	struct adc_model_stat *stat = &adc_model.stat;
+
+	stat->conversions = 0;
+	stat->conversion_us = 0;
+	stat->async = 0;
+}
@@ -0,0 +1,42 @@
+#ifndef __ADC_MODEL_H__
+#define __ADC_MODEL_H__
+
+/*
+ * the ADC, the temp LDO and the two sensor channels
+ */
+struct adc_model_config {
+	double noise_lsb; /* rms of a 14-bit conversion */
+	double spike_rate; /* conversions hit by a spike, 0..1 */
+	double spike_lsb; /* size of a spike, either sign */
+	double offset_lsb; /* of the ADC, the GND/VREF cal removes it */
+	double gain_error; /* 0.01 is 1% */
+
+	double ldo_mv;
+	double ldo_tau_ms; /* rise after P2.3 goes high */
+	double avdd_mv;
+	double die_temp; /* du */
+
+	unsigned int seed;
+};
+
+struct adc_model_stat {
+	unsigned long conversions;
+	unsigned long conversion_us; /* time the ADC was busy */
+	unsigned long async; /* conversions ended by the isr */
+};
+
+extern const struct adc_model_config adc_model_default;
+
+void adc_model_init(const struct adc_model_config *config);
+/* the temp at the probe, du */
+void adc_model_set_temp(double temp);
+/* 14-bit code of [channel] (AIN0, AIN1) at [temp], without noise */
+double adc_model_code(unsigned char channel, double temp);
+
+/* once per ms of host time: the LDO, the async conversions */
+void adc_model_step(void);
+
+const struct adc_model_stat *adc_model_get_stat(void);
+void adc_model_reset_stat(void);
+
+#endif
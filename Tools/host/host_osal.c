@@ -0,0 +1,237 @@
+/*
+ * OSAL, the SFRs and print() for the host builds under Tools/
+ *
+ * There is one task: the timers and events of every task id go to the
+ * same place. The clock only moves when the test sets it.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "Comdef.h"
+#include "OSAL.h"
+
+#include "ther_uart_comm.h"
+#include "host_osal.h"
+
+#define HOST_TIMER_NR 16
+#define HOST_SNV_NR 256
+#define HOST_SNV_SIZE 256
+
+struct host_osal {
+	uint32 now; /* ms */
+
+	uint16 events;
+	bool timer_run[HOST_TIMER_NR];
+	uint32 timer_expire[HOST_TIMER_NR];
+
+	uint8 pwrmgr;
+	unsigned char pwrmgr_hold;
+
+	bool snv_valid[HOST_SNV_NR];
+	uint8 snv[HOST_SNV_NR][HOST_SNV_SIZE];
+
+	unsigned char log_level;
+	void (*print_hook)(unsigned char level, const char *line);
+};
+static struct host_osal host_osal = {
+	.log_level = LOG_ERR,
+};
+
+#define HOST_SFR_DEFINE(n) volatile unsigned char n;
+HOST_SFR_DEFINE(P0_0) HOST_SFR_DEFINE(P0_1) HOST_SFR_DEFINE(P0_7)
+HOST_SFR_DEFINE(P1_1) HOST_SFR_DEFINE(P1_3) HOST_SFR_DEFINE(P1_4) HOST_SFR_DEFINE(P1_5)
+HOST_SFR_DEFINE(P1_6) HOST_SFR_DEFINE(P1_7)
+HOST_SFR_DEFINE(P2_3) HOST_SFR_DEFINE(P2_4)
+HOST_SFR_DEFINE(P0SEL) HOST_SFR_DEFINE(P0DIR) HOST_SFR_DEFINE(P0INP)
+HOST_SFR_DEFINE(P1SEL) HOST_SFR_DEFINE(P1DIR) HOST_SFR_DEFINE(P1INP)
+HOST_SFR_DEFINE(P2SEL) HOST_SFR_DEFINE(P2DIR) HOST_SFR_DEFINE(P2INP)
+HOST_SFR_DEFINE(ADCCFG) HOST_SFR_DEFINE(ADCIE) HOST_SFR_DEFINE(ADCIF)
+HOST_SFR_DEFINE(TR0) HOST_SFR_DEFINE(ATEST)
+
+static int host_event_index(uint16 event)
+{
+	int i;
+
+	for (i = 0; i < HOST_TIMER_NR; i++) {
+		if (event == BV(i))
+			return i;
+	}
+
+	return -1;
+}
+
+void host_osal_set_time(uint32 ms)
+{
+	host_osal.now = ms;
+}
+
+uint32 host_osal_get_time(void)
+{
+	return host_osal.now;
+}
+
+uint16 host_osal_take_events(void)
+{
+	struct host_osal *h = &host_osal;
+	uint16 events = h->events;
+	int i;
+
+	for (i = 0; i < HOST_TIMER_NR; i++) {
+		if (h->timer_run[i] && (int32)(h->now - h->timer_expire[i]) >= 0) {
+			h->timer_run[i] = FALSE;
+			events |= BV(i);
+		}
+	}
+	h->events = 0;
+
+	return events;
+}
+
+long host_osal_timer_left(uint16 event)
+{
+	struct host_osal *h = &host_osal;
+	int i = host_event_index(event);
+
+	if (i < 0 || !h->timer_run[i])
+		return -1;
+
+	return (int32)(h->timer_expire[i] - h->now);
+}
+
+uint8 host_osal_pwrmgr_state(void)
+{
+	return host_osal.pwrmgr;
+}
+
+void host_osal_log_level(unsigned char level)
+{
+	host_osal.log_level = level;
+}
+
+void host_osal_print_hook(void (*hook)(unsigned char level, const char *line))
+{
+	host_osal.print_hook = hook;
+}
+
+int print(unsigned char level, char *fmt, ...)
+{
+	char line[256];
+	va_list args;
+
+	va_start(args, fmt);
+	vsnprintf(line, sizeof(line), fmt, args);
+	va_end(args);
+
+	if (host_osal.print_hook)
+		host_osal.print_hook(level, line);
+
+	if (level < host_osal.log_level)
+		return 0;
+
+	return fputs(line, stdout);
+}
+
+uint8 osal_set_event(uint8 task_id, uint16 event_flag)
+{
+	host_osal.events |= event_flag;
+
+	return SUCCESS;
+}
+
+uint8 osal_start_timerEx(uint8 task_id, uint16 event_id, uint32 timeout_value)
+{
+	struct host_osal *h = &host_osal;
+	int i = host_event_index(event_id);
+
+	if (i < 0)
+		return NV_OPER_FAILED;
+
+	h->timer_run[i] = TRUE;
+	h->timer_expire[i] = h->now + timeout_value;
+
+	return SUCCESS;
+}
+
+uint8 osal_stop_timerEx(uint8 task_id, uint16 event_id)
+{
+	int i = host_event_index(event_id);
+
+	if (i >= 0)
+		host_osal.timer_run[i] = FALSE;
+
+	return SUCCESS;
+}
+
+uint8 osal_pwrmgr_task_state(uint8 task_id, uint8 state)
+{
+	host_osal.pwrmgr = state;
+
+	return SUCCESS;
+}
+
+/* as in thermometer.c, which needs the BLE stack */
+void ther_pwrmgr_hold(void)
+{
+	if (host_osal.pwrmgr_hold++ == 0)
+		osal_pwrmgr_task_state(0, PWRMGR_HOLD);
+}
+
+void ther_pwrmgr_release(void)
+{
+	if (host_osal.pwrmgr_hold && --host_osal.pwrmgr_hold == 0)
+		osal_pwrmgr_task_state(0, PWRMGR_CONSERVE);
+}
+
+uint32 osal_GetSystemClock(void)
+{
+	return host_osal.now;
+}
+
+uint32 osal_getClock(void)
+{
+	return host_osal.now / 1000;
+}
+
+void *osal_memcpy(void *dst, const void *src, unsigned int len)
+{
+	return memcpy(dst, src, len);
+}
+
+void *osal_memset(void *dest, uint8 value, int len)
+{
+	return memset(dest, value, len);
+}
+
+uint8 osal_memcmp(const void *src1, const void *src2, unsigned int len)
+{
+	return memcmp(src1, src2, len) == 0;
+}
+
+int osal_strlen(char *pString)
+{
+	return strlen(pString);
+}
+
+uint8 osal_snv_read(uint8 id, uint8 len, void *buf)
+{
+	struct host_osal *h = &host_osal;
+
+	if (!h->snv_valid[id])
+		return NV_OPER_FAILED;
+
+	memcpy(buf, h->snv[id], len);
+
+	return SUCCESS;
+}
+
+uint8 osal_snv_write(uint8 id, uint8 len, void *buf)
+{
+	struct host_osal *h = &host_osal;
+
+	memcpy(h->snv[id], buf, len);
+	h->snv_valid[id] = TRUE;
+
+	return SUCCESS;
+}
@@ -0,0 +1,24 @@
+#ifndef __HOST_OSAL_H__
+#define __HOST_OSAL_H__
+
+/*
+ * what the host builds of the firmware get in place of OSAL: a clock set
+ * by the test, timers and events kept for one task, an SNV in RAM
+ */
+
+void host_osal_set_time(uint32 ms);
+uint32 host_osal_get_time(void);
+
+/* events set, and timers run out by now; they are cleared */
+uint16 host_osal_take_events(void);
+/* ms left on the timer of [event], < 0 if not running */
+long host_osal_timer_left(uint16 event);
+
+uint8 host_osal_pwrmgr_state(void);
+
+/* print() lines below [level] are dropped, LOG_ERR by default */
+void host_osal_log_level(unsigned char level);
+/* every print() line goes to [hook] too, whatever its level */
+void host_osal_print_hook(void (*hook)(unsigned char level, const char *line));
+
+#endif
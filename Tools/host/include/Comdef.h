@@ -0,0 +1,83 @@
+#ifndef __HOST_COMDEF_H__
+#define __HOST_COMDEF_H__
+
+/*
+ * host build: the types of the IAR 8051 build, the SFRs as plain bytes.
+ * Build with -fpack-struct, the firmware structs are laid out without
+ * padding, as on the 8051.
+ */
+
+#include <stddef.h>
+
+typedef unsigned char uint8;
+typedef signed char int8;
+typedef unsigned short uint16;
+typedef short int16;
+typedef unsigned int uint32;
+typedef int int32;
+typedef unsigned char bool;
+typedef unsigned char halIntState_t;
+
+#define TRUE 1
+#define FALSE 0
+#define SUCCESS 0
+#define NV_OPER_FAILED 0x0A
+
+#define BV(n) (1 << (n))
+#define st(x) do { x } while (0)
+
+/* SFRs, see host_osal.c */
+#define HOST_SFR(n) extern volatile unsigned char n;
+HOST_SFR(P0_0) HOST_SFR(P0_1) HOST_SFR(P0_7)
+HOST_SFR(P1_1) HOST_SFR(P1_3) HOST_SFR(P1_4) HOST_SFR(P1_5) HOST_SFR(P1_6) HOST_SFR(P1_7)
+HOST_SFR(P2_3) HOST_SFR(P2_4)
+HOST_SFR(P0SEL) HOST_SFR(P0DIR) HOST_SFR(P0INP)
+HOST_SFR(P1SEL) HOST_SFR(P1DIR) HOST_SFR(P1INP)
+HOST_SFR(P2SEL) HOST_SFR(P2DIR) HOST_SFR(P2INP)
+HOST_SFR(ADCCFG) HOST_SFR(ADCIE) HOST_SFR(ADCIF)
+HOST_SFR(TR0) HOST_SFR(ATEST)
+
+/*
+ * the registers the ADC acts on, see adc_model.c: a write to ADCCON3
+ * starts a conversion, ADCL gives its result
+ */
+volatile unsigned char *host_adccon1(void);
+volatile unsigned char *host_adccon3(void);
+volatile unsigned char *host_adcl(void);
+volatile unsigned char *host_adch(void);
+#define ADCCON1 (*host_adccon1())
+#define ADCCON3 (*host_adccon3())
+#define ADCL (*host_adcl())
+#define ADCH (*host_adch())
+
+#define HAL_ISR_FUNCTION(f, v) void f(void)
+#define HAL_ENTER_ISR()
+#define HAL_EXIT_ISR()
+#define CLEAR_SLEEP_MODE()
+#define HAL_ENTER_CRITICAL_SECTION(s) ((void)(s))
+#define HAL_EXIT_CRITICAL_SECTION(s) ((void)(s))
+
+/* osal, see host_osal.c */
+typedef struct {
+	uint8 event;
+	uint8 status;
+} osal_event_hdr_t;
+
+uint8 osal_set_event(uint8 task_id, uint16 event_flag);
+uint8 osal_start_timerEx(uint8 task_id, uint16 event_id, uint32 timeout_value);
+uint8 osal_stop_timerEx(uint8 task_id, uint16 event_id);
+void *osal_memcpy(void *dst, const void *src, unsigned int len);
+void *osal_memset(void *dest, uint8 value, int len);
+uint8 osal_memcmp(const void *src1, const void *src2, unsigned int len);
+int osal_strlen(char *pString);
+uint32 osal_GetSystemClock(void);
+uint32 osal_getClock(void);
+
+#define PWRMGR_CONSERVE 0
+#define PWRMGR_HOLD 1
+uint8 osal_pwrmgr_task_state(uint8 task_id, uint8 state);
+
+uint8 osal_snv_read(uint8 id, uint8 len, void *buf);
+uint8 osal_snv_write(uint8 id, uint8 len, void *buf);
+
+#endif
@@ -0,0 +1 @@
+#include "Comdef.h"
@@ -0,0 +1,5 @@
+#include "Comdef.h"
+
+#define BLE_NVID_CUST_START 0x80
+
+typedef uint8 bStatus_t;
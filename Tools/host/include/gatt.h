@@ -0,0 +1,9 @@
+#include "Comdef.h"
+
+typedef struct {
+	uint16 handle;
+} attHandleValueInd_t;
+
+typedef struct {
+	uint16 handle;
+} attHandleValueNoti_t;
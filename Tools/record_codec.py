@@ -0,0 +1,163 @@
+#!/usr/bin/env python3
+#
+# Model of the record codec of Source/ther_storage.c, to see how many
+# records a 4 KB sector holds for a trace, and how fast the codec is.
+#
+#   ./record_codec.py FILE     encode a trace, print the ratio and the speed
+#   ./record_codec.py --synth  same on a synthetic trace
+#
+# A trace has one record per line: "time, temp[, type]", time in UTC
+# second, temp in 0.1 du. Lines starting with '#' are skipped.
+#
+# The speed is the one of this model, not of the 8051, only compare runs
+# of the same machine.
+#
+
+import sys
+import time
+
+SECTOR_SIZE = 4096
+HEADER_SIZE = 16    # struct storage_header on the 8051
+RAW_SIZE = 8        # time, temp, type, crc
+TYPE_BITS = 2
+COMMIT = 0x80
+COMMIT_TIME = 600   # second, a commit byte at least this often
+
+
+def crc8(buf):
+	crc = 0
+	for b in buf:
+		crc ^= b
+		for _ in range(8):
+			crc = ((crc << 1) ^ 0x07) & 0xFF if crc & 0x80 else (crc << 1) & 0xFF
+	return crc
+
+
+def zigzag(val):
+	return ((-(val + 1)) << 1) | 1 if val < 0 else val << 1
+
+
+def unzigzag(val):
+	return -(val >> 1) - 1 if val & 1 else val >> 1
+
+
+def put_varint(val):
+	out = bytearray()
+	while val >= 0x80:
+		out.append((val & 0x7F) | 0x80)
+		val >>= 7
+	out.append(val)
+	return out
+
+
+def encode_record(rec, prev):
+	body = put_varint(zigzag(rec[0] - prev[0]))
+	body += put_varint((zigzag(rec[1] - prev[1]) << TYPE_BITS) | (rec[2] & ((1 << TYPE_BITS) - 1)))
+	return bytes([crc8(body) % 127 + 1]) + bytes(body)
+
+
+def encode(trace):
+	"""same as ther_storage_append(), return the list of sectors"""
+	sectors = []
+	buf = None
+	prev = (0, 0)
+	commit_time = 0
+
+	for rec in trace:
+		data = encode_record(rec, prev)
+		# a byte is kept for the commit
+		if buf is None or HEADER_SIZE + len(buf) + len(data) >= SECTOR_SIZE:
+			if buf is not None:
+				sectors.append(bytes(buf))
+			buf = bytearray()
+			data = encode_record(rec, (0, 0))
+		buf += data
+		prev = rec
+
+		if rec[0] - commit_time >= COMMIT_TIME:
+			buf.append(COMMIT)
+			commit_time = rec[0]
+
+	if buf is not None:
+		sectors.append(bytes(buf))
+	return sectors
+
+
+def decode(sectors):
+	"""same as cursor_next()"""
+	out = []
+	for buf in sectors:
+		t, temp, i = 0, 0, 0
+		while i < len(buf):
+			if buf[i] == COMMIT:
+				i += 1
+				continue
+			check = buf[i]
+			n = i + 1
+			val = []
+			for _ in range(2):
+				v, shift = 0, 0
+				while True:
+					v |= (buf[n] & 0x7F) << shift
+					shift += 7
+					n += 1
+					if not buf[n - 1] & 0x80:
+						break
+				val.append(v)
+			if crc8(buf[i + 1:n]) % 127 + 1 != check:
+				raise ValueError("bad record at %d" % i)
+			t += unzigzag(val[0])
+			temp += unzigzag(val[1] >> TYPE_BITS)
+			out.append((t, temp, val[1] & ((1 << TYPE_BITS) - 1)))
+			i = n
+	return out
+
+
+def synth_trace():
+	"""one day at 5 s, 36.5 du with a slow swing and +/- 0.2 du of noise"""
+	import math
+	import random
+	rnd = random.Random(1)
+	t0 = 1500000000
+	for i in range(24 * 3600 // 5):
+		temp = 365 + int(round(5 * math.sin(i / 2000.0))) + rnd.randint(-2, 2)
+		yield (t0 + i * 5 + rnd.randint(0, 1), temp, 1)
+
+
+def read_trace(path):
+	with open(path) as f:
+		for line in f:
+			line = line.strip()
+			if not line or line.startswith("#"):
+				continue
+			v = [int(x) for x in line.split(",")]
+			yield v[0], v[1], v[2] if len(v) > 2 else 1
+
+
+if __name__ == "__main__":
+	args = [a for a in sys.argv[1:] if not a.startswith("--")]
+	if "--synth" not in sys.argv[1:] and len(args) != 1:
+		sys.exit("usage: %s FILE | --synth" % sys.argv[0])
+	trace = list(synth_trace() if "--synth" in sys.argv[1:] else read_trace(args[0]))
+	if not trace:
+		sys.exit("empty trace")
+
+	start = time.time()
+	sectors = encode(trace)
+	encode_time = time.time() - start
+
+	start = time.time()
+	back = decode(sectors)
+	decode_time = time.time() - start
+
+	if back != trace:
+		sys.exit("decoded trace differs")
+
+	size = sum(len(s) for s in sectors)
+	raw_per_sector = (SECTOR_SIZE - HEADER_SIZE) // RAW_SIZE
+	print("%d records, %d sectors, %.2f bytes per record" % (len(trace), len(sectors), size / float(len(trace))))
+	print("ratio %.2f against the raw %d bytes, %d records per sector instead of %d" %
+			(RAW_SIZE * len(trace) / float(size), RAW_SIZE,
+			len(trace) // len(sectors), raw_per_sector))
+	print("encode %.0f records/s, decode %.0f records/s" %
+			(len(trace) / max(encode_time, 1e-9), len(trace) / max(decode_time, 1e-9)))
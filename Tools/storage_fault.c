@@ -0,0 +1,347 @@
+/*
+ * power cuts in Source/ther_storage.c, see flash_file_power_cut()
+ *
+ *	storage_fault [appends] [image]
+ *
+ * The work is a small log taking a record per append with a flush and an
+ * idle call after each, so every path of the storage is hit: sectors
+ * closed and reclaimed, the spare pool refilled, a clear in the middle.
+ * It is run once to count the programmed bytes and erases, then once per
+ * unit with the power cut there. After each cut the log is mounted again
+ * and checked:
+ *
+ *  - the records read are those appended, in order, with no gap, and the
+ *    count is the number read
+ *  - no committed record is lost but those of reclaimed sectors, none of
+ *    the appends after the cut is there
+ *  - the log takes records again and keeps them over a mount
+ *
+ * Then the clear alone, on a log of several sectors, with the power cut
+ * at each of its programs: after the mount the log is empty or all there.
+ *
+ * Exits with 1 if a cut fails.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "Comdef.h"
+
+#include "ther_spi_w25x40cl.h"
+#include "ther_storage.h"
+#include "flash_file.h"
+#include "host_osal.h"
+
+#define FAULT_SECTOR_NR 4
+#define FAULT_APPEND_NR 7000
+#define FAULT_CLEAR_AT 2500
+#define FAULT_AFTER_NR 1500 /* appends after the recovery */
+#define FAULT_TIME_BASE 1000
+#define FAULT_INTERVAL 5
+#define FAULT_MAX_FAILED 10
+#define FAULT_CLEAR_FILL 2000 /* appends before the clear alone, 2 sectors */
+
+struct fault_test {
+	struct flash_device fd;
+	long append_nr;
+	long clear_at;
+
+	/* oldest record after each append, without cuts */
+	long *oldest;
+};
+static struct fault_test fault_test;
+
+static uint16 fault_temp(long i)
+{
+	return 300 + (i * 13 % 50);
+}
+
+static long fault_index(uint32 time)
+{
+	return ((long)time - FAULT_TIME_BASE) / FAULT_INTERVAL;
+}
+
+static void fault_append(long i)
+{
+	host_osal_set_time((FAULT_TIME_BASE + i * FAULT_INTERVAL) * 1000UL);
+	ther_storage_append(STORAGE_TYPE_TEMP, fault_temp(i));
+}
+
+static long fault_oldest(void)
+{
+	struct storage_cursor cursor;
+	struct storage_record record;
+
+	ther_storage_rewind(&cursor);
+	if (!ther_storage_read_next(&cursor, &record))
+		return -1;
+
+	return fault_index(record.time);
+}
+
+static void fault_erase(void)
+{
+	flash_file_power_on();
+	fault_test.fd.erase_range(0, FAULT_SECTOR_NR);
+}
+
+/*
+ * the work, until the power goes; [done] gets the appends finished and
+ * [cleared] if the clear was finished. Returns the append the power went in
+ */
+static long fault_run(long *done, bool *cleared)
+{
+	struct fault_test *t = &fault_test;
+	long i;
+
+	*done = 0;
+	*cleared = FALSE;
+	ther_storage_init(&t->fd);
+
+	for (i = 0; i < t->append_nr; i++) {
+		if (i == t->clear_at) {
+			ther_storage_clear();
+			if (flash_file_power_lost())
+				return i;
+			*cleared = TRUE;
+		}
+
+		fault_append(i);
+		ther_storage_flush();
+		ther_storage_idle();
+		if (flash_file_power_lost())
+			return i;
+
+		*done = i + 1;
+	}
+
+	return i;
+}
+
+static bool fault_check(long cut, long inflight, long done, bool cleared)
+{
+	struct fault_test *t = &fault_test;
+	struct storage_cursor cursor;
+	struct storage_record record;
+	long first = -1, last = -1, n = 0, i;
+
+	ther_storage_rewind(&cursor);
+	while (ther_storage_read_next(&cursor, &record)) {
+		i = fault_index(record.time);
+		if (record.time != FAULT_TIME_BASE + i * FAULT_INTERVAL ||
+			record.temp != fault_temp(i) || record.type != STORAGE_TYPE_TEMP) {
+			printf("cut %ld: bad record %ld\n", cut, i);
+			return FALSE;
+		}
+
+		if (first < 0) {
+			first = i;
+		} else if (i != last + 1) {
+			printf("cut %ld: gap %ld -> %ld\n", cut, last, i);
+			return FALSE;
+		}
+		last = i;
+		n++;
+	}
+
+	if (n != (long)ther_storage_count()) {
+		printf("cut %ld: count %lu, %ld read\n", cut, (unsigned long)ther_storage_count(), n);
+		return FALSE;
+	}
+
+	if (last > inflight) {
+		printf("cut %ld: record %ld, the power went in %ld\n", cut, last, inflight);
+		return FALSE;
+	}
+
+	/* a clear cut in the middle leaves the log empty or as it was */
+	if (inflight == t->clear_at && !cleared) {
+		if (n && t->clear_at && (first != t->oldest[t->clear_at - 1] ||
+			last != t->clear_at - 1)) {
+			printf("cut %ld: in the clear, records %ld..%ld\n", cut, first, last);
+			return FALSE;
+		}
+		return TRUE;
+	}
+
+	/* cleared, nothing appended since */
+	if (cleared && done == t->clear_at)
+		done = 0;
+
+	if (done && last < done - 1) {
+		printf("cut %ld: committed %ld lost, last %ld\n", cut, done - 1, last);
+		return FALSE;
+	}
+
+	/* the oldest may go with the sector the append in the cut reclaimed */
+	if (done && first > t->oldest[done - 1] &&
+		(inflight >= t->append_nr || first > t->oldest[inflight])) {
+		printf("cut %ld: oldest %ld, should be %ld\n", cut, first, t->oldest[done - 1]);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static bool fault_recover(long cut, long inflight)
+{
+	struct storage_cursor cursor;
+	struct storage_record record;
+	long from = inflight + 1, last = -1, n = 0, i;
+
+	for (i = 0; i < FAULT_AFTER_NR; i++)
+		fault_append(from + i);
+	ther_storage_flush();
+	ther_storage_init(&fault_test.fd);
+
+	ther_storage_rewind(&cursor);
+	while (ther_storage_read_next(&cursor, &record)) {
+		i = fault_index(record.time);
+		if (record.temp != fault_temp(i) || (last >= 0 && i != last + 1 && i != from))
+			break;
+		last = i;
+		n++;
+	}
+
+	if (last != from + FAULT_AFTER_NR - 1 || n != (long)ther_storage_count()) {
+		printf("cut %ld: after the recovery last %ld, %ld read, count %lu\n",
+			cut, last, n, (unsigned long)ther_storage_count());
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * a log of FAULT_CLEAR_FILL records, return the oldest
+ */
+static long fault_clear_fill(void)
+{
+	long i;
+
+	fault_erase();
+	flash_file_power_cut(1L << 40);
+	ther_storage_init(&fault_test.fd);
+	for (i = 0; i < FAULT_CLEAR_FILL; i++) {
+		fault_append(i);
+		ther_storage_flush();
+		ther_storage_idle();
+	}
+
+	return fault_oldest();
+}
+
+/*
+ * after a clear cut in the middle: the log empty or as it was
+ */
+static bool fault_clear_check(long cut, long oldest)
+{
+	struct storage_cursor cursor;
+	struct storage_record record;
+	long first = -1, last = -1, n = 0, i;
+
+	ther_storage_rewind(&cursor);
+	while (ther_storage_read_next(&cursor, &record)) {
+		i = fault_index(record.time);
+		if (first < 0)
+			first = i;
+		else if (i != last + 1)
+			break;
+		last = i;
+		n++;
+	}
+
+	if (n != (long)ther_storage_count() ||
+		(n && (first != oldest || last != FAULT_CLEAR_FILL - 1))) {
+		printf("clear cut %ld: records %ld..%ld, %ld read, count %lu\n",
+			cut, first, last, n, (unsigned long)ther_storage_count());
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * the clear alone, return the cuts failed
+ */
+static long fault_clear(void)
+{
+	long oldest, units, cut, failed = 0;
+
+	fault_clear_fill();
+	flash_file_power_cut(1L << 40);
+	ther_storage_clear();
+	units = (1L << 40) - flash_file_power_left();
+
+	for (cut = 0; cut < units; cut++) {
+		oldest = fault_clear_fill();
+		srand(cut);
+		flash_file_power_cut(cut);
+		ther_storage_clear();
+
+		flash_file_power_on();
+		ther_storage_init(&fault_test.fd);
+
+		if (!fault_clear_check(cut, oldest))
+			failed++;
+	}
+
+	printf("clear of %ld records: %ld cuts, %ld failed\n", (long)FAULT_CLEAR_FILL,
+		cut, failed);
+
+	return failed;
+}
+
+int main(int argc, char **argv)
+{
+	struct fault_test *t = &fault_test;
+	const char *path = argc > 2 ? argv[2] : "storage_fault.img";
+	long units, cut, inflight, done, i, failed = 0;
+	bool cleared;
+
+	t->append_nr = argc > 1 ? atol(argv[1]) : FAULT_APPEND_NR;
+	t->clear_at = t->append_nr * FAULT_CLEAR_AT / FAULT_APPEND_NR;
+	t->oldest = malloc(sizeof(long) * t->append_nr);
+
+	remove(path);
+	if (!t->oldest || flash_file_init(&t->fd, path, FAULT_SECTOR_NR, NULL) != FL_EOK) {
+		printf("can't map %s\n", path);
+		return 1;
+	}
+
+	/* without cuts: the oldest record after each append, and the units */
+	ther_storage_init(&t->fd);
+	flash_file_power_cut(1L << 40);
+	for (i = 0; i < t->append_nr; i++) {
+		if (i == t->clear_at)
+			ther_storage_clear();
+		fault_append(i);
+		ther_storage_flush();
+		ther_storage_idle();
+		t->oldest[i] = fault_oldest();
+	}
+	units = (1L << 40) - flash_file_power_left();
+	printf("%ld appends, %ld programmed bytes and erases\n", t->append_nr, units);
+
+	for (cut = 0; cut < units && failed < FAULT_MAX_FAILED; cut++) {
+		fault_erase();
+		srand(cut);
+		flash_file_power_cut(cut);
+		inflight = fault_run(&done, &cleared);
+
+		flash_file_power_on();
+		ther_storage_init(&t->fd);
+
+		if (!fault_check(cut, inflight, done, cleared) || !fault_recover(cut, inflight))
+			failed++;
+	}
+
+	printf("%ld cuts, %ld failed\n", cut, failed);
+
+	failed += fault_clear();
+
+	flash_file_exit();
+	remove(path);
+
+	return failed != 0;
+}
@@ -0,0 +1,227 @@
+/*
+ * Source/ther_storage.c on a flash image, see flash_file.c
+ *
+ *	storage_test [image]
+ *
+ * fills the log past its end, mounts it again, seeks in it, clears it
+ * and cuts the power in an append. Every record read back is checked
+ * against the one appended. Exits with 1 if one check fails.
+ */
+
+#include <stdio.h>
+
+#include "Comdef.h"
+
+#include "ther_spi_w25x40cl.h"
+#include "ther_storage.h"
+#include "flash_file.h"
+#include "host_osal.h"
+
+#define TEST_SECTOR_NR 128
+#define TEST_INTERVAL 5 /* s between two records */
+#define TEST_FILL_NR 5000
+#define TEST_WRAP_NR 300000 /* more than the log holds */
+
+static struct flash_device test_flash;
+static int test_failed;
+
+static uint16 test_temp(uint32 time)
+{
+	return 280 + (time * 7 % 40);
+}
+
+static void test_append(uint32 time)
+{
+	host_osal_set_time(time * 1000);
+	ther_storage_append(STORAGE_TYPE_TEMP, test_temp(time));
+}
+
+/*
+ * read from [cursor] to the end, the records are [TEST_INTERVAL] apart
+ * and their temps are those appended. Returns the number read, the first
+ * time in [first]
+ */
+static long test_read(const char *what, struct storage_cursor *cursor, uint32 *first)
+{
+	struct storage_record record;
+	uint32 last = 0;
+	long n = 0, bad = 0;
+
+	while (ther_storage_read_next(cursor, &record)) {
+		if (record.type != STORAGE_TYPE_TEMP || record.temp != test_temp(record.time))
+			bad++;
+		if (n && record.time != last + TEST_INTERVAL)
+			bad++;
+		if (!n && first)
+			*first = record.time;
+
+		last = record.time;
+		n++;
+	}
+
+	if (bad) {
+		printf("%s: %ld bad records\n", what, bad);
+		test_failed++;
+	}
+
+	return n;
+}
+
+static void test_expect(const char *what, bool ok)
+{
+	printf("%-40s %s\n", what, ok ? "ok" : "FAILED");
+	if (!ok)
+		test_failed++;
+}
+
+static void test_log(const char *what, uint32 count, uint32 first, uint32 last)
+{
+	struct storage_cursor cursor;
+	uint32 read_first = 0;
+	long n;
+
+	ther_storage_rewind(&cursor);
+	n = test_read(what, &cursor, &read_first);
+
+	test_expect(what, n == (long)ther_storage_count() &&
+		(!count || n == (long)count) &&
+		(!n || read_first == first) &&
+		(!n || read_first + (n - 1) * TEST_INTERVAL == last));
+}
+
+static void test_fill(void)
+{
+	uint32 i;
+
+	for (i = 0; i < TEST_FILL_NR; i++)
+		test_append(i * TEST_INTERVAL);
+	test_log("fill", TEST_FILL_NR, 0, (TEST_FILL_NR - 1) * TEST_INTERVAL);
+
+	ther_storage_flush();
+	ther_storage_init(&test_flash);
+	test_log("fill, mounted", TEST_FILL_NR, 0, (TEST_FILL_NR - 1) * TEST_INTERVAL);
+}
+
+static void test_wrap(void)
+{
+	struct storage_cursor cursor;
+	uint32 last = (TEST_WRAP_NR - 1) * TEST_INTERVAL;
+	uint32 first, count, i;
+
+	for (i = TEST_FILL_NR; i < TEST_WRAP_NR; i++)
+		test_append(i * TEST_INTERVAL);
+	ther_storage_flush();
+	ther_storage_init(&test_flash);
+
+	count = ther_storage_count();
+	first = last - (count - 1) * TEST_INTERVAL;
+	test_expect("wrap, older sectors dropped", count < TEST_WRAP_NR);
+	test_log("wrap, mounted", 0, first, last);
+
+	ther_storage_seek_seq(&cursor, 0);
+	test_expect("seek seq 0, all of the log", test_read("seek seq", &cursor, NULL) == (long)count);
+}
+
+static void test_seek(void)
+{
+	static const uint32 query[] = {
+		0, 5, 700000, 700001, 1234567, 1499995, 1499996, 2000000,
+	};
+	struct storage_cursor cursor, oldest;
+	uint32 first_log = 0, first, last = (TEST_WRAP_NR - 1) * TEST_INTERVAL;
+	char what[40];
+	bool found, ok;
+	long n;
+	int i;
+
+	ther_storage_rewind(&oldest);
+	test_read("seek, rewind", &oldest, &first_log);
+
+	for (i = 0; i < sizeof(query) / sizeof(query[0]); i++) {
+		first = 0;
+		found = ther_storage_seek_time(&cursor, query[i]);
+		n = found ? test_read("seek time", &cursor, &first) : 0;
+
+		/* the first record at or after the time, none past the end */
+		if (query[i] > last) {
+			ok = !found || n == 0;
+		} else {
+			uint32 expect = query[i] < first_log ? first_log :
+				(query[i] + TEST_INTERVAL - 1) / TEST_INTERVAL * TEST_INTERVAL;
+
+			ok = found && first == expect && n == (long)((last - expect) / TEST_INTERVAL + 1);
+		}
+
+		snprintf(what, sizeof(what), "seek time %lu", (unsigned long)query[i]);
+		test_expect(what, ok);
+	}
+}
+
+static void test_clear(void)
+{
+	uint32 base = 2000000, i;
+
+	ther_storage_clear();
+	test_log("clear", 0, 0, 0);
+	test_expect("clear, empty", ther_storage_count() == 0);
+
+	for (i = 0; i < 10; i++)
+		test_append(base + i * TEST_INTERVAL);
+	test_log("clear, appended", 10, base, base + 9 * TEST_INTERVAL);
+}
+
+/*
+ * the power goes in the middle of the appends: after mounting again the
+ * log is what was committed, and takes records again
+ */
+static void test_power_cut(void)
+{
+	uint32 base = 2000000, next, before, count, i;
+
+	ther_storage_flush();
+	before = ther_storage_count();
+	next = base + before * TEST_INTERVAL;
+
+	flash_file_power_cut(10);
+	for (i = 0; i < 100; i++)
+		test_append(next + i * TEST_INTERVAL);
+	test_expect("power cut, lost", flash_file_power_lost());
+
+	flash_file_power_on();
+	ther_storage_init(&test_flash);
+	count = ther_storage_count();
+	test_expect("power cut, committed kept", count >= before && count < before + 100);
+	test_log("power cut, mounted", count, base, base + (count - 1) * TEST_INTERVAL);
+
+	next = base + count * TEST_INTERVAL;
+	for (i = 0; i < 10; i++)
+		test_append(next + i * TEST_INTERVAL);
+	ther_storage_flush();
+	ther_storage_init(&test_flash);
+	test_log("power cut, appended after", count + 10, base, next + 9 * TEST_INTERVAL);
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = argc > 1 ? argv[1] : "storage_test.img";
+
+	remove(path);
+	if (flash_file_init(&test_flash, path, TEST_SECTOR_NR, NULL) != FL_EOK) {
+		printf("can't map %s\n", path);
+		return 1;
+	}
+	ther_storage_init(&test_flash);
+
+	test_fill();
+	test_wrap();
+	test_seek();
+	test_clear();
+	test_power_cut();
+
+	flash_file_exit();
+	remove(path);
+
+	printf("%s\n", test_failed ? "FAILED" : "passed");
+
+	return test_failed != 0;
+}
@@ -0,0 +1,220 @@
+/*
+ * noise of the burst filter of Source/ther_temp.c against the LDO on-time
+ *
+ *	temp_burst_<samples>_<trim> [readings]
+ *
+ * ther_temp.c, ther_adc.c and ther_temp_cal.c run on the ADC model, each
+ * binary with its TEMP_BURST_SAMPLES and TEMP_BURST_TRIM, see Makefile.
+ * A reading is taken as the thermometer task takes it: LDO on, settle
+ * polls every 2 ms, ther_temp_measure(), its burst converted from the ADC
+ * isr and delivered by TH_ADC_EVT. The probe stays at one temp, so the
+ * spread of the filtered adc codes is the noise left; it is set against
+ * the spread of single conversions on the same model.
+ *
+ * The adc codes are taken from the LOG_DBG line of ther_temp_by_adc().
+ * Exits with 1 if a reading was not delivered, if a conversion of the
+ * bursts was not ended by the isr, or if the pwrmgr hold is not released.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Comdef.h"
+
+#include "ther_adc.h"
+#include "ther_temp_cal.h"
+#include "ther_temp.h"
+#include "ther_uart_comm.h"
+#include "thermometer.h"
+#include "OSAL_PwrMgr.h"
+#include "host_osal.h"
+#include "adc_model.h"
+
+#define BURST_TASK_ID 1
+#define BURST_READINGS 2000
+#define BURST_SINGLES 20000
+#define BURST_TEMP 37.05 /* du, between two displayed digits */
+#define BURST_POLL_TIME 2 /* ms, TEMP_POWER_POLL_TIME */
+#define BURST_INTERVAL 5000 /* ms */
+
+struct burst_sum {
+	double sum, sum2;
+	long n;
+};
+
+static int burst_adc_high, burst_adc_low;
+static bool burst_adc_valid;
+static unsigned short burst_temp;
+static bool burst_measured;
+
+static void burst_add(struct burst_sum *s, double val)
+{
+	s->sum += val;
+	s->sum2 += val * val;
+	s->n++;
+}
+
+static double burst_rms(const struct burst_sum *s)
+{
+	double mean = s->sum / s->n;
+
+	return sqrt(s->sum2 / s->n - mean * mean);
+}
+
+static void burst_print_hook(unsigned char level, const char *line)
+{
+	const char *p = strstr(line, "] adc ");
+
+	if (p && sscanf(p, "] adc %d/%d", &burst_adc_high, &burst_adc_low) == 2)
+		burst_adc_valid = TRUE;
+}
+
+static void burst_step(void)
+{
+	host_osal_set_time(host_osal_get_time() + 1);
+	adc_model_step();
+
+	if (host_osal_take_events() & TH_ADC_EVT)
+		ther_adc_deliver_result();
+}
+
+static void burst_wait(uint32 ms)
+{
+	while (ms--)
+		burst_step();
+}
+
+static void burst_temp_measured(unsigned short temp)
+{
+	burst_temp = temp;
+	burst_measured = TRUE;
+}
+
+static void burst_settle(void)
+{
+	ther_temp_power_on();
+	do {
+		burst_wait(BURST_POLL_TIME);
+	} while (!ther_temp_power_settled());
+}
+
+/*
+ * as the thermometer task does it, see TH_TEMP_MEASURE_EVT
+ *
+ * return: FALSE if the temp was not delivered
+ */
+static bool burst_reading(unsigned short *temp)
+{
+	uint32 ms;
+
+	burst_settle();
+
+	burst_measured = FALSE;
+	if (!ther_temp_measure(burst_temp_measured))
+		return FALSE;
+	for (ms = 0; !burst_measured && ms < BURST_INTERVAL; ms++)
+		burst_step();
+
+	burst_wait(BURST_INTERVAL);
+	*temp = burst_temp;
+
+	return burst_measured;
+}
+
+/*
+ * spread of one conversion, calibrated like the burst is
+ */
+static void burst_singles(struct burst_sum *high, struct burst_sum *low)
+{
+	unsigned short temp;
+	long i;
+
+	ther_temp_power_on();
+	while (!ther_temp_power_settled())
+		burst_wait(BURST_POLL_TIME);
+	adc_cal_update(HAL_ADC_REF_AIN7);
+
+	for (i = 0; i < BURST_SINGLES; i++) {
+		burst_add(high, adc_cal_apply(read_adc(HAL_ADC_CHANNEL_0, HAL_ADC_RESOLUTION_14, HAL_ADC_REF_AIN7)));
+		burst_add(low, adc_cal_apply(read_adc(HAL_ADC_CHANNEL_1, HAL_ADC_RESOLUTION_14, HAL_ADC_REF_AIN7)));
+	}
+
+	/* P2.3 off again, the reading takes the power stat */
+	burst_reading(&temp);
+}
+
+int main(int argc, char **argv)
+{
+	struct burst_sum single_high = { 0 }, single_low = { 0 };
+	struct burst_sum high = { 0 }, low = { 0 };
+	const struct adc_model_stat *adc = adc_model_get_stat();
+	const struct ther_temp_power_stat *power;
+	long readings = argc > 1 ? atol(argv[1]) : BURST_READINGS;
+	long i, flicker = 0, lost = 0;
+	unsigned long ldo_total, measure_count;
+	unsigned short temp, temp_last = 0;
+	double ldo_ms;
+
+	adc_model_init(&adc_model_default);
+	adc_model_set_temp(BURST_TEMP);
+	host_osal_set_time(1000);
+	host_osal_log_level(LOG_CRIT + 1);
+	host_osal_print_hook(burst_print_hook);
+
+	ther_adc_init(BURST_TASK_ID);
+	ther_temp_init();
+
+	burst_singles(&single_high, &single_low);
+	adc_model_reset_stat();
+	power = ther_temp_get_power_stat();
+	ldo_total = power->ldo_on_total;
+	measure_count = power->measure_count;
+
+	for (i = 0; i < readings; i++) {
+		burst_adc_valid = FALSE;
+		if (!burst_reading(&temp) || !burst_adc_valid) {
+			lost++;
+			continue;
+		}
+
+		burst_add(&high, burst_adc_high);
+		burst_add(&low, burst_adc_low);
+		if (i && temp != temp_last)
+			flicker++;
+		temp_last = temp;
+	}
+
+	/* the async conversions run on the clock, in whole ms */
+	ldo_ms = (double)(power->ldo_on_total - ldo_total) / (power->measure_count - measure_count);
+
+	printf("%2d samples, trim %d: %5.1f conversions (%5.1f by the isr) %5.2f ms LDO on "
+		"(%4.2f converting), rms %5.2f/%5.2f lsb, %4.1fx/%4.1fx less than one conversion, "
+		"display changed %4.1f%%\n",
+		TEMP_BURST_SAMPLES, TEMP_BURST_TRIM,
+		(double)adc->conversions / readings, (double)adc->async / readings,
+		ldo_ms, adc->conversion_us / 1000.0 / readings,
+		burst_rms(&high), burst_rms(&low),
+		burst_rms(&single_high) / burst_rms(&high), burst_rms(&single_low) / burst_rms(&low),
+		100.0 * flicker / (readings - 1));
+
+	if (lost) {
+		printf("%ld readings not delivered\n", lost);
+		return 1;
+	}
+
+	/* the settle polls are the only conversions not ended by the isr */
+	if (adc->async != (unsigned long)readings * TEMP_BURST_SAMPLES * 2) {
+		printf("%lu conversions by the isr, %ld expected\n", adc->async,
+			readings * TEMP_BURST_SAMPLES * 2);
+		return 1;
+	}
+
+	if (host_osal_pwrmgr_state() != PWRMGR_CONSERVE) {
+		printf("pwrmgr still held\n");
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,142 @@
+#!/usr/bin/env python3
+#
+# Generate the adc => temp tables used by Source/ther_temp_cal.c, and sweep
+# every adc code (0..8191) to compare the integer path with the float formulas
+# the firmware used before.
+#
+#   ./temp_cal_table.py                  print the C tables
+#   ./temp_cal_table.py --sweep          print the max error of each channel
+#
+# Temp traces go through the firmware itself, see temp_replay.c.
+#
+
+import math
+import sys
+
+R25 = 100.0     # kohm, sensor resistance at 25 du
+B = 3950.0      # sensor B value
+R9 = 56.0       # kohm
+R49 = 76.8      # kohm
+R50 = 56.0      # kohm
+
+ADC_MAX = 8192  # 14-bit conversion, >> 2
+
+TEMP_MIN = 0.0      # du
+TEMP_MAX = 100.0    # du
+
+HIGH_PRESISION = 0
+LOW_PRESISION = 1
+
+# adc step between two table entries is (1 << shift)
+SHIFT = {
+	HIGH_PRESISION: 7,
+	LOW_PRESISION: 5,
+}
+
+NAME = {
+	HIGH_PRESISION: "high_presision",
+	LOW_PRESISION: "low_presision",
+}
+
+
+def res_by_adc(channel, adc):
+	if channel == HIGH_PRESISION:
+		return R9 / (1.0 / (adc / (5.0 * ADC_MAX) + R50 / (R49 + R50)) - 1)
+
+	if adc <= 0:
+		return 0.0
+	if adc >= ADC_MAX:
+		return float("inf")
+	return R9 * adc / (ADC_MAX - adc)
+
+
+def temp_by_res(res):
+	"""float formula of the old firmware, unit: du"""
+	if res <= 0.0:
+		return float("inf")
+	if res == float("inf"):
+		return -273.15
+	return 1.0 / (1.0 / (25.0 + 273.15) - math.log(R25 / res) / B) - 273.15
+
+
+def temp_by_adc(channel, adc):
+	return temp_by_res(res_by_adc(channel, adc))
+
+
+def build_table(channel):
+	"""
+	return (first_idx, entries), entry i is the temp of adc (first_idx + i) << shift,
+	unit: 0.01 du. Only entries inside [TEMP_MIN, TEMP_MAX] are kept.
+	"""
+	step = 1 << SHIFT[channel]
+	idx = [i for i in range(ADC_MAX // step + 1)
+			if TEMP_MIN <= temp_by_adc(channel, i * step) <= TEMP_MAX]
+
+	return idx[0], [int(round(temp_by_adc(channel, i * step) * 100)) for i in idx]
+
+
+def lookup(channel, first, table, adc):
+	"""same integer math as temp_cal_get_temp_by_adc()"""
+	shift = SHIFT[channel]
+	base = first << shift
+
+	if adc <= base:
+		return (table[0] + 5) // 10
+
+	k = (adc - base) >> shift
+	if k >= len(table) - 1:
+		return (table[-1] + 5) // 10
+
+	frac = (adc - base) & ((1 << shift) - 1)
+	t = (table[k] << shift) + (table[k + 1] - table[k]) * frac
+
+	return (t + (5 << shift)) // (10 << shift)
+
+
+def print_table(channel):
+	first, table = build_table(channel)
+	name = NAME[channel]
+
+	print("#define %s_SHIFT %d" % (name.upper(), SHIFT[channel]))
+	print("#define %s_FIRST %d" % (name.upper(), first))
+	print("static const unsigned short %s_table[] = {" % name)
+	for i in range(0, len(table), 8):
+		print("\t" + " ".join("%d," % v for v in table[i:i + 8]))
+	print("};")
+	print()
+
+
+def sweep(channel):
+	first, table = build_table(channel)
+	lo = table[-1] / 10.0 if table[-1] < table[0] else table[0] / 10.0
+	hi = table[0] / 10.0 if table[-1] < table[0] else table[-1] / 10.0
+
+	max_err = 0.0
+	max_err_adc = 0
+	max_trunc_err = 0
+
+	for adc in range(ADC_MAX):
+		temp = temp_by_adc(channel, adc) * 10.0
+		temp = min(max(temp, lo), hi)
+		val = lookup(channel, first, table, adc)
+
+		err = abs(val - temp)
+		if err > max_err:
+			max_err = err
+			max_err_adc = adc
+
+		# the old firmware truncated to 0.1 du
+		max_trunc_err = max(max_trunc_err, abs(val - int(temp)))
+
+	print("%s: %d entries (%d bytes), range %.1f..%.1f du" %
+			(NAME[channel], len(table), len(table) * 2, lo / 10, hi / 10))
+	print("  max error %.3f (0.1 du) at adc %d, max error against truncated float %d (0.1 du)" %
+			(max_err, max_err_adc, max_trunc_err))
+
+
+if __name__ == "__main__":
+	for ch in (HIGH_PRESISION, LOW_PRESISION):
+		if "--sweep" in sys.argv[1:]:
+			sweep(ch)
+		else:
+			print_table(ch)
@@ -0,0 +1,309 @@
+/*
+ * replay of probe rise curves through Source/ther_temp_predict.c
+ *
+ *	temp_predict [trace ...]
+ *
+ * A trace is a text file of "<ms> <temp>" lines, temp in 0.1 du as
+ * ther_temp_measure() gives it, in the order measured. "# final
+ * <temp>" gives the equilibrium temp; without it the last sample is
+ * taken. With no trace, the curves below are replayed, sampled every
+ * TEMP_MEASURE_MIN_INTERVAL with the noise of the burst filter.
+ *
+ * The temp reported is what ther_handle_temp_predict() makes of it. For
+ * each curve: the time to the result and its error against the final
+ * temp, the time the raw temp gets within 0.1 du of it without the
+ * prediction, and when and why the result is let go.
+ *
+ * Exits with 1 if a result is off by more than REPLAY_MAX_ERROR, if a
+ * curve that should give a result does not, or if the last temp reported
+ * is not the raw one. A curve with a slow tail is beyond the predictor,
+ * see Source/ther_temp_predict.c: its result may be low by the tail, but
+ * not high, and must be let go once the probe gets to it.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Comdef.h"
+
+#include "ther_temp_predict.h"
+#include "host_osal.h"
+
+#define REPLAY_INTERVAL 2000 /* ms, TEMP_MEASURE_MIN_INTERVAL */
+#define REPLAY_NOISE 0.03 /* du, rms left after the burst filter */
+#define REPLAY_MAX_ERROR 3 /* 0.1 du */
+#define REPLAY_SAMPLE_NR 2000
+#define REPLAY_START_TIME 1000 /* ms, of every replay */
+#define REPLAY_LET_GO_TIME 10000 /* ms, a result of a slow tail is held at most */
+
+/* what a curve should give */
+enum {
+	REPLAY_RESULT, /* a result within REPLAY_MAX_ERROR */
+	REPLAY_MAY_RESULT, /* a trace, any result within REPLAY_MAX_ERROR */
+	REPLAY_SLOW_TAIL, /* any result not above REPLAY_MAX_ERROR, let go at once */
+};
+
+struct replay_sample {
+	uint32 time; /* ms from the start of the curve */
+	unsigned short temp; /* 0.1 du */
+};
+
+struct replay_curve {
+	const char *name;
+	double start; /* du */
+	double final;
+	double tau; /* s */
+	double slow; /* part of the rise with tau_slow, 0..1 */
+	double tau_slow;
+	uint32 length; /* s */
+
+	/* from change_time on, the temp goes to change_temp, 0: no change */
+	uint32 change_time; /* s */
+	double change_temp;
+	double change_tau;
+
+	unsigned char expect;
+};
+
+static const struct replay_curve replay_curves[] = {
+	{ "oral, tau 30 s", 25.0, 37.2, 30.0, 0.0, 0.0, 600, 0, 0.0, 0.0, REPLAY_RESULT },
+	{ "axilla, tau 60 s", 25.0, 36.8, 60.0, 0.0, 0.0, 900, 0, 0.0, 0.0, REPLAY_RESULT },
+	{ "axilla, tau 120 s", 24.0, 36.5, 120.0, 0.0, 0.0, 1200, 0, 0.0, 0.0, REPLAY_RESULT },
+	/* one exponential does not fit it, the result is as low as the tail is big */
+	{ "axilla, 20% tau 400 s", 25.0, 36.9, 50.0, 0.2, 400.0, 1800, 0, 0.0, 0.0, REPLAY_SLOW_TAIL },
+	{ "fever, falls after 10 min", 25.0, 38.6, 60.0, 0.0, 0.0, 1500, 600, 37.9, 120.0, REPLAY_RESULT },
+	{ "removed after 7 min", 25.0, 36.8, 60.0, 0.0, 0.0, 600, 420, 25.0, 20.0, REPLAY_RESULT },
+	/* the arm moves, the probe loses contact: the result is never reached */
+	{ "falls at 3 min", 25.0, 36.8, 60.0, 0.0, 0.0, 600, 180, 35.5, 60.0, REPLAY_RESULT },
+	{ "oral, stops at 1:50 min", 25.0, 37.2, 30.0, 0.0, 0.0, 900, 110, 36.8, 5.0, REPLAY_RESULT },
+};
+
+struct replay_result {
+	long result_time; /* ms, < 0 if none */
+	unsigned short result;
+	long release_time;
+	char release[48];
+	long raw_time; /* within 0.1 du of final */
+	unsigned short last_raw, last_reported;
+};
+
+static struct replay_sample replay_samples[REPLAY_SAMPLE_NR];
+static char replay_release[48];
+
+static void replay_print_hook(unsigned char level, const char *line)
+{
+	const char *p = strstr(line, "] temp ");
+
+	if (p && (strstr(p, "got to") || strstr(p, "falls") || strstr(p, "did not")))
+		snprintf(replay_release, sizeof(replay_release), "%.*s", (int)strcspn(p + 2, "\r\n"), p + 2);
+}
+
+static double replay_gauss(void)
+{
+	double u1 = (rand() + 1.0) / (RAND_MAX + 2.0);
+	double u2 = (rand() + 1.0) / (RAND_MAX + 2.0);
+
+	return sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+}
+
+static double replay_curve_temp(const struct replay_curve *c, double s)
+{
+	double temp, rise = c->final - c->start;
+
+	temp = c->final - rise * (1.0 - c->slow) * exp(-s / c->tau);
+	if (c->slow > 0.0)
+		temp -= rise * c->slow * exp(-s / c->tau_slow);
+
+	if (c->change_time && s > c->change_time)
+		temp += (c->change_temp - temp) * (1.0 - exp(-(s - c->change_time) / c->change_tau));
+
+	return temp;
+}
+
+static int replay_curve_samples(const struct replay_curve *c)
+{
+	int n = 0;
+	uint32 ms;
+
+	for (ms = 0; ms <= c->length * 1000 && n < REPLAY_SAMPLE_NR; ms += REPLAY_INTERVAL, n++) {
+		replay_samples[n].time = ms;
+		replay_samples[n].temp = (unsigned short)lround((replay_curve_temp(c, ms / 1000.0) +
+			REPLAY_NOISE * replay_gauss()) * 10.0);
+	}
+
+	return n;
+}
+
+/*
+ * return: the number of samples, < 0 if the file cannot be read
+ */
+static int replay_trace_samples(const char *file, unsigned short *final)
+{
+	char line[128];
+	unsigned long ms;
+	unsigned int temp;
+	int n = 0;
+	FILE *f = fopen(file, "r");
+
+	if (!f)
+		return -1;
+
+	*final = 0;
+	while (fgets(line, sizeof(line), f) && n < REPLAY_SAMPLE_NR) {
+		if (sscanf(line, "# final %u", &temp) == 1)
+			*final = temp;
+		if (line[0] == '#' || sscanf(line, "%lu %u", &ms, &temp) != 2)
+			continue;
+
+		replay_samples[n].time = ms;
+		replay_samples[n].temp = temp;
+		n++;
+	}
+	fclose(f);
+
+	if (n && !*final)
+		*final = replay_samples[n - 1].temp;
+
+	return n;
+}
+
+/*
+ * the samples as the thermometer task gives them to the predict module,
+ * see ther_handle_temp_predict()
+ */
+static void replay(int n, unsigned short final, struct replay_result *r)
+{
+	unsigned short result, reported = 0;
+	unsigned char state, last_state = PREDICT_IDLE;
+	int i;
+
+	r->result_time = -1;
+	r->release_time = -1;
+	r->raw_time = -1;
+	replay_release[0] = '\0';
+
+	ther_temp_predict_reset();
+
+	for (i = 0; i < n; i++) {
+		host_osal_set_time(REPLAY_START_TIME + replay_samples[i].time);
+
+		reported = replay_samples[i].temp;
+		state = ther_temp_predict_add(replay_samples[i].temp, &result);
+		if (state == PREDICT_DONE && reported < result)
+			reported = result;
+
+		if (state == PREDICT_DONE && r->result_time < 0) {
+			r->result_time = replay_samples[i].time;
+			r->result = result;
+		}
+		if (state == PREDICT_RELEASED && last_state == PREDICT_DONE) {
+			r->release_time = replay_samples[i].time;
+			strcpy(r->release, replay_release);
+		}
+		if (r->raw_time < 0 && abs((int)replay_samples[i].temp - (int)final) <= 1)
+			r->raw_time = replay_samples[i].time;
+
+		last_state = state;
+	}
+
+	r->last_raw = n ? replay_samples[n - 1].temp : 0;
+	r->last_reported = reported;
+}
+
+/*
+ * return: FALSE if the curve fails a check
+ */
+static bool replay_print(const char *name, unsigned short final, unsigned char expect,
+				const struct replay_result *r)
+{
+	bool ok = TRUE;
+	int error = (int)r->result - (int)final;
+
+	printf("%-28s", name);
+	if (r->result_time >= 0)
+		printf(" result %5.1f s %4.1f du (%+4.1f)", r->result_time / 1000.0, r->result / 10.0,
+			error / 10.0);
+	else
+		printf(" no result %21s", "");
+
+	if (r->raw_time >= 0)
+		printf(", raw at %6.1f s", r->raw_time / 1000.0);
+	else
+		printf(", raw never %5s", "");
+
+	if (r->release_time >= 0)
+		printf(", let go %6.1f s: %s", r->release_time / 1000.0, r->release);
+	printf("\n");
+
+	if (r->result_time >= 0 && (expect == REPLAY_SLOW_TAIL ? error : abs(error)) > REPLAY_MAX_ERROR) {
+		printf("  result off by %+.1f du\n", error / 10.0);
+		ok = FALSE;
+	}
+	if (expect == REPLAY_SLOW_TAIL && r->result_time >= 0 &&
+		(r->release_time < 0 || r->release_time - r->result_time > REPLAY_LET_GO_TIME)) {
+		printf("  result of the slow tail held longer than %d s\n", REPLAY_LET_GO_TIME / 1000);
+		ok = FALSE;
+	}
+	if (expect == REPLAY_RESULT && r->result_time < 0) {
+		printf("  no result\n");
+		ok = FALSE;
+	}
+	if (r->last_reported != r->last_raw) {
+		printf("  reports %4.1f du at the end, the probe is at %4.1f du\n",
+			r->last_reported / 10.0, r->last_raw / 10.0);
+		ok = FALSE;
+	}
+
+	return ok;
+}
+
+int main(int argc, char **argv)
+{
+	struct replay_result r;
+	unsigned short final;
+	unsigned int i;
+	int n, failed = 0;
+
+	host_osal_print_hook(replay_print_hook);
+	srand(1);
+
+	if (argc > 1) {
+		for (i = 1; i < (unsigned int)argc; i++) {
+			n = replay_trace_samples(argv[i], &final);
+			if (n < 0) {
+				printf("cannot read %s\n", argv[i]);
+				return 1;
+			}
+
+			replay(n, final, &r);
+			if (!replay_print(argv[i], final, REPLAY_MAY_RESULT, &r))
+				failed++;
+		}
+
+		return failed ? 1 : 0;
+	}
+
+	for (i = 0; i < sizeof(replay_curves) / sizeof(replay_curves[0]); i++) {
+		const struct replay_curve *c = &replay_curves[i];
+
+		n = replay_curve_samples(c);
+		final = (unsigned short)lround(c->final * 10.0);
+
+		replay(n, final, &r);
+
+		/* a result after the change is one of the temp it goes to */
+		if (c->change_time && r.result_time >= (long)c->change_time * 1000)
+			final = (unsigned short)lround(c->change_temp * 10.0);
+		if (!replay_print(c->name, final, c->expect, &r))
+			failed++;
+	}
+
+	if (failed) {
+		printf("%d curves failed\n", failed);
+		return 1;
+	}
+
+	return 0;
+}
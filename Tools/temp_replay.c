@@ -0,0 +1,366 @@
+/*
+ * temp traces through the temperature pipeline of the firmware
+ *
+ *	temp_replay [trace ...]
+ *
+ * Source/ther_temp.c, ther_temp_cal.c and ther_adc.c run on the ADC model
+ * (host/adc_model.c), with the default TEMP_BURST_SAMPLES/TRIM. A trace is
+ * a text file of "<ms> <temp>" lines: the probe is at the reference temp
+ * <temp> (0.1 du) from <ms> on, and is measured at <ms> as the thermometer
+ * task does it, see temp_burst.c. Lines starting with '#' are skipped.
+ * With no trace, the traces below are replayed.
+ *
+ * For each trace: the error of the temps against the reference, for each
+ * presision; the conversions per reading and per second; the temps at
+ * which the presision switched and back. Exits with 1 if an error is
+ * above its REPLAY_MAX_ERROR or the high presision is not used inside
+ * REPLAY_HIGH_MIN..MAX.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Comdef.h"
+
+#include "ther_adc.h"
+#include "ther_temp_cal.h"
+#include "ther_temp.h"
+#include "ther_uart_comm.h"
+#include "thermometer.h"
+#include "host_osal.h"
+#include "adc_model.h"
+
+#define REPLAY_TASK_ID 1
+#define REPLAY_POLL_TIME 2 /* ms, TEMP_POWER_POLL_TIME */
+#define REPLAY_INTERVAL 2000 /* ms, TEMP_MEASURE_MIN_INTERVAL */
+#define REPLAY_SAMPLE_NR 4000
+#define REPLAY_SWITCH_NR 16
+
+/* 0.1 du, as ther_temp.c */
+#define HIGH_PRESISION_TEMP_MIN 290
+#define HIGH_PRESISION_TEMP_MAX 450
+#define PRESISION_TEMP_HYST 5
+
+/*
+ * 0.1 du, of any reading, by the presision used
+ *
+ * The gain is calibrated on the VREF input, at full scale: with a positive
+ * gain error, as in the model, that conversion clips at 8191 and the gain
+ * is not corrected. The high presision bridge hardly sees it, the low
+ * presision one reads a few 0.1 du low, most at the ends of its range.
+ */
+#define REPLAY_MAX_ERROR_HIGH 2
+#define REPLAY_MAX_ERROR_LOW 8
+
+/* inside this the high presision must be used, whatever the error */
+#define REPLAY_HIGH_MIN (HIGH_PRESISION_TEMP_MIN + PRESISION_TEMP_HYST + 5)
+#define REPLAY_HIGH_MAX (HIGH_PRESISION_TEMP_MAX - PRESISION_TEMP_HYST - 5)
+
+struct replay_sample {
+	uint32 time; /* ms */
+	unsigned short temp; /* 0.1 du */
+};
+
+struct replay_error {
+	long n, sum;
+	int max;
+	unsigned short max_temp;
+};
+
+struct replay_switch {
+	unsigned char presision; /* switched to */
+	unsigned short temp; /* reference, 0.1 du */
+};
+
+struct replay_stat {
+	struct replay_error error[2]; /* by the presision used */
+	struct replay_switch sw[REPLAY_SWITCH_NR];
+	unsigned char sw_nr;
+	long lost; /* readings not delivered */
+	long wrong; /* low presision inside the high presision range */
+};
+
+static struct replay_sample replay_samples[REPLAY_SAMPLE_NR];
+static unsigned char replay_presision;
+static bool replay_switched;
+static unsigned short replay_temp;
+static bool replay_measured;
+
+static void replay_print_hook(unsigned char level, const char *line)
+{
+	if (strstr(line, "change to high presision")) {
+		replay_presision = HIGH_PRESISION;
+		replay_switched = TRUE;
+	} else if (strstr(line, "change to low presision")) {
+		replay_presision = LOW_PRESISION;
+		replay_switched = TRUE;
+	}
+}
+
+static void replay_step(void)
+{
+	host_osal_set_time(host_osal_get_time() + 1);
+	adc_model_step();
+
+	if (host_osal_take_events() & TH_ADC_EVT)
+		ther_adc_deliver_result();
+}
+
+static void replay_temp_measured(unsigned short temp)
+{
+	replay_temp = temp;
+	replay_measured = TRUE;
+}
+
+/*
+ * as the thermometer task does it, see TH_TEMP_MEASURE_EVT
+ *
+ * return: FALSE if the temp was not delivered
+ */
+static bool replay_reading(unsigned short *temp)
+{
+	uint32 ms;
+
+	ther_temp_power_on();
+	do {
+		for (ms = 0; ms < REPLAY_POLL_TIME; ms++)
+			replay_step();
+	} while (!ther_temp_power_settled());
+
+	replay_measured = FALSE;
+	if (!ther_temp_measure(replay_temp_measured))
+		return FALSE;
+	for (ms = 0; !replay_measured && ms < REPLAY_INTERVAL; ms++)
+		replay_step();
+
+	*temp = replay_temp;
+
+	return replay_measured;
+}
+
+/* from 20 du to 42 du and back, 0.1 du a reading */
+static int replay_sweep(void)
+{
+	int n = 0, temp;
+
+	for (temp = 200; temp <= 420; temp++, n++)
+		replay_samples[n].temp = temp;
+	for (temp = 420; temp >= 200; temp--, n++)
+		replay_samples[n].temp = temp;
+
+	return n;
+}
+
+/* over the whole range of the low presision, 0.5 du a reading */
+static int replay_range(void)
+{
+	int n = 0, temp;
+
+	for (temp = 50; temp <= 900; temp += 5, n++)
+		replay_samples[n].temp = temp;
+
+	return n;
+}
+
+/* around the switch point, where the hysteresis has to hold */
+static int replay_switch_point(void)
+{
+	static const short wave[] = { 0, 2, 4, 6, 7, 6, 4, 2, 0, -2, -4, -6, -7, -6, -4, -2 };
+	int n;
+
+	for (n = 0; n < 400; n++)
+		replay_samples[n].temp = HIGH_PRESISION_TEMP_MIN + wave[n % 16] + (n / 100) * 2 - 3;
+
+	return n;
+}
+
+static void replay_even_times(int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		replay_samples[i].time = (uint32)i * REPLAY_INTERVAL;
+}
+
+/*
+ * return: the number of samples, < 0 if the file cannot be read
+ */
+static int replay_trace(const char *file)
+{
+	char line[128];
+	unsigned long ms;
+	unsigned int temp;
+	int n = 0;
+	FILE *f = fopen(file, "r");
+
+	if (!f)
+		return -1;
+
+	while (fgets(line, sizeof(line), f) && n < REPLAY_SAMPLE_NR) {
+		if (line[0] == '#' || sscanf(line, "%lu %u", &ms, &temp) != 2)
+			continue;
+
+		replay_samples[n].time = ms;
+		replay_samples[n].temp = temp;
+		n++;
+	}
+	fclose(f);
+
+	return n;
+}
+
+static void replay_error_add(struct replay_error *e, unsigned short temp, unsigned short ref)
+{
+	int error = abs((int)temp - (int)ref);
+
+	e->n++;
+	e->sum += error;
+	if (error > e->max) {
+		e->max = error;
+		e->max_temp = ref;
+	}
+}
+
+static void replay_run(int n, struct replay_stat *s)
+{
+	uint32 start = host_osal_get_time();
+	unsigned short temp;
+	int i;
+
+	memset(s, 0, sizeof(*s));
+
+	for (i = 0; i < n; i++) {
+		if (start + replay_samples[i].time > host_osal_get_time())
+			host_osal_set_time(start + replay_samples[i].time);
+		adc_model_set_temp(replay_samples[i].temp / 10.0);
+
+		replay_switched = FALSE;
+		if (!replay_reading(&temp)) {
+			s->lost++;
+			continue;
+		}
+
+		if (replay_switched && s->sw_nr < REPLAY_SWITCH_NR) {
+			s->sw[s->sw_nr].presision = replay_presision;
+			s->sw[s->sw_nr].temp = replay_samples[i].temp;
+			s->sw_nr++;
+		}
+
+		if (replay_presision == LOW_PRESISION &&
+			replay_samples[i].temp >= REPLAY_HIGH_MIN && replay_samples[i].temp <= REPLAY_HIGH_MAX)
+			s->wrong++;
+
+		replay_error_add(&s->error[replay_presision], temp, replay_samples[i].temp);
+	}
+}
+
+static void replay_print_error(const char *name, const struct replay_error *e)
+{
+	if (!e->n) {
+		printf("  %s presision: not used\n", name);
+		return;
+	}
+
+	printf("  %s presision: %ld readings, error mean %4.2f, max %3.1f du at %4.1f du\n", name,
+		e->n, (double)e->sum / e->n / 10.0, e->max / 10.0, e->max_temp / 10.0);
+}
+
+/*
+ * return: FALSE if the trace fails a check
+ */
+static bool replay(const char *name, int n)
+{
+	const struct adc_model_stat *adc = adc_model_get_stat();
+	uint32 start = host_osal_get_time();
+	struct replay_stat s;
+	double seconds;
+	unsigned char i;
+	bool ok = TRUE;
+
+	adc_model_reset_stat();
+	replay_run(n, &s);
+	seconds = (host_osal_get_time() - start) / 1000.0;
+
+	printf("%s: %d readings in %.0f s, %.1f conversions a reading, %.2f/s, %.2f ms converting\n",
+		name, n, seconds, (double)adc->conversions / n, adc->conversions / seconds,
+		adc->conversion_us / 1000.0 / n);
+	replay_print_error("high", &s.error[HIGH_PRESISION]);
+	replay_print_error("low", &s.error[LOW_PRESISION]);
+
+	printf("  %d presision switches", s.sw_nr);
+	for (i = 0; i < s.sw_nr; i++)
+		printf("%s %s at %4.1f", i ? "," : ":", s.sw[i].presision == HIGH_PRESISION ? "high" : "low",
+			s.sw[i].temp / 10.0);
+	printf("\n");
+
+	if (s.lost) {
+		printf("  %ld readings not delivered\n", s.lost);
+		ok = FALSE;
+	}
+	if (s.wrong) {
+		printf("  %ld readings of the low presision inside the high presision range\n", s.wrong);
+		ok = FALSE;
+	}
+	if (s.error[HIGH_PRESISION].max > REPLAY_MAX_ERROR_HIGH ||
+		s.error[LOW_PRESISION].max > REPLAY_MAX_ERROR_LOW) {
+		printf("  error above %3.1f/%3.1f du (high/low)\n",
+			REPLAY_MAX_ERROR_HIGH / 10.0, REPLAY_MAX_ERROR_LOW / 10.0);
+		ok = FALSE;
+	}
+
+	/* the next one starts away from this one */
+	host_osal_set_time(host_osal_get_time() + REPLAY_INTERVAL);
+
+	return ok;
+}
+
+int main(int argc, char **argv)
+{
+	int i, n, failed = 0;
+
+	adc_model_init(&adc_model_default);
+	host_osal_set_time(1000);
+	host_osal_print_hook(replay_print_hook);
+
+	ther_adc_init(REPLAY_TASK_ID);
+	ther_temp_init();
+	replay_presision = LOW_PRESISION;
+
+	if (argc > 1) {
+		for (i = 1; i < argc; i++) {
+			n = replay_trace(argv[i]);
+			if (n < 0) {
+				printf("cannot read %s\n", argv[i]);
+				return 1;
+			}
+
+			if (!replay(argv[i], n))
+				failed++;
+		}
+
+		return failed ? 1 : 0;
+	}
+
+	n = replay_sweep();
+	replay_even_times(n);
+	if (!replay("20 => 42 => 20 du", n))
+		failed++;
+
+	n = replay_switch_point();
+	replay_even_times(n);
+	if (!replay("around 29.0 du", n))
+		failed++;
+
+	n = replay_range();
+	replay_even_times(n);
+	if (!replay("5 => 90 du", n))
+		failed++;
+
+	if (failed) {
+		printf("%d traces failed\n", failed);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,178 @@
+/*
+ * SPI traffic of the storage on the flash driver, on the bus emulator
+ *
+ *	w25x_bench
+ *
+ *  - mount and seek: bytes clocked, read cache hits
+ *  - appends committed one by one: status reads in the appends, with and
+ *    without the erase ahead of ther_storage_idle()
+ *  - format: the erase commands and the wait
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "Comdef.h"
+
+#include "ther_spi_w25x40cl.h"
+#include "ther_storage.h"
+#include "host_osal.h"
+#include "w25x_emu.h"
+
+#define BENCH_TASK_ID 1
+#define BENCH_MOUNT_RECORDS 20000
+#define BENCH_SEEKS 100
+#define BENCH_APPENDS 40000
+#define BENCH_POLLS 200 /* flash events between two appends */
+#define BENCH_WAIT_POLLS 5 /* more status reads: the append waited */
+
+#define BENCH_CMD_RDSR 0x05
+#define BENCH_CMD_RDSR_BYTES 2
+
+static struct flash_cache_stat bench_cache;
+
+static void bench_set_time(uint32 s)
+{
+	host_osal_set_time(s * 1000);
+}
+
+static void bench_reset(void)
+{
+	const struct flash_cache_stat *cs = ther_spi_w25x_get_cache_stat();
+
+	w25x_emu_reset_stat();
+	if (cs)
+		bench_cache = *cs;
+}
+
+static void bench_print(const char *what)
+{
+	const struct flash_cache_stat *cs = ther_spi_w25x_get_cache_stat();
+	const struct w25x_emu_stat *st = w25x_emu_get_stat();
+
+	printf("%-8s %8lu bytes", what, (unsigned long)st->bytes);
+	if (cs)
+		printf(", cache %lu hits %lu misses", (unsigned long)(cs->hit - bench_cache.hit),
+			(unsigned long)(cs->miss - bench_cache.miss));
+	printf("\n");
+}
+
+static void bench_mount(void)
+{
+	struct storage_cursor cursor;
+	uint32 i;
+
+	memset(w25x_emu_mem(), 0xFF, W25X_EMU_SIZE);
+	ther_storage_init(&flash_dev);
+	for (i = 0; i < BENCH_MOUNT_RECORDS; i++) {
+		bench_set_time(i * 5);
+		ther_storage_append(STORAGE_TYPE_TEMP, 300 + i % 40);
+	}
+	ther_storage_flush();
+	flash_dev.sync();
+
+	printf("%u records:\n", BENCH_MOUNT_RECORDS);
+
+	bench_reset();
+	ther_storage_init(&flash_dev);
+	bench_print("mount");
+
+	bench_reset();
+	for (i = 0; i < BENCH_SEEKS; i++)
+		ther_storage_seek_time(&cursor, i * 997 % (BENCH_MOUNT_RECORDS * 5));
+	bench_print("seek x100");
+}
+
+/*
+ * BENCH_POLLS flash events, as thermometer.c handles them
+ */
+static void bench_flash_events(void)
+{
+	int k;
+
+	for (k = 0; k < BENCH_POLLS; k++) {
+		if (ther_spi_w25x_poll())
+			ther_storage_ready();
+	}
+}
+
+static void bench_commit(bool idle)
+{
+	const struct flash_cache_stat *cs = ther_spi_w25x_get_cache_stat();
+	const struct w25x_emu_stat *st = w25x_emu_get_stat();
+	long i, polls, max = 0, total = 0, waits = 0;
+
+	memset(w25x_emu_mem(), 0xFF, W25X_EMU_SIZE);
+	ther_storage_init(&flash_dev);
+	bench_reset();
+
+	for (i = 0; i < BENCH_APPENDS; i++) {
+		bench_set_time(i * 5);
+		w25x_emu_reset_stat();
+
+		ther_storage_append(STORAGE_TYPE_TEMP, 300 + i % 7);
+		ther_storage_flush();
+
+		polls = st->cmd_bytes[BENCH_CMD_RDSR] / BENCH_CMD_RDSR_BYTES;
+		total += polls;
+		if (polls > max)
+			max = polls;
+		if (polls > BENCH_WAIT_POLLS)
+			waits++;
+
+		/* time passes: the flash events, the idle one */
+		bench_flash_events();
+		if (idle)
+			ther_storage_idle();
+		bench_flash_events();
+	}
+
+	printf("%u appends committed, %s erase ahead: status reads max %ld total %ld, "
+		"%ld appends waited", BENCH_APPENDS, idle ? "with" : "no", max, total, waits);
+	if (cs)
+		printf(", cache %lu hits %lu misses", (unsigned long)(cs->hit - bench_cache.hit),
+			(unsigned long)(cs->miss - bench_cache.miss));
+	printf("\n");
+}
+
+static void bench_format(void)
+{
+	const struct w25x_emu_stat *st = w25x_emu_get_stat();
+
+	uint32 rdsr;
+	bool ready;
+
+	w25x_emu_reset_stat();
+	ther_storage_format();
+	rdsr = st->cmd_count[BENCH_CMD_RDSR];
+
+	/* the flash events, until the erase counts are programmed */
+	do {
+		ready = ther_spi_w25x_poll();
+		if (ready)
+			ther_storage_ready();
+	} while (!ready || flash_dev.busy());
+
+	printf("format: 4K %lu, 32K %lu, 64K %lu, chip %lu erases, %lu page programs, "
+		"%lu status reads, %lu in the call\n",
+		(unsigned long)st->cmd_count[0x20], (unsigned long)st->cmd_count[0x52],
+		(unsigned long)st->cmd_count[0xD8], (unsigned long)st->cmd_count[0xC7],
+		(unsigned long)st->cmd_count[0x02], (unsigned long)st->cmd_count[BENCH_CMD_RDSR],
+		(unsigned long)rdsr);
+}
+
+int main(void)
+{
+	w25x_emu_init(NULL);
+	if (ther_spi_w25x_init(BENCH_TASK_ID) != FL_EOK) {
+		printf("no flash on the bus\n");
+		return 1;
+	}
+
+	bench_mount();
+	bench_commit(FALSE);
+	bench_commit(TRUE);
+	bench_format();
+
+	return 0;
+}
@@ -0,0 +1,468 @@
+/*
+ * W25X40CL on the SPI bus, for host builds of ther_spi_w25x40cl.c
+ *
+ * It takes the place of Source/ther_spi.c: the ther_spi_* functions clock
+ * the bytes into a model of the flash instead of UART1. Every byte with
+ * CS low goes through w25x_emu_byte(), the command is run when CS goes
+ * high, like the chip does. The rules of the datasheet are kept:
+ *
+ *  - PP, erase and WRSR need WREN first, and clear the latch when done
+ *  - while busy only RDSR is taken, the status reads count as the time,
+ *    see struct w25x_emu_timing
+ *  - a page program wraps at the end of its 256 byte page, and only
+ *    clears bits
+ *  - in deep power-down only 0xAB is taken, the bus reads 0xFF until the
+ *    flash is up again
+ *
+ * A command the flash would ignore is ignored and counted as a violation,
+ * with a line on stderr. The bytes clocked are counted by opcode, so a
+ * driver change can be measured in SPI traffic:
+ *
+ *	w25x_emu_init(NULL);
+ *	ther_spi_w25x_init(task_id);
+ *	...
+ *	w25x_emu_print_stat();
+ *
+ * The driver needs the OSAL timer and clock functions and print() from
+ * the host build, see Tools/host and Tools/Makefile.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "Comdef.h"
+
+#include "ther_spi.h"
+#include "w25x_emu.h"
+
+#define W25X_EMU_PAGE_SIZE 256
+#define W25X_EMU_ERASED 0xFF
+
+#define W25X_EMU_JEDEC_MF 0xEF
+#define W25X_EMU_JEDEC_TYPE 0x30
+#define W25X_EMU_JEDEC_CAPACITY 0x13
+#define W25X_EMU_DEVICE_ID 0x12
+
+#define W25X_EMU_STATUS_BUSY 0x01
+#define W25X_EMU_STATUS_WEL 0x02
+
+enum {
+	EMU_WRSR = 0x01,
+	EMU_PP = 0x02,
+	EMU_READ = 0x03,
+	EMU_WRDI = 0x04,
+	EMU_RDSR = 0x05,
+	EMU_WREN = 0x06,
+	EMU_FAST_READ = 0x0B,
+	EMU_ERASE_4K = 0x20,
+	EMU_ERASE_32K = 0x52,
+	EMU_ERASE_64K = 0xD8,
+	EMU_JEDEC_ID = 0x9F,
+	EMU_ERASE_CHIP = 0xC7,
+	EMU_RELEASE_PWRDN = 0xAB,
+	EMU_POWER_DOWN = 0xB9,
+};
+
+struct w25x_emu {
+	uint8 mem[W25X_EMU_SIZE];
+	struct w25x_emu_timing timing;
+	struct w25x_emu_stat stat;
+
+	bool selected;
+	uint8 cmd;
+	uint32 count; /* bytes of the command so far, opcode included */
+	uint32 addr;
+
+	uint8 status;
+	uint16 busy_polls; /* status reads until it is done */
+	bool power_down;
+	uint16 wake_polls;
+
+	/* page program data, run when CS goes high */
+	uint8 page[W25X_EMU_PAGE_SIZE];
+	uint8 page_set[W25X_EMU_PAGE_SIZE];
+	uint32 page_addr;
+	bool page_wrapped;
+};
+static struct w25x_emu w25x_emu;
+
+static const struct w25x_emu_timing w25x_emu_default_timing = {
+	2,	/* page program, 0.8 ms at 0.4 ms a status read */
+	75,	/* 4 KB erase, 30 ms */
+	5000,	/* chip erase, 2 s */
+	1,	/* release from power-down, 3 us */
+};
+
+static void w25x_emu_violation(const char *what)
+{
+	struct w25x_emu *e = &w25x_emu;
+
+	e->stat.violations++;
+	fprintf(stderr, "w25x emu: %s, cmd 0x%02x ignored\n", what, e->cmd);
+}
+
+static uint8 w25x_emu_read_status(void)
+{
+	struct w25x_emu *e = &w25x_emu;
+
+	if (e->wake_polls) {
+		e->wake_polls--;
+		return 0xFF;
+	}
+
+	if (e->busy_polls && --e->busy_polls == 0)
+		e->status &= ~(W25X_EMU_STATUS_BUSY | W25X_EMU_STATUS_WEL);
+
+	return e->status;
+}
+
+/*
+ * the opcode is taken? a busy or powered down flash only takes some
+ */
+static bool w25x_emu_accept(void)
+{
+	struct w25x_emu *e = &w25x_emu;
+
+	if (e->power_down) {
+		if (e->cmd == EMU_RELEASE_PWRDN)
+			return TRUE;
+		w25x_emu_violation("powered down");
+		return FALSE;
+	}
+
+	if ((e->status & W25X_EMU_STATUS_BUSY) && e->cmd != EMU_RDSR) {
+		w25x_emu_violation("busy");
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static uint8 w25x_emu_byte(uint8 in)
+{
+	struct w25x_emu *e = &w25x_emu;
+	uint32 n = e->count++;
+	uint8 out = 0xFF;
+
+	e->stat.bytes++;
+
+	if (n == 0) {
+		e->cmd = in;
+		e->addr = 0;
+		e->page_wrapped = FALSE;
+		memset(e->page_set, 0, sizeof(e->page_set));
+
+		if (!w25x_emu_accept()) {
+			e->cmd = 0;
+			return out;
+		}
+		e->stat.cmd_count[in]++;
+	}
+
+	if (e->cmd == 0)
+		return out;
+
+	e->stat.cmd_bytes[e->cmd]++;
+
+	/* 24 bit address after the opcode */
+	if (n >= 1 && n <= 3) {
+		e->addr = (e->addr << 8) | in;
+		if (n == 3)
+			e->page_addr = e->addr & ~(uint32)(W25X_EMU_PAGE_SIZE - 1);
+	}
+
+	switch (e->cmd) {
+	case EMU_RDSR:
+		if (n >= 1)
+			out = w25x_emu_read_status();
+		break;
+
+	case EMU_JEDEC_ID:
+		if (n == 1)
+			out = W25X_EMU_JEDEC_MF;
+		else if (n == 2)
+			out = W25X_EMU_JEDEC_TYPE;
+		else if (n == 3)
+			out = W25X_EMU_JEDEC_CAPACITY;
+		break;
+
+	case EMU_RELEASE_PWRDN:
+		if (n >= 4)
+			out = W25X_EMU_DEVICE_ID;
+		break;
+
+	case EMU_READ:
+		if (n >= 4)
+			out = e->mem[(e->addr + n - 4) % W25X_EMU_SIZE];
+		break;
+
+	case EMU_FAST_READ:
+		/* one dummy byte */
+		if (n >= 5)
+			out = e->mem[(e->addr + n - 5) % W25X_EMU_SIZE];
+		break;
+
+	case EMU_PP:
+		if (n >= 4) {
+			uint32 offset = (e->addr + n - 4) % W25X_EMU_PAGE_SIZE;
+
+			/* back to the start of the page */
+			if (n - 4 == W25X_EMU_PAGE_SIZE - e->addr % W25X_EMU_PAGE_SIZE)
+				e->page_wrapped = TRUE;
+
+			e->page[offset] = in;
+			e->page_set[offset] = 1;
+		}
+		break;
+	}
+
+	return out;
+}
+
+static void w25x_emu_erase(uint32 addr, uint32 size, uint16 polls)
+{
+	struct w25x_emu *e = &w25x_emu;
+
+	addr &= ~(size - 1);
+	memset(e->mem + addr % W25X_EMU_SIZE, W25X_EMU_ERASED, size);
+
+	e->status |= W25X_EMU_STATUS_BUSY;
+	e->busy_polls = polls;
+}
+
+static bool w25x_emu_write_enabled(void)
+{
+	struct w25x_emu *e = &w25x_emu;
+
+	if (e->status & W25X_EMU_STATUS_WEL)
+		return TRUE;
+
+	w25x_emu_violation("no WREN");
+	return FALSE;
+}
+
+/*
+ * CS high: run the command
+ */
+static void w25x_emu_end(void)
+{
+	struct w25x_emu *e = &w25x_emu;
+	uint32 i;
+
+	switch (e->cmd) {
+	case EMU_WREN:
+		e->status |= W25X_EMU_STATUS_WEL;
+		break;
+
+	case EMU_WRDI:
+		e->status &= ~W25X_EMU_STATUS_WEL;
+		break;
+
+	case EMU_WRSR:
+		if (w25x_emu_write_enabled())
+			e->status &= ~W25X_EMU_STATUS_WEL;
+		break;
+
+	case EMU_PP:
+		if (e->count < 5 || !w25x_emu_write_enabled())
+			break;
+
+		if (e->page_wrapped) {
+			e->stat.page_wraps++;
+			fprintf(stderr, "w25x emu: page program at 0x%06lx wraps\n", (unsigned long)e->addr);
+		}
+
+		for (i = 0; i < W25X_EMU_PAGE_SIZE; i++) {
+			if (e->page_set[i])
+				e->mem[(e->page_addr + i) % W25X_EMU_SIZE] &= e->page[i];
+		}
+
+		e->status |= W25X_EMU_STATUS_BUSY;
+		e->busy_polls = e->timing.program_polls;
+		break;
+
+	case EMU_ERASE_4K:
+		if (e->count >= 4 && w25x_emu_write_enabled())
+			w25x_emu_erase(e->addr, 4096, e->timing.erase_polls);
+		break;
+
+	case EMU_ERASE_32K:
+		if (e->count >= 4 && w25x_emu_write_enabled())
+			w25x_emu_erase(e->addr, 32768, e->timing.erase_polls * 4);
+		break;
+
+	case EMU_ERASE_64K:
+		if (e->count >= 4 && w25x_emu_write_enabled())
+			w25x_emu_erase(e->addr, 65536, e->timing.erase_polls * 6);
+		break;
+
+	case EMU_ERASE_CHIP:
+		if (w25x_emu_write_enabled())
+			w25x_emu_erase(0, W25X_EMU_SIZE, e->timing.chip_erase_polls);
+		break;
+
+	case EMU_POWER_DOWN:
+		e->power_down = TRUE;
+		break;
+
+	case EMU_RELEASE_PWRDN:
+		if (e->power_down) {
+			e->power_down = FALSE;
+			e->wake_polls = e->timing.wake_polls;
+		}
+		break;
+	}
+
+	/* a busy flash that never gets polled is done by the next command */
+	if (!(e->status & W25X_EMU_STATUS_BUSY))
+		e->busy_polls = 0;
+}
+
+void ther_spi_init(void)
+{
+}
+
+uint32 ther_spi_transfer(struct ther_spi_message *message)
+{
+	struct w25x_emu *e = &w25x_emu;
+	const uint8 *send_ptr = message->send_buf;
+	uint8 *recv_ptr = message->recv_buf;
+	uint32 size = message->length;
+	uint8 data;
+
+	if (message->cs_take && !e->selected) {
+		e->selected = TRUE;
+		e->count = 0;
+	}
+
+	while (size--) {
+		data = send_ptr ? *send_ptr++ : 0xFF;
+		data = w25x_emu_byte(data);
+		if (recv_ptr)
+			*recv_ptr++ = data;
+	}
+
+	if (message->cs_release && e->selected) {
+		e->selected = FALSE;
+		w25x_emu_end();
+	}
+
+	return message->length;
+}
+
+uint32 ther_spi_recv(void *recv_buf, uint32 length)
+{
+	struct ther_spi_message message;
+
+	message.send_buf   = NULL;
+	message.recv_buf   = recv_buf;
+	message.length     = length;
+	message.cs_take    = 1;
+	message.cs_release = 1;
+
+	return ther_spi_transfer(&message);
+}
+
+uint32 ther_spi_send(const void *send_buf, uint32 length)
+{
+	struct ther_spi_message message;
+
+	message.send_buf   = send_buf;
+	message.recv_buf   = NULL;
+	message.length     = length;
+	message.cs_take    = 1;
+	message.cs_release = 1;
+
+	return ther_spi_transfer(&message);
+}
+
+uint32 ther_spi_send_then_send(const void *send_buf1, uint32 send_length1,
+                               const void *send_buf2, uint32 send_length2)
+{
+	struct ther_spi_message message;
+
+	message.send_buf   = send_buf1;
+	message.recv_buf   = NULL;
+	message.length     = send_length1;
+	message.cs_take    = 1;
+	message.cs_release = 0;
+	ther_spi_transfer(&message);
+
+	message.send_buf   = send_buf2;
+	message.recv_buf   = NULL;
+	message.length     = send_length2;
+	message.cs_take    = 0;
+	message.cs_release = 1;
+	ther_spi_transfer(&message);
+
+	return 0;
+}
+
+uint32 ther_spi_send_then_recv(const void *send_buf, uint32 send_length,
+                               void *recv_buf, uint32 recv_length)
+{
+	struct ther_spi_message message;
+
+	message.send_buf   = send_buf;
+	message.recv_buf   = NULL;
+	message.length     = send_length;
+	message.cs_take    = 1;
+	message.cs_release = 0;
+	ther_spi_transfer(&message);
+
+	message.send_buf   = NULL;
+	message.recv_buf   = recv_buf;
+	message.length     = recv_length;
+	message.cs_take    = 0;
+	message.cs_release = 1;
+	ther_spi_transfer(&message);
+
+	return 0;
+}
+
+/*
+ * an erased flash, [timing] may be NULL for the datasheet typical times
+ */
+void w25x_emu_init(const struct w25x_emu_timing *timing)
+{
+	struct w25x_emu *e = &w25x_emu;
+
+	memset(e, 0, sizeof(*e));
+	memset(e->mem, W25X_EMU_ERASED, sizeof(e->mem));
+	e->timing = timing ? *timing : w25x_emu_default_timing;
+}
+
+uint8 *w25x_emu_mem(void)
+{
+	return w25x_emu.mem;
+}
+
+bool w25x_emu_power_down(void)
+{
+	return w25x_emu.power_down;
+}
+
+const struct w25x_emu_stat *w25x_emu_get_stat(void)
+{
+	return &w25x_emu.stat;
+}
+
+void w25x_emu_reset_stat(void)
+{
+	memset(&w25x_emu.stat, 0, sizeof(w25x_emu.stat));
+}
+
+void w25x_emu_print_stat(void)
+{
+	struct w25x_emu_stat *st = &w25x_emu.stat;
+	uint16 cmd;
+
+	printf("w25x emu: %lu bytes, %lu page wraps, %lu violations\n",
+			(unsigned long)st->bytes, (unsigned long)st->page_wraps, (unsigned long)st->violations);
+
+	for (cmd = 0; cmd < 256; cmd++) {
+		if (st->cmd_count[cmd])
+			printf("  0x%02x: %lu commands, %lu bytes\n", cmd,
+					(unsigned long)st->cmd_count[cmd], (unsigned long)st->cmd_bytes[cmd]);
+	}
+}
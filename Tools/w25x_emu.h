@@ -0,0 +1,36 @@
+#ifndef __W25X_EMU_H__
+#define __W25X_EMU_H__
+
+#define W25X_EMU_SIZE (512UL * 1024)
+
+/*
+ * what the driver sent, by opcode
+ */
+struct w25x_emu_stat {
+	uint32 cmd_count[256];
+	uint32 cmd_bytes[256]; /* clocked with CS low, opcode included */
+	uint32 bytes; /* all of them */
+
+	uint32 page_wraps; /* page programs going over their page */
+	uint32 violations; /* commands the flash ignores */
+};
+
+/*
+ * status reads the flash stays busy for, the driver has no clock here
+ */
+struct w25x_emu_timing {
+	uint16 program_polls;
+	uint16 erase_polls;
+	uint16 chip_erase_polls;
+	uint16 wake_polls;
+};
+
+void w25x_emu_init(const struct w25x_emu_timing *timing);
+uint8 *w25x_emu_mem(void);
+bool w25x_emu_power_down(void);
+
+const struct w25x_emu_stat *w25x_emu_get_stat(void);
+void w25x_emu_reset_stat(void);
+void w25x_emu_print_stat(void);
+
+#endif
@@ -0,0 +1,385 @@
+/*
+ * Source/ther_spi_w25x40cl.c on the bus emulator, see w25x_emu.c
+ *
+ *	w25x_test
+ *
+ * random programs, erases and reads against a copy in RAM, the erase
+ * ranges and the commands they take, the storage on top with the flash
+ * and idle events run as thermometer.c runs them. No command may be one
+ * the flash ignores. Exits with 1 if one check fails.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Comdef.h"
+
+#include "thermometer.h"
+#include "ther_spi_w25x40cl.h"
+#include "ther_storage.h"
+#include "host_osal.h"
+#include "w25x_emu.h"
+
+#define TEST_TASK_ID 1
+#define TEST_IDLE_MS 1000 /* more than W25X_IDLE_TIME */
+#define TEST_SECTOR_SIZE 4096
+#define TEST_SECTOR_NR (W25X_EMU_SIZE / TEST_SECTOR_SIZE)
+#define TEST_MODEL_SECTOR_NR 8
+#define TEST_MODEL_OPS 200000
+
+/* status reads of a command that did not wait for an erase, a wake takes a few */
+#define TEST_WAIT_POLLS 10
+
+/* more than STORAGE_COMMIT_TIME and W25X_WC_DEADLINE */
+#define TEST_COMMIT_MS 660000
+
+#define TEST_CMD_RDSR 0x05
+#define TEST_CMD_ERASE_4K 0x20
+#define TEST_CMD_ERASE_32K 0x52
+#define TEST_CMD_ERASE_64K 0xD8
+#define TEST_CMD_CHIP_ERASE 0xC7
+
+static uint8 test_model[W25X_EMU_SIZE];
+static int test_failed;
+
+static void test_expect(const char *what, bool ok)
+{
+	printf("%-44s %s\n", what, ok ? "ok" : "FAILED");
+	if (!ok)
+		test_failed++;
+}
+
+/*
+ * [ms] of the task, the flash and idle events handled like thermometer.c
+ */
+static void test_run(uint32 ms)
+{
+	uint32 end = host_osal_get_time() + ms;
+	uint16 events;
+
+	while (host_osal_get_time() != end) {
+		host_osal_set_time(host_osal_get_time() + 1);
+		events = host_osal_take_events();
+
+		if ((events & TH_FLASH_EVT) && ther_spi_w25x_poll())
+			ther_storage_ready();
+
+		if (events & TH_FLASH_IDLE_EVT)
+			ther_spi_w25x_idle(ther_storage_idle());
+	}
+}
+
+/*
+ * until the flash has no job, the emulator counts the busy time in
+ * status reads and not in ms
+ */
+static void test_run_flash(void)
+{
+	long ms;
+
+	for (ms = 0; ms < 3600000 && host_osal_timer_left(TH_FLASH_EVT) >= 0; ms++)
+		test_run(1);
+	test_run(TEST_IDLE_MS);
+}
+
+static void test_model_check(void)
+{
+	uint8 buf[64], read_buf[64];
+	long i, bad = 0;
+	uint32 addr, size, k, sector;
+
+	memset(test_model, 0xFF, sizeof(test_model));
+	srand(1);
+
+	for (i = 0; i < TEST_MODEL_OPS; i++) {
+		int op = rand() % 10;
+
+		addr = rand() % (TEST_MODEL_SECTOR_NR * TEST_SECTOR_SIZE);
+		size = 1 + rand() % 40;
+
+		if (op == 0) {
+			if (rand() % 20)
+				continue;
+			sector = addr / TEST_SECTOR_SIZE;
+			flash_dev.erase(sector);
+			memset(test_model + sector * TEST_SECTOR_SIZE, 0xFF, TEST_SECTOR_SIZE);
+		} else if (op < 3) {
+			/* only bytes still erased, the storage never programs twice */
+			for (k = 0; k < size; k++) {
+				if (test_model[addr + k] != 0xFF)
+					break;
+			}
+			if (k != size)
+				continue;
+
+			for (k = 0; k < size; k++)
+				test_model[addr + k] = buf[k] = rand();
+			flash_dev.program(addr, buf, size);
+		} else if (op == 3) {
+			flash_dev.sync();
+		} else {
+			flash_dev.read(addr, read_buf, size);
+			if (memcmp(read_buf, test_model + addr, size))
+				bad++;
+		}
+	}
+	flash_dev.sync();
+
+	if (bad)
+		printf("model: %ld reads differ\n", bad);
+	test_expect("model, random program, erase, read", !bad);
+	test_expect("model, no ignored commands", w25x_emu_get_stat()->violations == 0);
+}
+
+static bool test_erased_only(uint32 sector, uint32 count)
+{
+	uint8 *mem = w25x_emu_mem();
+	uint32 i;
+	bool in;
+
+	for (i = 0; i < W25X_EMU_SIZE; i++) {
+		in = i / TEST_SECTOR_SIZE >= sector && i / TEST_SECTOR_SIZE < sector + count;
+		if (mem[i] != (in ? 0xFF : 0x00))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void test_erase_range(void)
+{
+	static const struct {
+		uint32 sector, count;
+		uint32 erase_4k, erase_32k, erase_64k, chip;
+	} range[] = {
+		{ 3, 40, 8, 2, 1, 0 },
+		{ 0, 128, 0, 0, 0, 1 },
+		{ 16, 16, 0, 0, 1, 0 },
+		{ 127, 1, 1, 0, 0, 0 },
+		{ 1, 126, 14, 2, 6, 0 },
+	};
+	const struct w25x_emu_stat *stat = w25x_emu_get_stat();
+	char what[48];
+	int i;
+
+	for (i = 0; i < sizeof(range) / sizeof(range[0]); i++) {
+		memset(w25x_emu_mem(), 0, W25X_EMU_SIZE);
+		w25x_emu_reset_stat();
+
+		flash_dev.erase_range(range[i].sector, range[i].count);
+		flash_dev.sync();
+
+		snprintf(what, sizeof(what), "erase range [%lu, +%lu]",
+			(unsigned long)range[i].sector, (unsigned long)range[i].count);
+		test_expect(what, test_erased_only(range[i].sector, range[i].count) &&
+			stat->cmd_count[TEST_CMD_ERASE_4K] == range[i].erase_4k &&
+			stat->cmd_count[TEST_CMD_ERASE_32K] == range[i].erase_32k &&
+			stat->cmd_count[TEST_CMD_ERASE_64K] == range[i].erase_64k &&
+			stat->cmd_count[TEST_CMD_CHIP_ERASE] == range[i].chip &&
+			stat->violations == 0);
+	}
+
+	/* the flash event carries the range on */
+	memset(w25x_emu_mem(), 0, W25X_EMU_SIZE);
+	flash_dev.erase_range(1, 126);
+	test_run_flash();
+	test_expect("erase range on the flash events", test_erased_only(1, 126));
+}
+
+/*
+ * a full page while an erase runs is held back, a read waits for the
+ * erase and must send the page before it
+ */
+static void test_flush_pending(void)
+{
+	uint8 page[256], buf[16];
+	uint32 addr = 2 * TEST_SECTOR_SIZE;
+	int i;
+
+	memset(w25x_emu_mem(), 0xFF, W25X_EMU_SIZE);
+	for (i = 0; i < sizeof(page); i++)
+		page[i] = i;
+
+	flash_dev.erase(0);
+	flash_dev.program(addr, page, sizeof(page));
+	flash_dev.read(TEST_SECTOR_SIZE, buf, sizeof(buf));
+	test_expect("held back page, sent after the wait", !memcmp(w25x_emu_mem() + addr, page, sizeof(page)));
+
+	test_run_flash();
+	test_expect("held back page, then powered down", w25x_emu_power_down());
+}
+
+static uint16 test_temp(uint32 time)
+{
+	return 280 + (time * 7 % 40);
+}
+
+static bool test_storage_read(uint32 count)
+{
+	struct storage_cursor cursor;
+	struct storage_record record;
+	uint32 n = 0, last = 0;
+	bool ok = TRUE;
+
+	ther_storage_rewind(&cursor);
+	while (ther_storage_read_next(&cursor, &record)) {
+		if (record.temp != test_temp(record.time) || (n && record.time != last + 5))
+			ok = FALSE;
+		last = record.time;
+		n++;
+	}
+
+	return ok && n == ther_storage_count() && (!count || n == count);
+}
+
+static void test_storage(void)
+{
+	struct storage_wear_stat wear, formatted;
+	uint32 i, time = 0;
+
+	memset(w25x_emu_mem(), 0xFF, W25X_EMU_SIZE);
+	ther_storage_init(&flash_dev);
+
+	for (i = 0; i < 20000; i++) {
+		time += 5;
+		host_osal_set_time(time * 1000);
+		ther_storage_append(STORAGE_TYPE_TEMP, test_temp(time));
+		test_run(100);
+	}
+	ther_storage_flush();
+	test_run_flash();
+	test_expect("storage, flash powered down when idle", w25x_emu_power_down());
+	test_expect("storage, appends", test_storage_read(20000));
+
+	ther_storage_init(&flash_dev);
+	test_expect("storage, mounted from power-down", test_storage_read(20000));
+
+	ther_storage_get_wear(&wear);
+	w25x_emu_reset_stat();
+	ther_storage_format();
+	test_expect("storage, format", ther_storage_count() == 0);
+	test_expect("storage, format does not wait for the erase",
+		flash_dev.busy() && w25x_emu_get_stat()->cmd_count[TEST_CMD_RDSR] < TEST_WAIT_POLLS);
+	test_run_flash();
+	ther_storage_init(&flash_dev);
+	ther_storage_get_wear(&formatted);
+	test_expect("storage, erase counts kept by format", formatted.erase_min == wear.erase_min + 1 &&
+		formatted.erase_max == wear.erase_max + 1 &&
+		formatted.erase_total == wear.erase_total + TEST_SECTOR_NR);
+	for (i = 0; i < 3000; i++) {
+		time += 5;
+		host_osal_set_time(time * 1000);
+		ther_storage_append(STORAGE_TYPE_TEMP, test_temp(time));
+		test_run(10);
+	}
+	ther_storage_flush();
+	test_run_flash();
+	ther_storage_init(&flash_dev);
+	test_expect("storage, appends after format", test_storage_read(3000));
+
+	/* no flush and no more appends, the deadlines commit them */
+	for (i = 0; i < 3; i++) {
+		time += 5;
+		host_osal_set_time(time * 1000);
+		ther_storage_append(STORAGE_TYPE_TEMP, test_temp(time));
+	}
+	test_run(TEST_COMMIT_MS);
+	test_expect("storage, powered down with records waiting", w25x_emu_power_down());
+	ther_storage_init(&flash_dev);
+	test_expect("storage, committed without an append", test_storage_read(3003));
+
+	/* PM3 right after a format and appends, no flash event runs */
+	ther_storage_get_wear(&wear);
+	ther_storage_format();
+	for (i = 0; i < 3; i++) {
+		time += 5;
+		host_osal_set_time(time * 1000);
+		ther_storage_append(STORAGE_TYPE_TEMP, test_temp(time));
+	}
+	ther_storage_sync();
+	ther_spi_w25x_power_off();
+	test_expect("power off, flash powered down", w25x_emu_power_down() && !flash_dev.busy());
+	ther_storage_init(&flash_dev);
+	ther_storage_get_wear(&formatted);
+	test_expect("power off, records on the flash", test_storage_read(3));
+	test_expect("power off, erase counts on the flash",
+		formatted.erase_total == wear.erase_total + TEST_SECTOR_NR);
+	test_expect("storage, no ignored commands", w25x_emu_get_stat()->violations == 0);
+}
+
+/* sectors erased for the pool: the magic erased, the erase count programmed */
+static int test_spare_sectors(void)
+{
+	uint8 *mem = w25x_emu_mem();
+	uint32 count;
+	int sector, n = 0;
+
+	for (sector = 0; sector < TEST_SECTOR_NR; sector++, mem += TEST_SECTOR_SIZE) {
+		memcpy(&count, mem + 6, sizeof(count));
+		if (mem[0] == 0xFF && mem[1] == 0xFF && count != 0xFFFFFFFF)
+			n++;
+	}
+
+	return n;
+}
+
+/*
+ * an append while the idle event erases ahead buffers its bytes, it does
+ * not wait for the erase
+ */
+static void test_erase_ahead(void)
+{
+	const struct w25x_emu_stat *st = w25x_emu_get_stat();
+	uint32 i, time = 1000000;
+	int spare;
+
+	memset(w25x_emu_mem(), 0xFF, W25X_EMU_SIZE);
+	ther_storage_init(&flash_dev);
+	for (i = 0; i < 10; i++) {
+		time += 5;
+		host_osal_set_time(time * 1000);
+		ther_storage_append(STORAGE_TYPE_TEMP, test_temp(time));
+	}
+	ther_storage_flush();
+	test_run_flash();
+
+	/* the pool is not kept across a mount */
+	ther_storage_init(&flash_dev);
+	spare = test_spare_sectors();
+	ther_storage_idle();
+
+	w25x_emu_reset_stat();
+	time += 5;
+	host_osal_set_time(time * 1000);
+	ther_storage_append(STORAGE_TYPE_TEMP, test_temp(time));
+	test_expect("erase ahead, the append does not wait",
+		flash_dev.busy() && st->cmd_count[TEST_CMD_RDSR] == 0);
+
+	ther_storage_flush();
+	test_run_flash();
+	test_expect("erase ahead, the pool counted", test_spare_sectors() == spare + 2);
+
+	ther_storage_init(&flash_dev);
+	test_expect("erase ahead, the appends", test_storage_read(11));
+	test_expect("erase ahead, no ignored commands", st->violations == 0);
+}
+
+int main(void)
+{
+	w25x_emu_init(NULL);
+	if (ther_spi_w25x_init(TEST_TASK_ID) != FL_EOK) {
+		printf("no flash on the bus\n");
+		return 1;
+	}
+
+	test_model_check();
+	test_erase_range();
+	test_flush_pending();
+	test_storage();
+	test_erase_ahead();
+
+	printf("%s\n", test_failed ? "FAILED" : "passed");
+
+	return test_failed != 0;
+}